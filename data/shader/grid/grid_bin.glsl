@@ -0,0 +1,153 @@
+#version 430
+
+// Bins the triangles into the cells of a dense grid, either counting the
+// triangles of every cell or scattering their indices. Mirrors
+// `forTriangleCells()` in `grid.cpp` operation by operation, `precise`
+// keeps the compiler from fusing or reordering them so the cells match
+// the CPU build.
+
+layout (local_size_x = 64) in;
+
+struct Triangle
+{
+	vec4 P[3];
+};
+
+layout (std140, binding=0) uniform Uniform
+{
+	// xyz: grid base, w: cell size
+	vec4 u_Base;
+	// x: inverse cell size, y: padding, z: half size of the padded cells
+	vec4 u_Cell;
+	// xyz: cells along each axis, w: number of triangles
+	ivec4 u_Size;
+	// x: 0 counts, 1 scatters
+	ivec4 u_Pass;
+};
+
+layout (std430, binding=0) buffer Triangles
+{
+	Triangle b_Triangles[];
+};
+
+layout (std430, binding=1) buffer Counts
+{
+	uint b_Counts[];
+};
+
+layout (std430, binding=2) buffer Cursors
+{
+	uint b_Cursors[];
+};
+
+layout (std430, binding=3) buffer CellTriangles
+{
+	uint b_CellTriangles[];
+};
+
+const int NumAxes = 13;
+
+vec3 preciseCross(vec3 a, vec3 b)
+{
+	precise vec3 r;
+	r.x = a.y * b.z - a.z * b.y;
+	r.y = a.z * b.x - a.x * b.z;
+	r.z = a.x * b.y - a.y * b.x;
+	return r;
+}
+
+float preciseDot(vec3 a, vec3 b)
+{
+	precise float r = a.x * b.x + a.y * b.y + a.z * b.z;
+	return r;
+}
+
+int clampCell(float v, int size)
+{
+	return clamp(int(floor(v)), 0, size - 1);
+}
+
+void main()
+{
+	uint id = gl_GlobalInvocationID.x + gl_GlobalInvocationID.y * gl_NumWorkGroups.x * gl_WorkGroupSize.x;
+	if (id >= uint(u_Size.w))
+		return;
+
+	vec3 a = b_Triangles[id].P[0].xyz;
+	vec3 b = b_Triangles[id].P[1].xyz;
+	vec3 c = b_Triangles[id].P[2].xyz;
+
+	float cellSize = u_Base.w;
+	float invCellSize = u_Cell.x;
+	float pad = u_Cell.y;
+	float halfSize = u_Cell.z;
+
+	// Inclusive range of cells whose padded bounds overlap the triangle
+	ivec3 lo, hi;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float tmin = min(a[axis], min(b[axis], c[axis]));
+		float tmax = max(a[axis], max(b[axis], c[axis]));
+		precise float l = ceil((tmin - pad - u_Base[axis]) * invCellSize - 1.0);
+		precise float h = (tmax + pad - u_Base[axis]) * invCellSize;
+		lo[axis] = clampCell(l, u_Size[axis]);
+		hi[axis] = clampCell(h, u_Size[axis]);
+	}
+
+	// Separating axes, see `SetupTriangleBoxAxes()`
+	precise vec3 e0 = b - a;
+	precise vec3 e1 = c - b;
+	precise vec3 e2 = a - c;
+
+	vec3 axes[NumAxes];
+	axes[0] = vec3(1.0, 0.0, 0.0);
+	axes[1] = vec3(0.0, 1.0, 0.0);
+	axes[2] = vec3(0.0, 0.0, 1.0);
+	axes[3] = preciseCross(e0, e1);
+	for (int axisI = 0; axisI < 3; axisI++)
+	{
+		axes[4 + axisI * 3 + 0] = preciseCross(axes[axisI], e0);
+		axes[4 + axisI * 3 + 1] = preciseCross(axes[axisI], e1);
+		axes[4 + axisI * 3 + 2] = preciseCross(axes[axisI], e2);
+	}
+
+	float axisLo[NumAxes], axisHi[NumAxes];
+	for (int i = 0; i < NumAxes; i++)
+	{
+		vec3 axis = axes[i];
+		float pa = preciseDot(axis, a);
+		float pb = preciseDot(axis, b);
+		float pc = preciseDot(axis, c);
+		float r = preciseDot(abs(axis), vec3(halfSize));
+		precise float l = min(pa, min(pb, pc)) - r;
+		precise float h = max(pa, max(pb, pc)) + r;
+		axisLo[i] = l;
+		axisHi[i] = h;
+	}
+
+	for (int z = lo.z; z <= hi.z; z++)
+	for (int y = lo.y; y <= hi.y; y++)
+	for (int x = lo.x; x <= hi.x; x++)
+	{
+		precise vec3 center;
+		center.x = u_Base.x + (float(x) + 0.5) * cellSize;
+		center.y = u_Base.y + (float(y) + 0.5) * cellSize;
+		center.z = u_Base.z + (float(z) + 0.5) * cellSize;
+
+		// Same order as `IntersectAABBs8vTriangle()`, no fusing
+		bool hit = true;
+		for (int i = 0; i < NumAxes && hit; i++)
+		{
+			precise float d = axes[i].x * center.x + axes[i].y * center.y + axes[i].z * center.z;
+			hit = d >= axisLo[i] && d <= axisHi[i];
+		}
+		if (!hit)
+			continue;
+
+		uint cell = uint(x + (y + z * u_Size.y) * u_Size.x);
+		if (u_Pass.x == 0)
+			atomicAdd(b_Counts[cell], 1u);
+		else
+			b_CellTriangles[atomicAdd(b_Cursors[cell], 1u)] = id;
+	}
+}
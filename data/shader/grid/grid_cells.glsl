@@ -0,0 +1,55 @@
+#version 430
+
+// Sorts the triangles of every cell back to ascending order after the
+// atomic scatter of `grid_bin.glsl` and writes the cell ranges.
+
+layout (local_size_x = 64) in;
+
+layout (std140, binding=0) uniform Uniform
+{
+	vec4 u_Base;
+	vec4 u_Cell;
+	// xyz: cells along each axis
+	ivec4 u_Size;
+	ivec4 u_Pass;
+};
+
+// Scanned counts, cell `c` is [b_Counts[c], b_Counts[c + 1])
+layout (std430, binding=1) buffer Counts
+{
+	uint b_Counts[];
+};
+
+layout (std430, binding=3) buffer CellTriangles
+{
+	uint b_CellTriangles[];
+};
+
+// First, end, count and capacity
+layout (std430, binding=4) buffer Cells
+{
+	ivec4 b_Cells[];
+};
+
+void main()
+{
+	uint id = gl_GlobalInvocationID.x + gl_GlobalInvocationID.y * gl_NumWorkGroups.x * gl_WorkGroupSize.x;
+	if (id >= uint(u_Size.x * u_Size.y * u_Size.z))
+		return;
+
+	uint first = b_Counts[id];
+	uint end = b_Counts[id + 1u];
+
+	// Cells hold a handful of triangles, an insertion sort is enough
+	for (uint i = first + 1u; i < end; i++)
+	{
+		uint v = b_CellTriangles[i];
+		uint j = i;
+		for (; j > first && b_CellTriangles[j - 1u] > v; j--)
+			b_CellTriangles[j] = b_CellTriangles[j - 1u];
+		b_CellTriangles[j] = v;
+	}
+
+	int num = int(end - first);
+	b_Cells[id] = ivec4(int(first), int(end), num, num);
+}
@@ -0,0 +1,117 @@
+#version 430
+
+// Counts the particles in every grid cell for the bucketed simulation.
+// Particles outside of the occupied cells go to the last bucket.
+
+layout (local_size_x = 64) in;
+
+struct Particle
+{
+	vec4 PositionAndLifetime;
+	vec4 Velocity;
+};
+
+// Matches `GridHashSlot`, empty slots have a negative `CoordAndCell.w`
+struct HashSlot
+{
+	ivec4 CoordAndCell;
+};
+
+layout (std140, binding=0) uniform Uniform
+{
+	ivec4 u_Counts;
+	vec4 u_GridBase;
+	vec4 u_InvGridSize;
+	vec4 u_Dt;
+	vec4 u_Gravity;
+	// x: sparse grid, y: hash table mask, z: max probes
+	ivec4 u_Hash;
+	// x: buckets including the outside one, y: first element of the work
+	// items in `b_Buckets`, z: particles per work item
+	ivec4 u_Buckets;
+};
+
+layout (std430, binding=0) buffer Particles
+{
+	Particle b_Particles[];
+};
+
+// Bucket and rank within the bucket of every particle
+layout (std430, binding=2) buffer ParticleBuckets
+{
+	uvec2 b_ParticleBuckets[];
+};
+
+layout (std430, binding=4) buffer Counters
+{
+	uint b_Count;
+	uint b_Next;
+	uint b_Zero;
+};
+
+layout (std430, binding=5) buffer HashTable
+{
+	HashSlot b_HashTable[];
+};
+
+// Per bucket counts, scanned into offsets, followed by the work items:
+// (bucket, first particle within the bucket) pairs.
+layout (std430, binding=7) buffer Buckets
+{
+	uint b_NumWork;
+	uint b_SimArgs[3];
+	uint b_Buckets[];
+};
+
+// Same as `GridHash()` in `grid.h`
+uint HashCell(ivec3 cell)
+{
+	uvec3 c = uvec3(cell);
+	return (c.x * 73856093u) ^ (c.y * 19349663u) ^ (c.z * 83492791u);
+}
+
+// Index into `b_Cells` or -1 if the cell has no triangles
+int LookupCell(ivec3 cell)
+{
+	if (any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, u_Counts.xyz)))
+		return -1;
+
+	if (u_Hash.x == 0)
+		return (cell.z * u_Counts.y + cell.y) * u_Counts.x + cell.x;
+
+	// Most lookups in open space end at an empty first slot
+	uint mask = uint(u_Hash.y);
+	uint slot = HashCell(cell) & mask;
+	for (int i = 0; i < u_Hash.z; i++)
+	{
+		ivec4 s = b_HashTable[slot].CoordAndCell;
+		if (s.w < 0)
+			return -1;
+		if (s.xyz == cell)
+			return s.w;
+		slot = (slot + 1u) & mask;
+	}
+	return -1;
+}
+
+void main()
+{
+	uint id = gl_GlobalInvocationID.x;
+	if (id >= b_Count)
+		return;
+
+	vec3 pos = b_Particles[id].PositionAndLifetime.xyz;
+	int cellIx = LookupCell(ivec3(floor((pos - u_GridBase.xyz) * u_InvGridSize.xyz)));
+	uint bucket = cellIx >= 0 ? uint(cellIx) : uint(u_Buckets.x - 1);
+
+	uint rank = atomicAdd(b_Buckets[bucket], 1u);
+	b_ParticleBuckets[id] = uvec2(bucket, rank);
+
+	// Big buckets are split into several work items
+	if (rank % uint(u_Buckets.z) == 0u)
+	{
+		uint work = atomicAdd(b_NumWork, 1u);
+		b_Buckets[u_Buckets.y + work * 2u + 0u] = bucket;
+		b_Buckets[u_Buckets.y + work * 2u + 1u] = rank;
+	}
+}
@@ -0,0 +1,63 @@
+#version 430
+
+// Moves every particle to its bucket, `b_Buckets` holds the scanned counts
+
+layout (local_size_x = 64) in;
+
+struct Particle
+{
+	vec4 PositionAndLifetime;
+	vec4 Velocity;
+};
+
+layout (std430, binding=0) buffer Particles
+{
+	Particle b_Particles[];
+};
+
+// Bucket and rank within the bucket of every particle
+layout (std430, binding=2) buffer ParticleBuckets
+{
+	uvec2 b_ParticleBuckets[];
+};
+
+layout (std430, binding=3) buffer OutParticles
+{
+	Particle b_OutParticles[];
+};
+
+layout (std430, binding=4) buffer Counters
+{
+	uint b_Count;
+	uint b_Next;
+	uint b_Zero;
+};
+
+// Per bucket counts, scanned into offsets, followed by the work items:
+// (bucket, first particle within the bucket) pairs.
+layout (std430, binding=7) buffer Buckets
+{
+	uint b_NumWork;
+	uint b_SimArgs[3];
+	uint b_Buckets[];
+};
+
+void main()
+{
+	uint id = gl_GlobalInvocationID.x;
+
+	// Indirect arguments of the simulation, a group per work item up to the
+	// dispatch limit, the groups loop over the rest.
+	if (id == 0u)
+	{
+		b_SimArgs[0] = min(b_NumWork, 65535u);
+		b_SimArgs[1] = 1u;
+		b_SimArgs[2] = 1u;
+	}
+
+	if (id >= b_Count)
+		return;
+
+	uvec2 bucket = b_ParticleBuckets[id];
+	b_OutParticles[b_Buckets[bucket.x] + bucket.y] = b_Particles[id];
+}
@@ -0,0 +1,344 @@
+#version 430
+
+// Simulation over the particles sorted by `bucket_scatter.glsl`. Every
+// workgroup takes a run of particles of one cell and loads the triangles of
+// that cell to shared memory once for all of them.
+
+layout (local_size_x = 64) in;
+
+const uint TileSize = 64u;
+
+// Matches `GpuTriangle`, the unit normal is in the w components
+struct Triangle
+{
+	vec4 AAndNormalX;
+	vec4 E0AndNormalY;
+	vec4 E1AndNormalZ;
+};
+
+struct Particle
+{
+	vec4 PositionAndLifetime;
+	vec4 Velocity;
+};
+
+struct Cell
+{
+	ivec4 Offsets;
+};
+
+// Matches `GridHashSlot`, empty slots have a negative `CoordAndCell.w`
+struct HashSlot
+{
+	ivec4 CoordAndCell;
+};
+
+layout (std140, binding=0) uniform Uniform
+{
+	ivec4 u_Counts;
+	vec4 u_GridBase;
+	vec4 u_InvGridSize;
+	vec4 u_Dt;
+	vec4 u_Gravity;
+	// x: sparse grid, y: hash table mask, z: max probes
+	ivec4 u_Hash;
+	// x: buckets including the outside one, y: first element of the work
+	// items in `b_Buckets`, z: particles per work item
+	ivec4 u_Buckets;
+};
+
+layout (std430, binding=0) buffer Particles
+{
+	Particle b_Particles[];
+};
+
+layout (std430, binding=1) buffer Triangles
+{
+	Triangle b_Triangles[];
+};
+
+layout (std430, binding=2) buffer Cells
+{
+	Cell b_Cells[];
+};
+
+// Cells are ranges of indices into `b_Triangles`
+layout (std430, binding=6) buffer CellTriangles
+{
+	uint b_CellTriangles[];
+};
+
+layout (std430, binding=3) buffer OutParticles
+{
+	Particle b_OutParticles[];
+};
+
+layout (std430, binding=4) buffer Counters
+{
+	uint b_Count;
+	uint b_Next;
+	uint b_Zero;
+};
+
+layout (std430, binding=5) buffer HashTable
+{
+	HashSlot b_HashTable[];
+};
+
+// Scanned per bucket offsets followed by the work items
+layout (std430, binding=7) buffer Buckets
+{
+	uint b_NumWork;
+	uint b_SimArgs[3];
+	uint b_Buckets[];
+};
+
+shared vec4 s_Triangles[TileSize * 3u];
+
+bool IntersectRayTriangle(vec3 ro, vec3 rd, vec3 a, vec3 e0, vec3 e1, out float outT)
+{
+	vec3 p = cross(rd, e1);
+	float det = dot(e0, p);
+
+	if (abs(det) < 0.0001)
+		return false;
+
+	float invDet = 1.0 / det;
+
+	vec3 t = ro - a;
+	float u = dot(t, p) * invDet;
+
+	vec3 q = cross(t, e0);
+	float v = dot(rd, q) * invDet;
+
+	if (min(u, min(v, 1.0 - u - v)) < 0.0)
+		return false;
+
+	outT = dot(e1, q) * invDet;
+	return true;
+}
+
+// Same as `GridHash()` in `grid.h`
+uint HashCell(ivec3 cell)
+{
+	uvec3 c = uvec3(cell);
+	return (c.x * 73856093u) ^ (c.y * 19349663u) ^ (c.z * 83492791u);
+}
+
+// Index into `b_Cells` or -1 if the cell has no triangles
+int LookupCell(ivec3 cell)
+{
+	if (any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, u_Counts.xyz)))
+		return -1;
+
+	if (u_Hash.x == 0)
+		return (cell.z * u_Counts.y + cell.y) * u_Counts.x + cell.x;
+
+	// Most lookups in open space end at an empty first slot
+	uint mask = uint(u_Hash.y);
+	uint slot = HashCell(cell) & mask;
+	for (int i = 0; i < u_Hash.z; i++)
+	{
+		ivec4 s = b_HashTable[slot].CoordAndCell;
+		if (s.w < 0)
+			return -1;
+		if (s.xyz == cell)
+			return s.w;
+		slot = (slot + 1u) & mask;
+	}
+	return -1;
+}
+
+// Closest hit in [tMin, tMax] against the triangles of a cell
+bool IntersectCell(int cellIx, vec3 ro, vec3 rd, float tMin, float tMax, out float outT, out vec3 outNormal)
+{
+	Cell cell = b_Cells[cellIx];
+
+	bool hit = false;
+	outT = tMax;
+	for (int i = cell.Offsets.x; i < cell.Offsets.y; i++)
+	{
+		Triangle t = b_Triangles[b_CellTriangles[i]];
+
+		float tt;
+		if (IntersectRayTriangle(ro, rd, t.AAndNormalX.xyz, t.E0AndNormalY.xyz, t.E1AndNormalZ.xyz, tt) && tt >= tMin && tt <= outT)
+		{
+			outT = tt;
+			outNormal = vec3(t.AAndNormalX.w, t.E0AndNormalY.w, t.E1AndNormalZ.w);
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+// Walks the cells crossed by the segment [ro, ro + rd * len] in order
+// (Amanatides & Woo) and stops in the first cell with a hit, the first
+// `skipCells` cells are not tested. Triangles are
+// listed in every cell they overlap, so a hit only counts in the cell that
+// contains it, otherwise a closer hit in a later cell could be missed.
+bool TraceGrid(vec3 ro, vec3 rd, float len, int skipCells, out float outT, out vec3 outNormal)
+{
+	// Grid space, cells are unit cubes and the grid is [0, u_Counts)
+	vec3 gro = (ro - u_GridBase.xyz) * u_InvGridSize.xyz;
+	vec3 grd = rd * u_InvGridSize.xyz;
+	grd = mix(grd, vec3(1e-20), lessThan(abs(grd), vec3(1e-20)));
+	vec3 invRd = 1.0 / grd;
+
+	// Clip the segment to the grid
+	vec3 t0 = -gro * invRd;
+	vec3 t1 = (vec3(u_Counts.xyz) - gro) * invRd;
+	vec3 tNear = min(t0, t1);
+	vec3 tFar = max(t0, t1);
+	float tEnter = max(max(tNear.x, tNear.y), max(tNear.z, 0.0));
+	float tLeave = min(min(tFar.x, tFar.y), min(tFar.z, len));
+	if (tEnter > tLeave)
+		return false;
+
+	ivec3 cell = clamp(ivec3(floor(gro + grd * tEnter)), ivec3(0), u_Counts.xyz - 1);
+	ivec3 stepDir = ivec3(sign(grd));
+	vec3 tNext = (vec3(cell) + vec3(greaterThan(stepDir, ivec3(0))) - gro) * invRd;
+	vec3 tDelta = abs(invRd);
+
+	int maxSteps = u_Counts.x + u_Counts.y + u_Counts.z;
+	for (int i = 0; i < maxSteps; i++)
+	{
+		float tExit = min(min(tNext.x, tNext.y), tNext.z);
+
+		int cellIx = i >= skipCells ? LookupCell(cell) : -1;
+		if (cellIx >= 0 && IntersectCell(cellIx, ro, rd, 0.0, min(tExit, len), outT, outNormal))
+			return true;
+
+		if (tExit >= tLeave)
+			break;
+
+		if (tNext.x == tExit)
+		{
+			cell.x += stepDir.x;
+			tNext.x += tDelta.x;
+		}
+		else if (tNext.y == tExit)
+		{
+			cell.y += stepDir.y;
+			tNext.y += tDelta.y;
+		}
+		else
+		{
+			cell.z += stepDir.z;
+			tNext.z += tDelta.z;
+		}
+	}
+
+	return false;
+}
+
+// Distance to where the segment leaves the cell containing `ro`
+float FirstCellExit(vec3 ro, vec3 rd, float len)
+{
+	vec3 gro = (ro - u_GridBase.xyz) * u_InvGridSize.xyz;
+	vec3 grd = rd * u_InvGridSize.xyz;
+	grd = mix(grd, vec3(1e-20), lessThan(abs(grd), vec3(1e-20)));
+
+	vec3 cell = floor(gro);
+	vec3 tNext = (cell + vec3(greaterThan(grd, vec3(0.0))) - gro) / grd;
+	return min(min(tNext.x, tNext.y), min(tNext.z, len));
+}
+
+void main()
+{
+	uint lane = gl_LocalInvocationID.x;
+	uint outsideBucket = uint(u_Buckets.x - 1);
+	uint numWork = b_NumWork;
+
+	for (uint work = gl_WorkGroupID.x; work < numWork; work += gl_NumWorkGroups.x)
+	{
+		uint bucket = b_Buckets[u_Buckets.y + work * 2u + 0u];
+		uint first = b_Buckets[bucket] + b_Buckets[u_Buckets.y + work * 2u + 1u];
+		uint last = min(first + uint(u_Buckets.z), b_Buckets[bucket + 1u]);
+
+		// Particles outside of the occupied cells walk the whole grid
+		int triBegin = 0, triEnd = 0;
+		int skipCells = 0;
+		if (bucket != outsideBucket)
+		{
+			Cell cell = b_Cells[bucket];
+			triBegin = cell.Offsets.x;
+			triEnd = cell.Offsets.y;
+			skipCells = 1;
+		}
+
+		for (uint base = first; base < last; base += TileSize)
+		{
+			uint id = base + lane;
+			bool inRange = id < last;
+
+			Particle particle = b_Particles[min(id, last - 1u)];
+
+			float life = particle.PositionAndLifetime.w - u_Dt.x;
+			vec3 pos = particle.PositionAndLifetime.xyz;
+			vec3 newPos = pos + particle.Velocity.xyz * u_Dt.x;
+			vec3 newVel = particle.Velocity.xyz + u_Gravity.xyz;
+
+			vec3 delta = newPos - pos;
+			vec3 dir = normalize(delta);
+			float dlen = length(delta);
+			bool moving = inRange && dlen > 0.0;
+
+			// Closest hit in the bucket cell, the triangles are shared by the
+			// whole workgroup
+			float tt = moving ? FirstCellExit(pos, dir, dlen) : 0.0;
+			vec3 n;
+			bool hit = false;
+			for (int tileBase = triBegin; tileBase < triEnd; tileBase += int(TileSize))
+			{
+				int tileI = tileBase + int(lane);
+				barrier();
+				if (tileI < triEnd)
+				{
+					Triangle t = b_Triangles[b_CellTriangles[tileI]];
+					s_Triangles[lane * 3u + 0u] = t.AAndNormalX;
+					s_Triangles[lane * 3u + 1u] = t.E0AndNormalY;
+					s_Triangles[lane * 3u + 2u] = t.E1AndNormalZ;
+				}
+				memoryBarrierShared();
+				barrier();
+
+				int num = min(int(TileSize), triEnd - tileBase);
+				for (int i = 0; moving && i < num; i++)
+				{
+					vec4 a = s_Triangles[i * 3 + 0];
+					vec4 e0 = s_Triangles[i * 3 + 1];
+					vec4 e1 = s_Triangles[i * 3 + 2];
+
+					float t;
+					if (IntersectRayTriangle(pos, dir, a.xyz, e0.xyz, e1.xyz, t) && t >= 0.0 && t <= tt)
+					{
+						tt = t;
+						n = vec3(a.w, e0.w, e1.w);
+						hit = true;
+					}
+				}
+			}
+
+			if (!inRange)
+				continue;
+
+			// Rest of the step in the following cells from global memory
+			if (!hit && moving)
+				hit = TraceGrid(pos, dir, dlen, skipCells, tt, n);
+
+			if (hit)
+			{
+				newPos = pos;
+				newVel = (newVel - n * 2.0 * dot(newVel, n)) * 0.7;
+			}
+
+			// Append the survivors to the other buffer
+			if (life <= 0.0)
+				continue;
+
+			uint outIx = atomicAdd(b_Next, 1);
+			b_OutParticles[outIx].PositionAndLifetime = vec4(newPos, life);
+			b_OutParticles[outIx].Velocity = vec4(newVel, 0.0);
+		}
+	}
+}
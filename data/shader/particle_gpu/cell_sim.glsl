@@ -2,9 +2,12 @@
 
 layout (local_size_x = 64) in;
 
+// Matches `GpuTriangle`, the unit normal is in the w components
 struct Triangle
 {
-	vec4 A, B, C;
+	vec4 AAndNormalX;
+	vec4 E0AndNormalY;
+	vec4 E1AndNormalZ;
 };
 
 struct Particle
@@ -18,14 +21,21 @@ struct Cell
 	ivec4 Offsets;
 };
 
+// Matches `GridHashSlot`, empty slots have a negative `CoordAndCell.w`
+struct HashSlot
+{
+	ivec4 CoordAndCell;
+};
+
 layout (std140, binding=0) uniform Uniform
 {
 	ivec4 u_Counts;
-	ivec4 u_Copy;
 	vec4 u_GridBase;
 	vec4 u_InvGridSize;
 	vec4 u_Dt;
 	vec4 u_Gravity;
+	// x: sparse grid, y: hash table mask, z: max probes
+	ivec4 u_Hash;
 };
 
 layout (std430, binding=0) buffer Particles
@@ -43,11 +53,31 @@ layout (std430, binding=2) buffer Cells
 	Cell b_Cells[];
 };
 
-bool IntersectRayTriangle(vec3 ro, vec3 rd, vec3 a, vec3 b, vec3 c, out float outT)
+// Cells are ranges of indices into `b_Triangles`
+layout (std430, binding=6) buffer CellTriangles
+{
+	uint b_CellTriangles[];
+};
+
+layout (std430, binding=3) buffer OutParticles
+{
+	Particle b_OutParticles[];
+};
+
+layout (std430, binding=4) buffer Counters
 {
-	vec3 e0 = b - a;
-	vec3 e1 = c - a;
+	uint b_Count;
+	uint b_Next;
+	uint b_Zero;
+};
 
+layout (std430, binding=5) buffer HashTable
+{
+	HashSlot b_HashTable[];
+};
+
+bool IntersectRayTriangle(vec3 ro, vec3 rd, vec3 a, vec3 e0, vec3 e1, out float outT)
+{
 	vec3 p = cross(rd, e1);
 	float det = dot(e0, p);
 
@@ -69,9 +99,123 @@ bool IntersectRayTriangle(vec3 ro, vec3 rd, vec3 a, vec3 b, vec3 c, out float ou
 	return true;
 }
 
+// Same as `GridHash()` in `grid.h`
+uint HashCell(ivec3 cell)
+{
+	uvec3 c = uvec3(cell);
+	return (c.x * 73856093u) ^ (c.y * 19349663u) ^ (c.z * 83492791u);
+}
+
+// Index into `b_Cells` or -1 if the cell has no triangles
+int LookupCell(ivec3 cell)
+{
+	if (any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, u_Counts.xyz)))
+		return -1;
+
+	if (u_Hash.x == 0)
+		return (cell.z * u_Counts.y + cell.y) * u_Counts.x + cell.x;
+
+	// Most lookups in open space end at an empty first slot
+	uint mask = uint(u_Hash.y);
+	uint slot = HashCell(cell) & mask;
+	for (int i = 0; i < u_Hash.z; i++)
+	{
+		ivec4 s = b_HashTable[slot].CoordAndCell;
+		if (s.w < 0)
+			return -1;
+		if (s.xyz == cell)
+			return s.w;
+		slot = (slot + 1u) & mask;
+	}
+	return -1;
+}
+
+// Closest hit in [tMin, tMax] against the triangles of a cell
+bool IntersectCell(int cellIx, vec3 ro, vec3 rd, float tMin, float tMax, out float outT, out vec3 outNormal)
+{
+	Cell cell = b_Cells[cellIx];
+
+	bool hit = false;
+	outT = tMax;
+	for (int i = cell.Offsets.x; i < cell.Offsets.y; i++)
+	{
+		Triangle t = b_Triangles[b_CellTriangles[i]];
+
+		float tt;
+		if (IntersectRayTriangle(ro, rd, t.AAndNormalX.xyz, t.E0AndNormalY.xyz, t.E1AndNormalZ.xyz, tt) && tt >= tMin && tt <= outT)
+		{
+			outT = tt;
+			outNormal = vec3(t.AAndNormalX.w, t.E0AndNormalY.w, t.E1AndNormalZ.w);
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+// Walks the cells crossed by the segment [ro, ro + rd * len] in order
+// (Amanatides & Woo) and stops in the first cell with a hit. Triangles are
+// listed in every cell they overlap, so a hit only counts in the cell that
+// contains it, otherwise a closer hit in a later cell could be missed.
+bool TraceGrid(vec3 ro, vec3 rd, float len, out float outT, out vec3 outNormal)
+{
+	// Grid space, cells are unit cubes and the grid is [0, u_Counts)
+	vec3 gro = (ro - u_GridBase.xyz) * u_InvGridSize.xyz;
+	vec3 grd = rd * u_InvGridSize.xyz;
+	grd = mix(grd, vec3(1e-20), lessThan(abs(grd), vec3(1e-20)));
+	vec3 invRd = 1.0 / grd;
+
+	// Clip the segment to the grid
+	vec3 t0 = -gro * invRd;
+	vec3 t1 = (vec3(u_Counts.xyz) - gro) * invRd;
+	vec3 tNear = min(t0, t1);
+	vec3 tFar = max(t0, t1);
+	float tEnter = max(max(tNear.x, tNear.y), max(tNear.z, 0.0));
+	float tLeave = min(min(tFar.x, tFar.y), min(tFar.z, len));
+	if (tEnter > tLeave)
+		return false;
+
+	ivec3 cell = clamp(ivec3(floor(gro + grd * tEnter)), ivec3(0), u_Counts.xyz - 1);
+	ivec3 stepDir = ivec3(sign(grd));
+	vec3 tNext = (vec3(cell) + vec3(greaterThan(stepDir, ivec3(0))) - gro) * invRd;
+	vec3 tDelta = abs(invRd);
+
+	int maxSteps = u_Counts.x + u_Counts.y + u_Counts.z;
+	for (int i = 0; i < maxSteps; i++)
+	{
+		float tExit = min(min(tNext.x, tNext.y), tNext.z);
+
+		int cellIx = LookupCell(cell);
+		if (cellIx >= 0 && IntersectCell(cellIx, ro, rd, 0.0, min(tExit, len), outT, outNormal))
+			return true;
+
+		if (tExit >= tLeave)
+			break;
+
+		if (tNext.x == tExit)
+		{
+			cell.x += stepDir.x;
+			tNext.x += tDelta.x;
+		}
+		else if (tNext.y == tExit)
+		{
+			cell.y += stepDir.y;
+			tNext.y += tDelta.y;
+		}
+		else
+		{
+			cell.z += stepDir.z;
+			tNext.z += tDelta.z;
+		}
+	}
+
+	return false;
+}
+
 void main()
 {
 	int id = int(gl_GlobalInvocationID.x);
+	if (uint(id) >= b_Count)
+		return;
 
 	Particle particle = b_Particles[id];
 
@@ -84,33 +228,21 @@ void main()
 	vec3 dir = normalize(delta);
 	float dlen = length(delta);
 
-	ivec3 cell = ivec3((pos - u_GridBase.xyz) * u_InvGridSize.xyz);
-	if (cell.x >= 0 && cell.y >= 0 && cell.z >= 0
-		&& cell.x < u_Counts.x && cell.y < u_Counts.y && cell.z < u_Counts.z)
+	float tt;
+	vec3 n;
+	if (dlen > 0.0 && TraceGrid(pos, dir, dlen, tt, n))
 	{
-		int cellIx = (cell.z * u_Counts.y + cell.y) * u_Counts.x + cell.x;
-		Cell cell = b_Cells[cellIx];
-
-		for (int i = cell.Offsets.x; i < cell.Offsets.y; i++)
-		{
-			Triangle t = b_Triangles[i];
-
-			float tt;
-			if (IntersectRayTriangle(pos, dir, t.A.xyz, t.B.xyz, t.C.xyz, tt) && tt >= 0.0 && tt < dlen)
-			{
-				vec3 n = normalize(cross(t.B.xyz - t.A.xyz, t.C.xyz - t.A.xyz));
-				newPos = pos;
-				newVel = (newVel - n * 2.0 * dot(newVel, n)) * 0.7;
-
-				// Force break
-				i = cell.Offsets.y;
-				break;
-			}
-		}
+		newPos = pos;
+		newVel = (newVel - n * 2.0 * dot(newVel, n)) * 0.7;
 	}
 
-	b_Particles[id].PositionAndLifetime = vec4(newPos, life);
-	b_Particles[id].Velocity = vec4(newVel, 0.0);
+	// Append the survivors to the other buffer
+	if (life <= 0.0)
+		return;
+
+	uint outIx = atomicAdd(b_Next, 1);
+	b_OutParticles[outIx].PositionAndLifetime = vec4(newPos, life);
+	b_OutParticles[outIx].Velocity = vec4(newVel, 0.0);
 }
 
 
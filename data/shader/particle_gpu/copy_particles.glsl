@@ -8,30 +8,53 @@ struct Particle
 	vec4 Velocity;
 };
 
+layout (std140, binding=0) uniform Uniform
+{
+	// x: new particles, y: capacity of `b_Particles`
+	ivec4 u_Copy;
+};
+
 layout (std430, binding=0) buffer Particles
 {
 	Particle b_Particles[];
 };
 
+// Tightly packed `Particle` structs from the CPU: position, velocity and
+// lifetime, 7 floats each.
 layout (std430, binding=1) buffer NewParticles
 {
-	Particle b_NewParticles[];
+	float b_NewParticles[];
 };
 
-layout (std140, binding=0) uniform Uniform
+layout (std430, binding=4) buffer Counters
 {
-	ivec4 u_Counts;
-	ivec4 u_Copy;
-	vec4 u_GridBase;
-	vec4 u_InvGridSize;
-	vec4 u_Dt;
-	vec4 u_Gravity;
+	uint b_Count;
+	uint b_Next;
+	uint b_Zero;
+	uint b_Overflow;
 };
 
 void main()
 {
 	int id = int(gl_GlobalInvocationID.x);
-	if (id < u_Copy.y)
-		b_Particles[u_Copy.x + id] = b_NewParticles[id];
-}
+	if (id >= u_Copy.x)
+		return;
+
+	int src = id * 7;
+	vec3 pos = vec3(b_NewParticles[src + 0], b_NewParticles[src + 1], b_NewParticles[src + 2]);
+	vec3 vel = vec3(b_NewParticles[src + 3], b_NewParticles[src + 4], b_NewParticles[src + 5]);
+	float life = b_NewParticles[src + 6];
 
+	// Past the capacity the slot is given back, `b_Count` only stays over
+	// the capacity while other threads are doing the same.
+	uint outIx = atomicAdd(b_Count, 1);
+	if (outIx >= uint(u_Copy.y))
+	{
+		atomicAdd(b_Count, 0xffffffffu);
+		atomicAdd(b_Overflow, 1);
+		return;
+	}
+
+	b_Particles[outIx].PositionAndLifetime = vec4(pos, life);
+	b_Particles[outIx].Velocity = vec4(vel, 0.0);
+}
@@ -0,0 +1,124 @@
+#version 430
+
+layout (local_size_x = 64) in;
+
+struct Particle
+{
+	vec4 PositionAndLifetime;
+	vec4 Velocity;
+};
+
+// Matches `GpuEmitBatch`, `Info` is (seed, first particle index, first
+// thread of the batch, shape).
+struct EmitBatch
+{
+	vec4 PositionAndLifetime;
+	vec4 ExtentAndLifetimeSpread;
+	vec4 Velocity;
+	vec4 VelocitySpread;
+	uvec4 Info;
+};
+
+layout (std140, binding=0) uniform Uniform
+{
+	// x: batches, y: particles, z: capacity of `b_Particles`
+	uvec4 u_Emit;
+};
+
+layout (std430, binding=0) buffer Particles
+{
+	Particle b_Particles[];
+};
+
+layout (std430, binding=1) buffer Batches
+{
+	EmitBatch b_Batches[];
+};
+
+layout (std430, binding=4) buffer Counters
+{
+	uint b_Count;
+	uint b_Next;
+	uint b_Zero;
+	uint b_Overflow;
+};
+
+const uint EmitterBox = 1u;
+const uint EmitterSphere = 2u;
+
+// PCG hash, same as `hash()` in `emitter.cpp`
+uint hash(uint v)
+{
+	uint state = v * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+float random01(inout uint state)
+{
+	state = hash(state);
+	return float(state >> 8) * (1.0 / 16777216.0);
+}
+
+float randomSigned(inout uint state)
+{
+	return random01(state) * 2.0 - 1.0;
+}
+
+vec3 randomSpread(inout uint state, vec3 spread)
+{
+	float x = randomSigned(state);
+	float y = randomSigned(state);
+	float z = randomSigned(state);
+	return vec3(x, y, z) * spread;
+}
+
+void main()
+{
+	uint id = gl_GlobalInvocationID.x;
+	if (id >= u_Emit.y)
+		return;
+
+	// Batches are sorted by their first thread and there are only a few
+	uint batchIx = 0;
+	for (uint i = 1; i < u_Emit.x; i++)
+	{
+		if (id >= b_Batches[i].Info.z)
+			batchIx = i;
+	}
+
+	EmitBatch batch = b_Batches[batchIx];
+	uint index = batch.Info.y + (id - batch.Info.z);
+	uint state = hash(batch.Info.x ^ hash(index));
+
+	vec3 offset = vec3(0.0);
+	if (batch.Info.w == EmitterBox)
+	{
+		offset = randomSpread(state, batch.ExtentAndLifetimeSpread.xyz);
+	}
+	else if (batch.Info.w == EmitterSphere)
+	{
+		float z = randomSigned(state);
+		float phi = random01(state) * 2.0 * 3.14159265;
+		float r = batch.ExtentAndLifetimeSpread.x * pow(random01(state), 1.0 / 3.0);
+		float xy = sqrt(1.0 - z * z);
+		offset = vec3(cos(phi) * xy, sin(phi) * xy, z) * r;
+	}
+
+	vec3 pos = batch.PositionAndLifetime.xyz + offset;
+	vec3 vel = batch.Velocity.xyz + randomSpread(state, batch.VelocitySpread.xyz);
+	float life = batch.PositionAndLifetime.w + randomSigned(state) * batch.ExtentAndLifetimeSpread.w;
+
+	// Past the capacity the slot is given back, `b_Count` only stays over
+	// the capacity while other threads are doing the same.
+	uint outIx = atomicAdd(b_Count, 1);
+	if (outIx >= uint(u_Emit.z))
+	{
+		atomicAdd(b_Count, 0xffffffffu);
+		atomicAdd(b_Overflow, 1);
+		return;
+	}
+
+	b_Particles[outIx].PositionAndLifetime = vec4(pos, life);
+	b_Particles[outIx].Velocity = vec4(vel, 0.0);
+}
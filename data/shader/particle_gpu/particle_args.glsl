@@ -0,0 +1,35 @@
+#version 430
+
+// Indirect arguments for the live particles, matches `GpuParticleArgs`
+
+layout (local_size_x = 1) in;
+
+layout (std430, binding=0) buffer Args
+{
+	uint b_Sim[3];
+	uint b_Draw[5];
+};
+
+layout (std430, binding=4) buffer Counters
+{
+	uint b_Count;
+	uint b_Next;
+	uint b_Zero;
+};
+
+void main()
+{
+	uint count = b_Count;
+
+	// 64 threads per group
+	b_Sim[0] = (count + 63u) / 64u;
+	b_Sim[1] = 1u;
+	b_Sim[2] = 1u;
+
+	// An instance of the 6 index particle quad per particle
+	b_Draw[0] = 6u;
+	b_Draw[1] = count;
+	b_Draw[2] = 0u;
+	b_Draw[3] = 0u;
+	b_Draw[4] = 0u;
+}
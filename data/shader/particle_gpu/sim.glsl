@@ -30,6 +30,18 @@ layout (std430, binding=1) buffer Triangles
 	Triangle b_Triangles[];
 };
 
+layout (std430, binding=3) buffer OutParticles
+{
+	Particle b_OutParticles[];
+};
+
+layout (std430, binding=4) buffer Counters
+{
+	uint b_Count;
+	uint b_Next;
+	uint b_Zero;
+};
+
 bool IntersectRayTriangle(vec3 ro, vec3 rd, vec3 a, vec3 b, vec3 c, out float outT)
 {
 	vec3 e0 = b - a;
@@ -59,6 +71,8 @@ bool IntersectRayTriangle(vec3 ro, vec3 rd, vec3 a, vec3 b, vec3 c, out float ou
 void main()
 {
 	int id = int(gl_GlobalInvocationID.x);
+	if (uint(id) >= b_Count)
+		return;
 
 	Particle particle = b_Particles[id];
 
@@ -85,7 +99,12 @@ void main()
 		}
 	}
 
-	b_Particles[id].PositionAndLifetime = vec4(newPos, life);
-	b_Particles[id].Velocity = vec4(newVel, 0.0);
+	// Append the survivors to the other buffer
+	if (life <= 0.0)
+		return;
+
+	uint outIx = atomicAdd(b_Next, 1);
+	b_OutParticles[outIx].PositionAndLifetime = vec4(newPos, life);
+	b_OutParticles[outIx].Velocity = vec4(newVel, 0.0);
 }
 
@@ -0,0 +1,37 @@
+#version 430
+
+// Adds the scanned block sums to the blocks of `scan_blocks.glsl`
+
+layout (local_size_x = 256) in;
+
+layout (std140, binding=0) uniform Uniform
+{
+	// x: count, y: first element
+	uvec4 u_Scan;
+};
+
+layout (std430, binding=0) buffer Data
+{
+	uint b_Data[];
+};
+
+layout (std430, binding=1) buffer BlockSums
+{
+	uint b_BlockSums[];
+};
+
+void main()
+{
+	uint block = gl_WorkGroupID.x + gl_WorkGroupID.y * gl_NumWorkGroups.x;
+	if (block * 512u >= u_Scan.x)
+		return;
+
+	uint sum = b_BlockSums[block];
+	uint i0 = block * 512u + gl_LocalInvocationID.x;
+	uint i1 = i0 + 256u;
+
+	if (i0 < u_Scan.x)
+		b_Data[u_Scan.y + i0] += sum;
+	if (i1 < u_Scan.x)
+		b_Data[u_Scan.y + i1] += sum;
+}
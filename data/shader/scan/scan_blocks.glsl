@@ -0,0 +1,86 @@
+#version 430
+
+// Exclusive scan of blocks of 512 values in shared memory (Blelloch), the
+// total of every block goes to `b_BlockSums`.
+
+layout (local_size_x = 256) in;
+
+layout (std140, binding=0) uniform Uniform
+{
+	// x: count, y: first element
+	uvec4 u_Scan;
+};
+
+layout (std430, binding=0) buffer Data
+{
+	uint b_Data[];
+};
+
+layout (std430, binding=1) buffer BlockSums
+{
+	uint b_BlockSums[];
+};
+
+shared uint s_Data[512];
+
+void main()
+{
+	// Blocks past the end fill up the last row of groups, the whole group
+	// leaves so the barriers below stay uniform
+	uint block = gl_WorkGroupID.x + gl_WorkGroupID.y * gl_NumWorkGroups.x;
+	if (block * 512u >= u_Scan.x)
+		return;
+
+	uint t = gl_LocalInvocationID.x;
+	uint i0 = block * 512u + t;
+	uint i1 = i0 + 256u;
+
+	s_Data[t] = i0 < u_Scan.x ? b_Data[u_Scan.y + i0] : 0u;
+	s_Data[t + 256u] = i1 < u_Scan.x ? b_Data[u_Scan.y + i1] : 0u;
+
+	// Up-sweep, builds partial sums in place
+	uint offset = 1u;
+	for (uint d = 256u; d > 0u; d >>= 1)
+	{
+		memoryBarrierShared();
+		barrier();
+		if (t < d)
+		{
+			uint ai = offset * (2u * t + 1u) - 1u;
+			uint bi = offset * (2u * t + 2u) - 1u;
+			s_Data[bi] += s_Data[ai];
+		}
+		offset *= 2u;
+	}
+
+	memoryBarrierShared();
+	barrier();
+	if (t == 0u)
+	{
+		b_BlockSums[block] = s_Data[511];
+		s_Data[511] = 0u;
+	}
+
+	// Down-sweep
+	for (uint d = 1u; d < 512u; d *= 2u)
+	{
+		offset >>= 1;
+		memoryBarrierShared();
+		barrier();
+		if (t < d)
+		{
+			uint ai = offset * (2u * t + 1u) - 1u;
+			uint bi = offset * (2u * t + 2u) - 1u;
+			uint v = s_Data[ai];
+			s_Data[ai] = s_Data[bi];
+			s_Data[bi] += v;
+		}
+	}
+
+	memoryBarrierShared();
+	barrier();
+	if (i0 < u_Scan.x)
+		b_Data[u_Scan.y + i0] = s_Data[t];
+	if (i1 < u_Scan.x)
+		b_Data[u_Scan.y + i1] = s_Data[t + 256u];
+}
@@ -0,0 +1,411 @@
+#include "opengl.h"
+#include "renderer.h"
+#include "particles.h"
+#include "grid.h"
+#include "gpu_grid.h"
+#include "util.h"
+#include "../ext/tinyobj_loader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#endif
+
+// Headless benchmark of the particle systems, run from the `data` directory:
+//
+//   bench [frames]
+//   bench --validate-grid
+//
+// Every backend is run against every collision mesh with the same spawn
+// script, results are written to stdout as CSV. The `peak_*_kb` columns
+// are the growth over the run, not totals of the whole process.
+//
+// `--validate-grid` instead builds the collision grid of every mesh on the
+// CPU and with the compute shaders and compares the cells, run it on a
+// software GL implementation (e.g. LIBGL_ALWAYS_SOFTWARE=1 with Mesa) to
+// check the GPU build without driver quirks.
+
+GLFWwindow *g_Window;
+
+namespace {
+
+const uint32_t BenchDefaultFrames = 1000;
+const uint32_t BenchSpawnInterval = 100;
+const uint32_t BenchSpawnCount = 10000;
+const float BenchLifetime = 10.0f;
+const float BenchDt = 0.016f;
+
+// Cell sizes validated, the first matches the grid backends
+const float BenchGridCellSizes[] = { 1.0f, 0.25f };
+const float BenchGridCellPadding = 0.001f;
+
+struct BenchBackend
+{
+	const char *Name;
+	ParticleSystem *(*Create)();
+};
+
+ParticleSystem *createParallelCpu()
+{
+	return ParticlesCreateParallelCpu(0);
+}
+
+const BenchBackend BenchBackends[] =
+{
+	{ "dumb_cpu", &ParticlesCreateDumbCpu },
+	{ "parallel_cpu", &createParallelCpu },
+	{ "dumb_gpu", &ParticlesCreateDumbGpu },
+	{ "grid_gpu", &ParticlesCreateGridGpu },
+	{ "sparse_grid_gpu", &ParticlesCreateSparseGridGpu },
+	{ "bucketed_grid_gpu", &ParticlesCreateBucketedGridGpu },
+};
+
+const char *BenchMeshes[] =
+{
+	"mesh/houses.obj",
+	"mesh/room.obj",
+};
+
+// Same spawn volume as `scene.cpp` but with a fixed LCG so every run and
+// every backend sees exactly the same particles.
+struct BenchRandom
+{
+	uint32_t State;
+
+	float Next()
+	{
+		State = State * 1664525u + 1013904223u;
+		return (float)(State >> 8) * (1.0f / 16777216.0f);
+	}
+};
+
+struct BenchBatch
+{
+	uint32_t Count;
+	float Lifetime;
+};
+
+struct BenchResult
+{
+	uint64_t ParticleFrames;
+	double TotalMs;
+	double P50Ms;
+	double P99Ms;
+	size_t PeakBufferBytes;
+	size_t PeakProcessBytes;
+};
+
+std::vector<Triangle> loadTriangles(const char *path)
+{
+	tinyobj::attrib_t attrib;
+	std::vector<tinyobj::shape_t> shapes;
+	std::vector<tinyobj::material_t> materials;
+	std::string err;
+
+	std::vector<Triangle> triangles;
+	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, path, "mesh/"))
+	{
+		fprintf(stderr, "Failed to load %s: %s\n", path, err.c_str());
+		return triangles;
+	}
+
+	for (tinyobj::shape_t &shape : shapes)
+	{
+		for (size_t i = 0; i + 2 < shape.mesh.indices.size(); i += 3)
+		{
+			Triangle t;
+			for (uint32_t p = 0; p < 3; p++)
+			{
+				float *v = &attrib.vertices[shape.mesh.indices[i + p].vertex_index * 3];
+				t.P[p] = vec3(v[0], v[1], v[2]);
+			}
+			triangles.push_back(t);
+		}
+	}
+
+	return triangles;
+}
+
+// Number of cells whose triangles differ between the two builds, the GPU
+// cells come back through `rb`.
+uint32_t validateGrid(GpuGridBuilder *gb, CommandBuffer *cb, ReadbackBuffer *rb, const std::vector<Triangle>& triangles, float cellSize)
+{
+	uint32_t count = (uint32_t)triangles.size();
+
+	UniformGrid cpu, gpu;
+	BuildUniformGrid(&cpu, NULL, triangles.data(), count, cellSize, BenchGridCellPadding);
+
+	Buffer *cells = CreateBuffer(BufferStorage);
+	Buffer *cellTriangles = CreateBuffer(BufferStorage);
+	BuildGpuUniformGrid(gb, cb, &gpu, triangles.data(), count, cellSize, BenchGridCellPadding, cells, cellTriangles);
+
+	uint32_t numCells = (uint32_t)(cpu.CellStart.size() - 1);
+	size_t maxPairs = (size_t)CountGridPairBound(&gpu, triangles.data(), count);
+
+	ReadbackRange ranges[2] =
+	{
+		{ cells, 0, numCells * 4 * sizeof(int) },
+		{ cellTriangles, 0, maxPairs * sizeof(uint32_t) },
+	};
+	bool queued = QueueReadback(cb, rb, ranges, ArrayCount(ranges), 0);
+	glFinish();
+
+	size_t size;
+	uint32_t tag;
+	const char *data = (const char*)GetReadbackData(rb, &size, &tag);
+	if (!queued || !data || gpu.Size[0] != cpu.Size[0] || gpu.Size[1] != cpu.Size[1] || gpu.Size[2] != cpu.Size[2])
+	{
+		DestroyBuffer(cells);
+		DestroyBuffer(cellTriangles);
+		return numCells > 0 ? numCells : 1;
+	}
+
+	const int *gpuCells = (const int*)data;
+	const uint32_t *gpuTriangles = (const uint32_t*)(data + ranges[0].Size);
+
+	uint32_t mismatches = 0;
+	for (uint32_t cellI = 0; cellI < numCells; cellI++)
+	{
+		const int *c = &gpuCells[cellI * 4];
+		uint32_t first = cpu.CellStart[cellI];
+		uint32_t num = cpu.CellStart[cellI + 1] - first;
+
+		bool same = c[2] == (int)num && c[1] - c[0] == (int)num && c[0] >= 0 && (size_t)c[1] <= maxPairs;
+		for (uint32_t i = 0; same && i < num; i++)
+			same = gpuTriangles[c[0] + i] == cpu.Triangles[first + i];
+
+		if (!same)
+		{
+			if (mismatches < 8)
+				fprintf(stderr, "cell %u: %u triangles on the CPU, %d on the GPU\n", cellI, num, c[2]);
+			mismatches++;
+		}
+	}
+
+	DestroyBuffer(cells);
+	DestroyBuffer(cellTriangles);
+	return mismatches;
+}
+
+double percentile(std::vector<double> values, double p)
+{
+	if (values.empty())
+		return 0.0;
+
+	size_t ix = (size_t)(p * (double)(values.size() - 1) + 0.5);
+	std::nth_element(values.begin(), values.begin() + ix, values.end());
+	return values[ix];
+}
+
+// Resident memory right now, the OS peak counters only ever grow so they
+// can't be split per run.
+size_t currentProcessMemory()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return 0;
+	return pmc.WorkingSetSize;
+#else
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+
+	unsigned long long size = 0, resident = 0;
+	int fields = fscanf(f, "%llu %llu", &size, &resident);
+	fclose(f);
+	if (fields != 2)
+		return 0;
+	return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+BenchResult runBenchmark(ParticleSystem *ps, CommandBuffer *cb, uint32_t numFrames)
+{
+	BenchResult result = { };
+	std::vector<double> frameMs;
+	std::vector<BenchBatch> batches;
+	std::vector<Particle> spawn(BenchSpawnCount);
+
+	BenchRandom rng;
+	rng.State = 1;
+
+	Mat44 proj = mat44_perspective(1.5f, 1280.0f/720.0f, 0.1f, 1000.0f);
+	Mat44 view = mat44_lookat(vec3(0.0f, 4.0f, 5.0f), vec3(0.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+
+	for (uint32_t frame = 1; frame <= numFrames; frame++)
+	{
+		if (frame % BenchSpawnInterval == 0)
+		{
+			for (Particle &p : spawn)
+			{
+				p.Position.x = rng.Next() * 5.0f - 2.5f;
+				p.Position.y = 4.0f + rng.Next() * 2.0f;
+				p.Position.z = rng.Next() * 5.0f - 2.5f;
+				p.Velocity = vec3(0.0f, 0.0f, 0.0f);
+				p.Lifetime = BenchLifetime;
+			}
+
+			BenchBatch batch = { BenchSpawnCount, BenchLifetime };
+			batches.push_back(batch);
+		}
+
+		// Wait for the GPU so the frame time includes the GPU backends' work
+		uint64_t begin = BeginMeasureCpuTime();
+		if (frame % BenchSpawnInterval == 0)
+			ps->SpawnParticles(spawn.data(), (uint32_t)spawn.size());
+		ps->Update(cb, BenchDt);
+		ps->Render(cb, view, proj);
+		EndFrame(cb);
+		glFinish();
+		double ms = EndMeasureCpuTime(begin);
+
+		frameMs.push_back(ms);
+		result.TotalMs += ms;
+		result.PeakProcessBytes = std::max(result.PeakProcessBytes, currentProcessMemory());
+
+		// Live particles follow from the script, the backends age them the
+		// same way so this doesn't need a readback.
+		uint32_t live = 0;
+		for (size_t i = 0; i < batches.size(); )
+		{
+			batches[i].Lifetime -= BenchDt;
+			if (batches[i].Lifetime <= 0.0f)
+			{
+				batches.erase(batches.begin() + i);
+				continue;
+			}
+			live += batches[i].Count;
+			i++;
+		}
+		result.ParticleFrames += live;
+
+		glfwPollEvents();
+	}
+
+	result.P50Ms = percentile(frameMs, 0.50);
+	result.P99Ms = percentile(frameMs, 0.99);
+	return result;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t numFrames = BenchDefaultFrames;
+	bool validate = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--validate-grid"))
+			validate = true;
+		else
+			numFrames = (uint32_t)atoi(argv[i]);
+	}
+
+	if (!glfwInit())
+	{
+		fprintf(stderr, "glfwInit() failed\n");
+		return 1;
+	}
+
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+
+	g_Window = glfwCreateWindow(1280, 720, "Benchmark", NULL, NULL);
+	if (!g_Window)
+	{
+		fprintf(stderr, "glfwCreateWindow() failed\n");
+		return 1;
+	}
+
+	glfwMakeContextCurrent(g_Window);
+	glewInit();
+	glfwSwapInterval(0);
+
+	glEnable(GL_DEPTH_TEST);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	CommandBuffer *cb = CreateCommandBuffer();
+
+	if (validate)
+	{
+		GpuGridBuilder *gb = CreateGpuGridBuilder();
+		ReadbackBuffer *rb = CreateReadbackBuffer();
+		uint32_t failed = 0;
+
+		printf("mesh,triangles,cell_size,mismatched_cells\n");
+		for (uint32_t meshI = 0; meshI < ArrayCount(BenchMeshes); meshI++)
+		{
+			std::vector<Triangle> triangles = loadTriangles(BenchMeshes[meshI]);
+			for (uint32_t sizeI = 0; sizeI < ArrayCount(BenchGridCellSizes); sizeI++)
+			{
+				uint32_t mismatches = validateGrid(gb, cb, rb, triangles, BenchGridCellSizes[sizeI]);
+				printf("%s,%u,%.3f,%u\n", BenchMeshes[meshI], (uint32_t)triangles.size(), BenchGridCellSizes[sizeI], mismatches);
+				if (mismatches > 0)
+					failed++;
+			}
+		}
+
+		glfwDestroyWindow(g_Window);
+		glfwTerminate();
+		return failed > 0 ? 1 : 0;
+	}
+
+	printf("backend,mesh,triangles,frames,particle_frames,ns_per_particle_frame,p50_ms,p99_ms,peak_buffer_kb,peak_process_kb,binds_issued,binds_filtered\n");
+
+	for (uint32_t meshI = 0; meshI < ArrayCount(BenchMeshes); meshI++)
+	{
+		std::vector<Triangle> triangles = loadTriangles(BenchMeshes[meshI]);
+		if (triangles.empty())
+			continue;
+
+		for (uint32_t backendI = 0; backendI < ArrayCount(BenchBackends); backendI++)
+		{
+			const BenchBackend *backend = &BenchBackends[backendI];
+			fprintf(stderr, "%s: %s\n", backend->Name, BenchMeshes[meshI]);
+
+			// Buffers are never freed, measure the growth during this run
+			size_t baseBufferBytes = GetBufferMemoryUsage();
+			size_t baseProcessBytes = currentProcessMemory();
+			ResetPeakBufferMemoryUsage();
+			ResetBindingCounters(cb);
+
+			ParticleSystem *ps = backend->Create();
+			ps->Initialize(triangles.data(), (uint32_t)triangles.size());
+
+			BenchResult r = runBenchmark(ps, cb, numFrames);
+			r.PeakBufferBytes = GetPeakBufferMemoryUsage() - baseBufferBytes;
+			r.PeakProcessBytes = r.PeakProcessBytes > baseProcessBytes ? r.PeakProcessBytes - baseProcessBytes : 0;
+
+			delete ps;
+
+			uint64_t bindsIssued, bindsFiltered;
+			GetBindingCounters(cb, &bindsIssued, &bindsFiltered);
+
+			double nsPerParticle = r.ParticleFrames > 0 ? r.TotalMs * 1000000.0 / (double)r.ParticleFrames : 0.0;
+
+			printf("%s,%s,%u,%u,%llu,%.3f,%.3f,%.3f,%llu,%llu,%llu,%llu\n",
+				backend->Name, BenchMeshes[meshI], (uint32_t)triangles.size(), numFrames,
+				(unsigned long long)r.ParticleFrames, nsPerParticle, r.P50Ms, r.P99Ms,
+				(unsigned long long)(r.PeakBufferBytes / 1024),
+				(unsigned long long)(r.PeakProcessBytes / 1024),
+				(unsigned long long)bindsIssued, (unsigned long long)bindsFiltered);
+			fflush(stdout);
+		}
+	}
+
+	glfwDestroyWindow(g_Window);
+	glfwTerminate();
+	return 0;
+}
+
@@ -0,0 +1,394 @@
+#include "bvh.h"
+#include "fastmath.h"
+#include "simd.h"
+#include <float.h>
+#include <algorithm>
+
+namespace {
+
+const uint32_t BvhNumBins = 16;
+const uint32_t BvhMaxDepth = 48;
+const float BvhTraversalCost = 1.0f;
+const float BvhIntersectCost = 1.0f;
+
+struct BuildTriangle
+{
+	AABB Bounds;
+	Vec3 Center;
+};
+
+struct BvhBin
+{
+	AABB Bounds;
+	uint32_t Count;
+};
+
+struct BvhBuilder
+{
+	Bvh *B;
+	std::vector<BuildTriangle> Tris;
+	std::vector<uint32_t> Order;
+};
+
+AABB emptyAABB()
+{
+	AABB a;
+	a.Min = vec3s(FLT_MAX);
+	a.Max = vec3s(-FLT_MAX);
+	return a;
+}
+
+void growAABB(AABB& a, const Vec3& p)
+{
+	a.Min = vec3(F_MIN(a.Min.x, p.x), F_MIN(a.Min.y, p.y), F_MIN(a.Min.z, p.z));
+	a.Max = vec3(F_MAX(a.Max.x, p.x), F_MAX(a.Max.y, p.y), F_MAX(a.Max.z, p.z));
+}
+
+void growAABB(AABB& a, const AABB& b)
+{
+	growAABB(a, b.Min);
+	growAABB(a, b.Max);
+}
+
+float surfaceArea(const AABB& a)
+{
+	if (a.Min.x > a.Max.x)
+		return 0.0f;
+
+	Vec3 d = a.Max - a.Min;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+float axisValue(const Vec3& v, uint32_t axis)
+{
+	return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+void makeLeaf(BvhNode *node, uint32_t first, uint32_t count)
+{
+	node->First = first;
+	node->Count = count;
+}
+
+// Leaves point to `BvhBuilder::Order` during the build, pack them into
+// blocks of 8 once the tree is done.
+void packLeaves(BvhBuilder *b, const Triangle *triangles)
+{
+	Bvh *bvh = b->B;
+	std::vector<Triangle> leafTriangles;
+
+	for (BvhNode &node : bvh->Nodes)
+	{
+		if (node.Count == 0)
+			continue;
+
+		uint32_t numBlocks = (node.Count + 7) / 8;
+		uint32_t firstBlock = (uint32_t)bvh->Blocks.size();
+
+		leafTriangles.clear();
+		for (uint32_t i = 0; i < node.Count; i++)
+			leafTriangles.push_back(triangles[b->Order[node.First + i]]);
+
+		bvh->Blocks.resize(firstBlock + numBlocks);
+		PackTrianglesSoa8(leafTriangles.data(), node.Count, &bvh->Blocks[firstBlock]);
+
+		bvh->Indices.resize((firstBlock + numBlocks) * 8, ~0U);
+		for (uint32_t i = 0; i < node.Count; i++)
+			bvh->Indices[firstBlock * 8 + i] = b->Order[node.First + i];
+
+		node.First = firstBlock;
+	}
+}
+
+void buildNode(BvhBuilder *b, uint32_t nodeIx, uint32_t first, uint32_t count, uint32_t depth)
+{
+	AABB bounds = emptyAABB();
+	AABB centers = emptyAABB();
+	for (uint32_t i = first; i < first + count; i++)
+	{
+		const BuildTriangle *t = &b->Tris[b->Order[i]];
+		growAABB(bounds, t->Bounds);
+		growAABB(centers, t->Center);
+	}
+
+	b->B->Nodes[nodeIx].Bounds = bounds;
+
+	if (count <= 2 || depth >= BvhMaxDepth)
+	{
+		makeLeaf(&b->B->Nodes[nodeIx], first, count);
+		return;
+	}
+
+	Vec3 extent = centers.Max - centers.Min;
+	uint32_t axis = 0;
+	if (extent.y > axisValue(extent, axis)) axis = 1;
+	if (extent.z > axisValue(extent, axis)) axis = 2;
+
+	float axisMin = axisValue(centers.Min, axis);
+	float axisExtent = axisValue(extent, axis);
+
+	uint32_t split = first + count / 2;
+	bool sahSplit = false;
+
+	if (axisExtent > 0.0f)
+	{
+		float binScale = (float)BvhNumBins / axisExtent;
+
+		BvhBin bins[BvhNumBins];
+		for (uint32_t i = 0; i < BvhNumBins; i++)
+		{
+			bins[i].Bounds = emptyAABB();
+			bins[i].Count = 0;
+		}
+
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			const BuildTriangle *t = &b->Tris[b->Order[i]];
+			uint32_t bin = (uint32_t)((axisValue(t->Center, axis) - axisMin) * binScale);
+			if (bin >= BvhNumBins) bin = BvhNumBins - 1;
+			growAABB(bins[bin].Bounds, t->Bounds);
+			bins[bin].Count++;
+		}
+
+		// Sweep from the right to get the cost of the right side of every split
+		float rightArea[BvhNumBins];
+		uint32_t rightCount[BvhNumBins];
+		{
+			AABB acc = emptyAABB();
+			uint32_t num = 0;
+			for (uint32_t i = BvhNumBins - 1; i > 0; i--)
+			{
+				growAABB(acc, bins[i].Bounds);
+				num += bins[i].Count;
+				rightArea[i] = surfaceArea(acc);
+				rightCount[i] = num;
+			}
+		}
+
+		float bestCost = FLT_MAX;
+		uint32_t bestBin = 0;
+		{
+			AABB acc = emptyAABB();
+			uint32_t num = 0;
+			for (uint32_t i = 1; i < BvhNumBins; i++)
+			{
+				growAABB(acc, bins[i - 1].Bounds);
+				num += bins[i - 1].Count;
+				if (num == 0 || rightCount[i] == 0)
+					continue;
+
+				float cost = surfaceArea(acc) * num + rightArea[i] * rightCount[i];
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestBin = i;
+				}
+			}
+		}
+
+		float parentArea = surfaceArea(bounds);
+		float splitCost = BvhTraversalCost + BvhIntersectCost * bestCost / F_MAX(parentArea, FLT_MIN);
+		float leafCost = BvhIntersectCost * (float)count;
+
+		if (count <= BvhMaxLeafTriangles && (bestBin == 0 || splitCost >= leafCost))
+		{
+			makeLeaf(&b->B->Nodes[nodeIx], first, count);
+			return;
+		}
+
+		// Too big for a leaf, still split at the best bin even if SAH would rather not
+		if (bestBin != 0)
+		{
+			uint32_t *mid = std::partition(b->Order.data() + first, b->Order.data() + first + count, [&](uint32_t ix) {
+				uint32_t bin = (uint32_t)((axisValue(b->Tris[ix].Center, axis) - axisMin) * binScale);
+				if (bin >= BvhNumBins) bin = BvhNumBins - 1;
+				return bin < bestBin;
+			});
+			split = (uint32_t)(mid - b->Order.data());
+			sahSplit = true;
+		}
+	}
+	else if (count <= BvhMaxLeafTriangles)
+	{
+		makeLeaf(&b->B->Nodes[nodeIx], first, count);
+		return;
+	}
+
+	if (!sahSplit)
+	{
+		// All centers coincide or share a bin, only a median split is left
+		std::nth_element(b->Order.data() + first, b->Order.data() + split, b->Order.data() + first + count, [&](uint32_t l, uint32_t r) {
+			return axisValue(b->Tris[l].Center, axis) < axisValue(b->Tris[r].Center, axis);
+		});
+	}
+
+	uint32_t children = (uint32_t)b->B->Nodes.size();
+	b->B->Nodes.emplace_back();
+	b->B->Nodes.emplace_back();
+	b->B->Nodes[nodeIx].First = children;
+	b->B->Nodes[nodeIx].Count = 0;
+
+	buildNode(b, children + 0, first, split - first, depth + 1);
+	buildNode(b, children + 1, split, first + count - split, depth + 1);
+}
+
+bool intersectRayvNode(const BvhNode *node, const Vec3& origin, const Vec3& invDir, float maxT, float *outT)
+{
+	float tx0 = (node->Bounds.Min.x - origin.x) * invDir.x;
+	float tx1 = (node->Bounds.Max.x - origin.x) * invDir.x;
+	float ty0 = (node->Bounds.Min.y - origin.y) * invDir.y;
+	float ty1 = (node->Bounds.Max.y - origin.y) * invDir.y;
+	float tz0 = (node->Bounds.Min.z - origin.z) * invDir.z;
+	float tz1 = (node->Bounds.Max.z - origin.z) * invDir.z;
+
+	float tmin = F_MAX(F_MAX(F_MIN(tx0, tx1), F_MIN(ty0, ty1)), F_MAX(F_MIN(tz0, tz1), 0.0f));
+	float tmax = F_MIN(F_MIN(F_MAX(tx0, tx1), F_MAX(ty0, ty1)), F_MIN(F_MAX(tz0, tz1), maxT));
+
+	*outT = tmin;
+	return tmin <= tmax;
+}
+
+}
+
+void BuildBvh(Bvh *bvh, const Triangle *triangles, uint32_t count)
+{
+	bvh->Nodes.clear();
+	bvh->Blocks.clear();
+	bvh->Indices.clear();
+
+	if (count == 0)
+		return;
+
+	BvhBuilder b;
+	b.B = bvh;
+	b.Tris.resize(count);
+	b.Order.resize(count);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const Triangle *t = &triangles[i];
+		BuildTriangle *bt = &b.Tris[i];
+		bt->Bounds = emptyAABB();
+		growAABB(bt->Bounds, t->A);
+		growAABB(bt->Bounds, t->B);
+		growAABB(bt->Bounds, t->C);
+		bt->Center = (bt->Bounds.Min + bt->Bounds.Max) * 0.5f;
+		b.Order[i] = i;
+	}
+
+	bvh->Nodes.reserve(count * 2 / 3 + 1);
+	bvh->Nodes.emplace_back();
+	buildNode(&b, 0, 0, count, 0);
+
+	packLeaves(&b, triangles);
+}
+
+void RefitBvh(Bvh *bvh, const Triangle *triangles)
+{
+	std::vector<Triangle> leafTriangles;
+
+	// Children are always stored after their parent
+	for (size_t nodeI = bvh->Nodes.size(); nodeI-- > 0; )
+	{
+		BvhNode *node = &bvh->Nodes[nodeI];
+		if (node->Count == 0)
+		{
+			node->Bounds = bvh->Nodes[node->First + 0].Bounds;
+			growAABB(node->Bounds, bvh->Nodes[node->First + 1].Bounds);
+			continue;
+		}
+
+		node->Bounds = emptyAABB();
+		leafTriangles.clear();
+		for (uint32_t i = 0; i < node->Count; i++)
+		{
+			const Triangle &t = triangles[bvh->Indices[node->First * 8 + i]];
+			growAABB(node->Bounds, t.A);
+			growAABB(node->Bounds, t.B);
+			growAABB(node->Bounds, t.C);
+			leafTriangles.push_back(t);
+		}
+
+		PackTrianglesSoa8(leafTriangles.data(), node->Count, &bvh->Blocks[node->First]);
+	}
+}
+
+bool IntersectRayvBvh(const Bvh *bvh, const Vec3& origin, const Vec3& dir, float maxT, float *outT, uint32_t *outTriangle)
+{
+	if (bvh->Nodes.empty())
+		return false;
+
+	const BvhNode *nodes = bvh->Nodes.data();
+	Vec3 invDir = vec3(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+
+	float closest = maxT;
+	uint32_t hit = ~0U;
+
+	float rootT;
+	if (!intersectRayvNode(&nodes[0], origin, invDir, closest, &rootT))
+		return false;
+
+	uint32_t stack[BvhMaxDepth + 2];
+	uint32_t depth = 0;
+	stack[depth++] = 0;
+
+	while (depth > 0)
+	{
+		const BvhNode *node = &nodes[stack[--depth]];
+
+		if (node->Count > 0)
+		{
+			uint32_t numBlocks = (node->Count + 7) / 8;
+			for (uint32_t blockI = node->First; blockI < node->First + numBlocks; blockI++)
+			{
+				float t[8];
+				uint32_t mask = IntersectRayvTriangles8(origin, dir, bvh->Blocks[blockI], closest, t);
+				for (; mask; mask &= mask - 1)
+				{
+					uint32_t lane = CountTrailingZeros(mask);
+					if (t[lane] <= closest)
+					{
+						closest = t[lane];
+						hit = blockI * 8 + lane;
+					}
+				}
+			}
+			continue;
+		}
+
+		float tl, tr;
+		bool hl = intersectRayvNode(&nodes[node->First + 0], origin, invDir, closest, &tl);
+		bool hr = intersectRayvNode(&nodes[node->First + 1], origin, invDir, closest, &tr);
+
+		// Push the farther child first so the nearer one is visited first
+		if (hl && hr)
+		{
+			if (tl <= tr)
+			{
+				stack[depth++] = node->First + 1;
+				stack[depth++] = node->First + 0;
+			}
+			else
+			{
+				stack[depth++] = node->First + 0;
+				stack[depth++] = node->First + 1;
+			}
+		}
+		else if (hl)
+		{
+			stack[depth++] = node->First + 0;
+		}
+		else if (hr)
+		{
+			stack[depth++] = node->First + 1;
+		}
+	}
+
+	if (hit == ~0U)
+		return false;
+
+	*outT = closest;
+	*outTriangle = bvh->Indices[hit];
+	return true;
+}
+
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "intersection.h"
+#include <stdint.h>
+#include <vector>
+
+struct BvhNode
+{
+	AABB Bounds;
+
+	// Inner nodes: children are at `First` and `First + 1`, `Count` is zero.
+	// Leaves: `Count` triangles packed in blocks starting from `First` in
+	// `Bvh::Blocks`, the last block of a leaf may be partially filled.
+	uint32_t First;
+	uint32_t Count;
+};
+
+struct Bvh
+{
+	std::vector<BvhNode> Nodes;
+
+	// Leaf triangles packed for `IntersectRayvTriangles8()`, `Indices` maps
+	// every lane of the blocks back to the original triangle index.
+	std::vector<TriangleSoa8> Blocks;
+	std::vector<uint32_t> Indices;
+};
+
+const uint32_t BvhMaxLeafTriangles = 8;
+
+// Binned SAH build, replaces the previous contents of `bvh`.
+void BuildBvh(Bvh *bvh, const Triangle *triangles, uint32_t count);
+
+// Updates the bounds and the packed leaves after the triangles moved, the
+// tree keeps its topology so it gets slower with large deformations.
+// `triangles` is indexed like the array the tree was built from.
+void RefitBvh(Bvh *bvh, const Triangle *triangles);
+
+// Closest hit along the ray in [0, maxT]. `dir` must be normalized,
+// `outTriangle` receives the original index of the hit triangle.
+bool IntersectRayvBvh(const Bvh *bvh, const Vec3& origin, const Vec3& dir, float maxT, float *outT, uint32_t *outTriangle);
+
@@ -0,0 +1,119 @@
+#include "emitter.h"
+#include <math.h>
+#include <stddef.h>
+
+namespace {
+
+const float Pi = 3.14159265358979323846f;
+
+// PCG hash, same as `hash()` in `emit_particles.glsl`
+uint32_t hash(uint32_t v)
+{
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+// Uniform in [0, 1), advances the state
+float random01(uint32_t *state)
+{
+	*state = hash(*state);
+	return (float)(*state >> 8) * (1.0f / 16777216.0f);
+}
+
+float randomSigned(uint32_t *state)
+{
+	return random01(state) * 2.0f - 1.0f;
+}
+
+Vec3 randomSpread(uint32_t *state, const Vec3& spread)
+{
+	float x = randomSigned(state);
+	float y = randomSigned(state);
+	float z = randomSigned(state);
+	return vec3(x * spread.x, y * spread.y, z * spread.z);
+}
+
+}
+
+void InitParticleEmitters(ParticleEmitters *pe)
+{
+	pe->Emitters.clear();
+	pe->NextId = 1;
+}
+
+uint32_t AddParticleEmitter(ParticleEmitters *pe, const ParticleEmitter& emitter)
+{
+	EmitterState e;
+	e.Desc = emitter;
+	e.Id = pe->NextId++;
+	e.Emitted = 0;
+	e.Pending = (float)emitter.Burst;
+	pe->Emitters.push_back(e);
+	return e.Id;
+}
+
+void RemoveParticleEmitter(ParticleEmitters *pe, uint32_t id)
+{
+	for (size_t i = 0; i < pe->Emitters.size(); i++)
+	{
+		if (pe->Emitters[i].Id == id)
+		{
+			pe->Emitters.erase(pe->Emitters.begin() + i);
+			return;
+		}
+	}
+}
+
+void StepParticleEmitters(ParticleEmitters *pe, float dt, std::vector<EmitBatch>& batches)
+{
+	for (size_t i = 0; i < pe->Emitters.size(); )
+	{
+		EmitterState *e = &pe->Emitters[i];
+
+		uint32_t count = (uint32_t)e->Pending;
+		e->Pending -= (float)count;
+
+		if (count > 0)
+		{
+			EmitBatch batch;
+			batch.Emitter = e->Desc;
+			batch.First = e->Emitted;
+			batch.Count = count;
+			batches.push_back(batch);
+			e->Emitted += count;
+		}
+
+		if (e->Desc.Rate <= 0.0f)
+		{
+			pe->Emitters.erase(pe->Emitters.begin() + i);
+			continue;
+		}
+
+		e->Pending += e->Desc.Rate * dt;
+		i++;
+	}
+}
+
+void EmitParticle(const ParticleEmitter& emitter, uint32_t index, Particle *p)
+{
+	uint32_t state = hash(emitter.Seed ^ hash(index));
+
+	Vec3 offset = vec3(0.0f, 0.0f, 0.0f);
+	if (emitter.Shape == EmitterBox)
+	{
+		offset = randomSpread(&state, emitter.Extent);
+	}
+	else if (emitter.Shape == EmitterSphere)
+	{
+		float z = randomSigned(&state);
+		float phi = random01(&state) * 2.0f * Pi;
+		float r = emitter.Extent.x * cbrtf(random01(&state));
+		float xy = sqrtf(1.0f - z * z);
+		offset = vec3(cosf(phi) * xy, sinf(phi) * xy, z) * r;
+	}
+
+	p->Position = emitter.Position + offset;
+	p->Velocity = emitter.Velocity + randomSpread(&state, emitter.VelocitySpread);
+	p->Lifetime = emitter.Lifetime + randomSigned(&state) * emitter.LifetimeSpread;
+}
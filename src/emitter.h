@@ -0,0 +1,39 @@
+#pragma once
+
+#include "particles.h"
+#include <stdint.h>
+#include <vector>
+
+// Particles [First, First + Count) of an emitter to spawn this frame
+struct EmitBatch
+{
+	ParticleEmitter Emitter;
+	uint32_t First;
+	uint32_t Count;
+};
+
+struct EmitterState
+{
+	ParticleEmitter Desc;
+	uint32_t Id;
+	uint32_t Emitted;
+	float Pending;
+};
+
+struct ParticleEmitters
+{
+	std::vector<EmitterState> Emitters;
+	uint32_t NextId;
+};
+
+void InitParticleEmitters(ParticleEmitters *pe);
+uint32_t AddParticleEmitter(ParticleEmitters *pe, const ParticleEmitter& emitter);
+void RemoveParticleEmitter(ParticleEmitters *pe, uint32_t id);
+
+// Appends the particles due in the next `dt` to `batches`, the first step
+// after adding an emitter includes its burst.
+void StepParticleEmitters(ParticleEmitters *pe, float dt, std::vector<EmitBatch>& batches);
+
+// Builds particle `index` of the emitter, matches `emit_particles.glsl` up
+// to float precision.
+void EmitParticle(const ParticleEmitter& emitter, uint32_t index, Particle *p);
@@ -0,0 +1,152 @@
+#include "gpu_grid.h"
+#include "gpu_scan.h"
+#include "grid.h"
+#include "renderer.h"
+#include "util.h"
+#include <vector>
+
+namespace {
+
+const uint32_t GridBuildGroupSize = 64;
+const uint32_t GridBuildMaxGroups = 65535;
+
+enum GridBinPass
+{
+	GridBinCount,
+	GridBinScatter,
+};
+
+struct GridBuildUniform
+{
+	// xyz: grid base, w: cell size
+	float u_Base[4];
+	// x: inverse cell size, y: padding, z: half size of the padded cells
+	float u_Cell[4];
+	// xyz: cells along each axis, w: number of triangles
+	int u_Size[4];
+	// x: `GridBinPass`
+	int u_Pass[4];
+};
+
+// Triangles as read by `grid_bin.glsl`, the w components are unused
+struct GpuGridTriangle
+{
+	float P[3][4];
+};
+
+}
+
+struct GpuGridBuilder
+{
+	Shader *BinShader;
+	Shader *CellsShader;
+	GpuScan *Scan;
+
+	Buffer *Triangles;
+	Buffer *Counts;
+	Buffer *Cursors;
+	Buffer *Uniforms[2];
+	std::vector<GpuGridTriangle> Upload;
+};
+
+GpuGridBuilder *CreateGpuGridBuilder()
+{
+	GpuGridBuilder *gb = new GpuGridBuilder();
+	gb->BinShader = LoadComputeShader("shader/grid/grid_bin");
+	gb->CellsShader = LoadComputeShader("shader/grid/grid_cells");
+	gb->Scan = CreateGpuScan();
+
+	gb->Triangles = CreateBuffer(BufferStorage);
+	gb->Counts = CreateBuffer(BufferStorage);
+	gb->Cursors = CreateBuffer(BufferStorage);
+	for (uint32_t i = 0; i < ArrayCount(gb->Uniforms); i++)
+		gb->Uniforms[i] = CreateStaticBuffer(BufferUniform, NULL, sizeof(GridBuildUniform));
+	return gb;
+}
+
+// Spreads the groups over y past the dispatch limit, the shaders rebuild
+// the linear index from `gl_NumWorkGroups`.
+static void dispatchLinear(CommandBuffer *cb, uint32_t count)
+{
+	uint32_t groups = (count + GridBuildGroupSize - 1) / GridBuildGroupSize;
+	uint32_t y = (groups + GridBuildMaxGroups - 1) / GridBuildMaxGroups;
+	uint32_t x = groups < GridBuildMaxGroups ? groups : GridBuildMaxGroups;
+	if (groups > 0)
+		DispatchCompute(cb, x, y, 1);
+}
+
+void BuildGpuUniformGrid(GpuGridBuilder *gb, CommandBuffer *cb, UniformGrid *grid, const Triangle *triangles, uint32_t count,
+	float cellSize, float padding, Buffer *cells, Buffer *cellTriangles)
+{
+	FitUniformGrid(grid, triangles, count, cellSize, padding);
+	if (count == 0)
+		return;
+
+	uint32_t numCells = (uint32_t)(grid->Size[0] * grid->Size[1] * grid->Size[2]);
+	uint64_t maxPairs = CountGridPairBound(grid, triangles, count);
+
+	gb->Upload.resize(count);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		for (uint32_t p = 0; p < 3; p++)
+		{
+			gb->Upload[i].P[p][0] = triangles[i].P[p].x;
+			gb->Upload[i].P[p][1] = triangles[i].P[p].y;
+			gb->Upload[i].P[p][2] = triangles[i].P[p].z;
+			gb->Upload[i].P[p][3] = 0.0f;
+		}
+	}
+	SetBufferData(gb->Triangles, gb->Upload.data(), count * sizeof(GpuGridTriangle));
+
+	// The scan turns the counts into the cell starts plus the total
+	ReserveUndefinedBuffer(gb->Counts, (numCells + 1) * sizeof(uint32_t), true);
+	ReserveUndefinedBuffer(gb->Cursors, numCells * sizeof(uint32_t), true);
+	ReserveUndefinedBuffer(cells, numCells * 4 * sizeof(int), true);
+	ReserveUndefinedBuffer(cellTriangles, (size_t)maxPairs * sizeof(uint32_t), true);
+
+	for (uint32_t pass = 0; pass < ArrayCount(gb->Uniforms); pass++)
+	{
+		GridBuildUniform u = { };
+		u.u_Base[0] = grid->Base.x;
+		u.u_Base[1] = grid->Base.y;
+		u.u_Base[2] = grid->Base.z;
+		u.u_Base[3] = cellSize;
+		u.u_Cell[0] = 1.0f / cellSize;
+		u.u_Cell[1] = padding;
+		u.u_Cell[2] = cellSize * 0.5f + padding;
+		u.u_Size[0] = grid->Size[0];
+		u.u_Size[1] = grid->Size[1];
+		u.u_Size[2] = grid->Size[2];
+		u.u_Size[3] = (int)count;
+		u.u_Pass[0] = (int)pass;
+		SetBufferData(gb->Uniforms[pass], &u, sizeof(u));
+	}
+
+	ClearBufferData(cb, gb->Counts, 0, (numCells + 1) * sizeof(uint32_t));
+
+	SetShader(cb, gb->BinShader);
+	SetUniformBuffer(cb, 0, gb->Uniforms[GridBinCount]);
+	SetStorageBuffer(cb, 0, gb->Triangles);
+	SetStorageBuffer(cb, 1, gb->Counts);
+	dispatchLinear(cb, count);
+	ComputeBarrier(cb);
+
+	GpuScanExclusive(gb->Scan, cb, gb->Counts, 0, numCells + 1);
+	CopyBufferData(cb, gb->Cursors, gb->Counts, 0, 0, numCells * sizeof(uint32_t));
+
+	SetShader(cb, gb->BinShader);
+	SetUniformBuffer(cb, 0, gb->Uniforms[GridBinScatter]);
+	SetStorageBuffer(cb, 0, gb->Triangles);
+	SetStorageBuffer(cb, 2, gb->Cursors);
+	SetStorageBuffer(cb, 3, cellTriangles);
+	dispatchLinear(cb, count);
+	ComputeBarrier(cb);
+
+	SetShader(cb, gb->CellsShader);
+	SetUniformBuffer(cb, 0, gb->Uniforms[GridBinScatter]);
+	SetStorageBuffer(cb, 1, gb->Counts);
+	SetStorageBuffer(cb, 3, cellTriangles);
+	SetStorageBuffer(cb, 4, cells);
+	dispatchLinear(cb, numCells);
+	ComputeBarrier(cb);
+}
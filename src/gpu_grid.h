@@ -0,0 +1,22 @@
+#pragma once
+
+#include "intersection.h"
+#include <stdint.h>
+
+struct Buffer;
+struct CommandBuffer;
+struct UniformGrid;
+struct GpuGridBuilder;
+
+// Dense grid build in compute shaders, the triangles are uploaded as is
+// and binned with the same math as `BuildUniformGrid()`: an atomic count
+// pass, a prefix sum, an atomic scatter and a sort of every cell.
+GpuGridBuilder *CreateGpuGridBuilder();
+
+// Fits `grid` to the triangles like `BuildUniformGrid()` but leaves its
+// cell lists empty, the cells are only written to the buffers:
+// `cells` gets an ivec4 (first, end, count, capacity) per cell, x-major,
+// and `cellTriangles` the ascending triangle indices of every cell. Both
+// are resized, nothing is read back.
+void BuildGpuUniformGrid(GpuGridBuilder *gb, CommandBuffer *cb, UniformGrid *grid, const Triangle *triangles, uint32_t count,
+	float cellSize, float padding, Buffer *cells, Buffer *cellTriangles);
@@ -0,0 +1,96 @@
+#include "gpu_scan.h"
+#include "renderer.h"
+#include "util.h"
+
+namespace {
+
+const uint32_t ScanBlockSize = 512;
+const uint32_t ScanMaxLevels = 4;
+const uint32_t ScanMaxGroups = 65535;
+
+struct ScanUniform
+{
+	uint32_t u_Scan[4];
+};
+
+// Block sums of one level of the recursion
+struct ScanLevel
+{
+	Buffer *BlockSums;
+	uint32_t Capacity;
+};
+
+}
+
+struct GpuScan
+{
+	Shader *BlocksShader;
+	Shader *AddShader;
+	ScanLevel Levels[ScanMaxLevels];
+};
+
+GpuScan *CreateGpuScan()
+{
+	GpuScan *s = new GpuScan();
+	s->BlocksShader = LoadComputeShader("shader/scan/scan_blocks");
+	s->AddShader = LoadComputeShader("shader/scan/scan_add");
+
+	for (uint32_t i = 0; i < ScanMaxLevels; i++)
+	{
+		s->Levels[i].BlockSums = CreateBuffer(BufferStorage);
+		s->Levels[i].Capacity = 0;
+	}
+
+	return s;
+}
+
+// One group per block, spread over y past the dispatch limit
+static void dispatchBlocks(CommandBuffer *cb, uint32_t numBlocks)
+{
+	uint32_t y = (numBlocks + ScanMaxGroups - 1) / ScanMaxGroups;
+	uint32_t x = numBlocks < ScanMaxGroups ? numBlocks : ScanMaxGroups;
+	DispatchCompute(cb, x, y, 1);
+}
+
+static void scanLevel(GpuScan *s, CommandBuffer *cb, Buffer *b, uint32_t first, uint32_t count, uint32_t level)
+{
+	ScanLevel *l = &s->Levels[level];
+	uint32_t numBlocks = (count + ScanBlockSize - 1) / ScanBlockSize;
+
+	if (numBlocks > l->Capacity)
+	{
+		ReserveUndefinedBuffer(l->BlockSums, numBlocks * sizeof(uint32_t), false);
+		l->Capacity = numBlocks;
+	}
+
+	ScanUniform u = { };
+	u.u_Scan[0] = count;
+	u.u_Scan[1] = first;
+
+	SetShader(cb, s->BlocksShader);
+	PushUniformData(cb, 0, &u, sizeof(u));
+	SetStorageBuffer(cb, 0, b);
+	SetStorageBuffer(cb, 1, l->BlockSums);
+	dispatchBlocks(cb, numBlocks);
+	ComputeBarrier(cb);
+
+	if (numBlocks == 1)
+		return;
+
+	scanLevel(s, cb, l->BlockSums, 0, numBlocks, level + 1);
+
+	// The next level bound its own uniforms
+	SetShader(cb, s->AddShader);
+	PushUniformData(cb, 0, &u, sizeof(u));
+	SetStorageBuffer(cb, 0, b);
+	SetStorageBuffer(cb, 1, l->BlockSums);
+	dispatchBlocks(cb, numBlocks);
+	ComputeBarrier(cb);
+}
+
+void GpuScanExclusive(GpuScan *s, CommandBuffer *cb, Buffer *b, uint32_t first, uint32_t count)
+{
+	// 4 levels cover 512^4 values
+	if (count > 0)
+		scanLevel(s, cb, b, first, count, 0);
+}
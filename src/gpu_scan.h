@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+struct Buffer;
+struct CommandBuffer;
+struct GpuScan;
+
+// Exclusive prefix sum of uint32 values on the GPU. Blocks of 512 values
+// are scanned in shared memory, the block sums are scanned recursively and
+// added back.
+GpuScan *CreateGpuScan();
+
+// Scans the `count` values starting at element `first` of `b` in place,
+// results are visible to the following commands.
+void GpuScanExclusive(GpuScan *s, CommandBuffer *cb, Buffer *b, uint32_t first, uint32_t count);
@@ -0,0 +1,494 @@
+#include "grid.h"
+#include "jobs.h"
+#include "fastmath.h"
+#include "simd.h"
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+namespace {
+
+const uint32_t GridTriangleChunkSize = 256;
+const uint32_t GridCellChunkSize = 1024;
+
+// Cell and triangle of a sparse build, the cell key packs the coordinates
+// in 21 bits each so sorting by key sorts by z, y, x.
+struct GridPair
+{
+	uint64_t Key;
+	uint32_t Triangle;
+};
+
+const uint32_t GridKeyBits = 21;
+const int GridMaxSparseSize = 1 << GridKeyBits;
+
+struct GridBuilder
+{
+	UniformGrid *Grid;
+	const Triangle *Triangles;
+
+	// Dense: per cell triangle counts in the first pass, write cursors in
+	// the second
+	std::unique_ptr<std::atomic<uint32_t>[]> Cursors;
+
+	// Sparse: per triangle pair counts, then the offsets into `Pairs`
+	std::vector<uint32_t> PairStart;
+	std::vector<GridPair> Pairs;
+};
+
+typedef void (*GridPassFunc)(GridBuilder *b, uint32_t begin, uint32_t end);
+
+struct GridPass
+{
+	GridBuilder *B;
+	GridPassFunc Func;
+};
+
+int clampCell(float v, int size)
+{
+	int c = (int)floorf(v);
+	return c < 0 ? 0 : c >= size ? size - 1 : c;
+}
+
+// Inclusive range of cells whose padded bounds overlap the triangle bounds
+void triangleCells(const UniformGrid *grid, const Triangle& t, int lo[3], int hi[3])
+{
+	float invCellSize = 1.0f / grid->CellSize;
+	float pad = grid->Padding;
+	float base[3] = { grid->Base.x, grid->Base.y, grid->Base.z };
+
+	for (uint32_t axis = 0; axis < 3; axis++)
+	{
+		float a = axis == 0 ? t.A.x : axis == 1 ? t.A.y : t.A.z;
+		float b = axis == 0 ? t.B.x : axis == 1 ? t.B.y : t.B.z;
+		float c = axis == 0 ? t.C.x : axis == 1 ? t.C.y : t.C.z;
+		float tmin = F_MIN(a, F_MIN(b, c));
+		float tmax = F_MAX(a, F_MAX(b, c));
+
+		// Cell x spans [x - pad, x + 1 + pad] in cell units
+		lo[axis] = clampCell(ceilf((tmin - pad - base[axis]) * invCellSize - 1.0f), grid->Size[axis]);
+		hi[axis] = clampCell((tmax + pad - base[axis]) * invCellSize, grid->Size[axis]);
+	}
+}
+
+// Calls `func(x, y, z)` for every cell that the triangle overlaps. The cells
+// in the bounds are tested exactly with SAT, 8 cells of a row at a time.
+template <typename Func>
+void forTriangleCells(const UniformGrid *grid, const Triangle& t, Func func)
+{
+	int lo[3], hi[3];
+	triangleCells(grid, t, lo, hi);
+
+	float cellSize = grid->CellSize;
+	Vec3 halfSize = vec3s(cellSize * 0.5f + grid->Padding);
+
+	TriangleBoxAxes axes;
+	SetupTriangleBoxAxes(&axes, t, halfSize);
+
+	float cx[8], cy[8], cz[8];
+	for (int z = lo[2]; z <= hi[2]; z++)
+	for (int y = lo[1]; y <= hi[1]; y++)
+	{
+		float centerY = grid->Base.y + ((float)y + 0.5f) * cellSize;
+		float centerZ = grid->Base.z + ((float)z + 0.5f) * cellSize;
+
+		for (int x = lo[0]; x <= hi[0]; x += 8)
+		{
+			for (uint32_t lane = 0; lane < 8; lane++)
+			{
+				cx[lane] = grid->Base.x + ((float)(x + (int)lane) + 0.5f) * cellSize;
+				cy[lane] = centerY;
+				cz[lane] = centerZ;
+			}
+
+			uint32_t mask = IntersectAABBs8vTriangle(axes, cx, cy, cz);
+			if (hi[0] - x < 7)
+				mask &= (1U << (hi[0] - x + 1)) - 1;
+
+			for (; mask; mask &= mask - 1)
+				func(x + (int)CountTrailingZeros(mask), y, z);
+		}
+	}
+}
+
+uint32_t denseCell(const UniformGrid *grid, int x, int y, int z)
+{
+	return (uint32_t)(x + (y + z * grid->Size[1]) * grid->Size[0]);
+}
+
+// Index of the cell or -1 if a sparse grid doesn't store it
+int findCell(const UniformGrid *grid, int x, int y, int z)
+{
+	if (!grid->Sparse)
+		return (int)denseCell(grid, x, y, z);
+
+	GridCoord c = { x, y, z };
+	const GridCoord *begin = grid->Coords.data();
+	const GridCoord *end = begin + grid->Coords.size();
+	const GridCoord *it = std::lower_bound(begin, end, c, [](const GridCoord& l, const GridCoord& r) {
+		if (l.Z != r.Z) return l.Z < r.Z;
+		if (l.Y != r.Y) return l.Y < r.Y;
+		return l.X < r.X;
+	});
+	if (it == end || it->X != x || it->Y != y || it->Z != z)
+		return -1;
+	return (int)(it - begin);
+}
+
+// The cell ranges of `triangleCells()` are clamped, check that nothing of
+// the triangle would be cut off.
+bool insideGrid(const UniformGrid *grid, const Triangle& t)
+{
+	float invCellSize = 1.0f / grid->CellSize;
+	for (uint32_t p = 0; p < 3; p++)
+	{
+		Vec3 c = (t.P[p] - grid->Base) * invCellSize;
+		if (c.x < 0.0f || c.y < 0.0f || c.z < 0.0f)
+			return false;
+		if (c.x >= (float)grid->Size[0] || c.y >= (float)grid->Size[1] || c.z >= (float)grid->Size[2])
+			return false;
+	}
+	return true;
+}
+
+void countPass(GridBuilder *b, uint32_t begin, uint32_t end)
+{
+	for (uint32_t i = begin; i < end; i++)
+	{
+		forTriangleCells(b->Grid, b->Triangles[i], [&](int x, int y, int z) {
+			b->Cursors[denseCell(b->Grid, x, y, z)].fetch_add(1, std::memory_order_relaxed);
+		});
+	}
+}
+
+void scatterPass(GridBuilder *b, uint32_t begin, uint32_t end)
+{
+	uint32_t *tris = b->Grid->Triangles.data();
+	for (uint32_t i = begin; i < end; i++)
+	{
+		forTriangleCells(b->Grid, b->Triangles[i], [&](int x, int y, int z) {
+			tris[b->Cursors[denseCell(b->Grid, x, y, z)].fetch_add(1, std::memory_order_relaxed)] = i;
+		});
+	}
+}
+
+void countPairsPass(GridBuilder *b, uint32_t begin, uint32_t end)
+{
+	for (uint32_t i = begin; i < end; i++)
+	{
+		uint32_t num = 0;
+		forTriangleCells(b->Grid, b->Triangles[i], [&](int x, int y, int z) {
+			num++;
+		});
+		b->PairStart[i] = num;
+	}
+}
+
+void writePairsPass(GridBuilder *b, uint32_t begin, uint32_t end)
+{
+	for (uint32_t i = begin; i < end; i++)
+	{
+		GridPair *pair = &b->Pairs[b->PairStart[i]];
+		forTriangleCells(b->Grid, b->Triangles[i], [&](int x, int y, int z) {
+			pair->Key = (uint64_t)z << (2 * GridKeyBits) | (uint64_t)y << GridKeyBits | (uint64_t)x;
+			pair->Triangle = i;
+			pair++;
+		});
+	}
+}
+
+// The scatter order depends on the thread timing, sort every cell back to
+// ascending triangle order.
+void sortPass(GridBuilder *b, uint32_t begin, uint32_t end)
+{
+	UniformGrid *grid = b->Grid;
+	uint32_t *tris = grid->Triangles.data();
+	for (uint32_t cell = begin; cell < end; cell++)
+	{
+		uint32_t first = grid->CellStart[cell];
+		uint32_t last = grid->CellStart[cell + 1];
+		if (last - first > 1)
+			std::sort(tris + first, tris + last);
+	}
+}
+
+void gridPassJob(void *user, uint32_t begin, uint32_t end, uint32_t thread)
+{
+	GridPass *pass = (GridPass*)user;
+	pass->Func(pass->B, begin, end);
+}
+
+void runGridPass(JobPool *jobs, GridBuilder *b, uint32_t count, uint32_t chunkSize, GridPassFunc func)
+{
+	if (!jobs)
+	{
+		func(b, 0, count);
+		return;
+	}
+
+	GridPass pass = { b, func };
+	RunJobRange(jobs, count, chunkSize, &gridPassJob, &pass);
+}
+
+// Resets the grid and fits it to the bounds, false if there's nothing to build
+bool setupGrid(UniformGrid *grid, const Triangle *triangles, uint32_t count, float cellSize, float padding, bool sparse)
+{
+	grid->CellSize = cellSize;
+	grid->Padding = padding;
+	grid->Sparse = sparse;
+	grid->Coords.clear();
+	grid->CellStart.clear();
+	grid->CellCount.clear();
+	grid->Triangles.clear();
+
+	if (count == 0)
+	{
+		grid->Base = vec3s(0.0f);
+		grid->Size[0] = grid->Size[1] = grid->Size[2] = 0;
+		grid->CellStart.push_back(0);
+		return false;
+	}
+
+	Vec3 min = triangles[0].A, max = min;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		for (uint32_t p = 0; p < 3; p++)
+		{
+			const Vec3 &v = triangles[i].P[p];
+			min = vec3(F_MIN(min.x, v.x), F_MIN(min.y, v.y), F_MIN(min.z, v.z));
+			max = vec3(F_MAX(max.x, v.x), F_MAX(max.y, v.y), F_MAX(max.z, v.z));
+		}
+	}
+
+	grid->Base = min;
+	grid->Size[0] = (int)((max.x - min.x) / cellSize) + 1;
+	grid->Size[1] = (int)((max.y - min.y) / cellSize) + 1;
+	grid->Size[2] = (int)((max.z - min.z) / cellSize) + 1;
+	return true;
+}
+
+}
+
+void BuildUniformGrid(UniformGrid *grid, JobPool *jobs, const Triangle *triangles, uint32_t count, float cellSize, float padding)
+{
+	if (!setupGrid(grid, triangles, count, cellSize, padding, false))
+		return;
+
+	uint32_t numCells = (uint32_t)(grid->Size[0] * grid->Size[1] * grid->Size[2]);
+
+	GridBuilder b;
+	b.Grid = grid;
+	b.Triangles = triangles;
+	b.Cursors.reset(new std::atomic<uint32_t>[numCells]);
+	for (uint32_t i = 0; i < numCells; i++)
+		b.Cursors[i].store(0, std::memory_order_relaxed);
+
+	runGridPass(jobs, &b, count, GridTriangleChunkSize, &countPass);
+
+	// Exclusive prefix sum of the counts, the cursors start at the cell bases
+	grid->CellStart.resize(numCells + 1);
+	uint32_t total = 0;
+	for (uint32_t i = 0; i < numCells; i++)
+	{
+		uint32_t num = b.Cursors[i].load(std::memory_order_relaxed);
+		grid->CellStart[i] = total;
+		b.Cursors[i].store(total, std::memory_order_relaxed);
+		total += num;
+	}
+	grid->CellStart[numCells] = total;
+
+	grid->Triangles.resize(total);
+	runGridPass(jobs, &b, count, GridTriangleChunkSize, &scatterPass);
+	runGridPass(jobs, &b, numCells, GridCellChunkSize, &sortPass);
+}
+
+void BuildSparseGrid(UniformGrid *grid, JobPool *jobs, const Triangle *triangles, uint32_t count, float cellSize, float padding)
+{
+	if (!setupGrid(grid, triangles, count, cellSize, padding, true))
+		return;
+
+	// Cells past the key range are dropped, that's 2M cells along an axis
+	for (uint32_t axis = 0; axis < 3; axis++)
+	{
+		if (grid->Size[axis] > GridMaxSparseSize)
+			grid->Size[axis] = GridMaxSparseSize;
+	}
+
+	GridBuilder b;
+	b.Grid = grid;
+	b.Triangles = triangles;
+	b.PairStart.resize(count);
+
+	runGridPass(jobs, &b, count, GridTriangleChunkSize, &countPairsPass);
+
+	uint32_t total = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t num = b.PairStart[i];
+		b.PairStart[i] = total;
+		total += num;
+	}
+
+	// Pairs are written in triangle order, a stable sort by cell keeps the
+	// triangles of every cell ascending.
+	b.Pairs.resize(total);
+	runGridPass(jobs, &b, count, GridTriangleChunkSize, &writePairsPass);
+	std::stable_sort(b.Pairs.begin(), b.Pairs.end(), [](const GridPair& l, const GridPair& r) {
+		return l.Key < r.Key;
+	});
+
+	const uint64_t keyMask = ((uint64_t)1 << GridKeyBits) - 1;
+	grid->Triangles.resize(total);
+	for (uint32_t i = 0; i < total; i++)
+	{
+		const GridPair *pair = &b.Pairs[i];
+		if (i == 0 || pair->Key != b.Pairs[i - 1].Key)
+		{
+			GridCoord c;
+			c.X = (int)(pair->Key & keyMask);
+			c.Y = (int)(pair->Key >> GridKeyBits & keyMask);
+			c.Z = (int)(pair->Key >> (2 * GridKeyBits));
+			grid->Coords.push_back(c);
+			grid->CellStart.push_back(i);
+		}
+		grid->Triangles[i] = pair->Triangle;
+	}
+	grid->CellStart.push_back(total);
+}
+
+void FitUniformGrid(UniformGrid *grid, const Triangle *triangles, uint32_t count, float cellSize, float padding)
+{
+	setupGrid(grid, triangles, count, cellSize, padding, false);
+}
+
+uint64_t CountGridPairBound(const UniformGrid *grid, const Triangle *triangles, uint32_t count)
+{
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		int lo[3], hi[3];
+		triangleCells(grid, triangles[i], lo, hi);
+		total += (uint64_t)(hi[0] - lo[0] + 1) * (uint64_t)(hi[1] - lo[1] + 1) * (uint64_t)(hi[2] - lo[2] + 1);
+	}
+	return total;
+}
+
+void ReserveGridSlack(UniformGrid *grid, float slack, uint32_t minSlack)
+{
+	uint32_t numCells = (uint32_t)grid->CellStart.size() - 1;
+	bool packed = grid->CellCount.empty();
+
+	std::vector<uint32_t> start(numCells + 1);
+	std::vector<uint32_t> count(numCells);
+	uint32_t total = 0;
+	for (uint32_t cell = 0; cell < numCells; cell++)
+	{
+		uint32_t num = packed ? grid->CellStart[cell + 1] - grid->CellStart[cell] : grid->CellCount[cell];
+		start[cell] = total;
+		count[cell] = num;
+		uint32_t extra = (uint32_t)((float)num * slack);
+		total += num + (extra > minSlack ? extra : minSlack);
+	}
+	start[numCells] = total;
+
+	std::vector<uint32_t> tris(total);
+	for (uint32_t cell = 0; cell < numCells; cell++)
+	{
+		const uint32_t *src = &grid->Triangles[grid->CellStart[cell]];
+		std::copy(src, src + count[cell], tris.begin() + start[cell]);
+	}
+
+	grid->CellStart.swap(start);
+	grid->CellCount.swap(count);
+	grid->Triangles.swap(tris);
+}
+
+bool MoveGridTriangle(UniformGrid *grid, uint32_t index, const Triangle& from, const Triangle& to, std::vector<uint32_t>& dirtyCells)
+{
+	if (grid->CellCount.empty() || !insideGrid(grid, to))
+		return false;
+
+	// `from` visits the same cells it was binned into
+	forTriangleCells(grid, from, [&](int x, int y, int z) {
+		int cell = findCell(grid, x, y, z);
+		if (cell < 0)
+			return;
+
+		uint32_t *first = &grid->Triangles[grid->CellStart[cell]];
+		uint32_t *last = first + grid->CellCount[cell];
+		uint32_t *it = std::lower_bound(first, last, index);
+		if (it == last || *it != index)
+			return;
+
+		std::copy(it + 1, last, it);
+		grid->CellCount[cell]--;
+		dirtyCells.push_back((uint32_t)cell);
+	});
+
+	bool fits = true;
+	forTriangleCells(grid, to, [&](int x, int y, int z) {
+		int cell = findCell(grid, x, y, z);
+		if (cell < 0)
+		{
+			fits = false;
+			return;
+		}
+
+		uint32_t *first = &grid->Triangles[grid->CellStart[cell]];
+		uint32_t *last = first + grid->CellCount[cell];
+		uint32_t *it = std::lower_bound(first, last, index);
+		if (it != last && *it == index)
+			return;
+
+		uint32_t capacity = grid->CellStart[cell + 1] - grid->CellStart[cell];
+		if (grid->CellCount[cell] == capacity)
+		{
+			fits = false;
+			return;
+		}
+
+		std::copy_backward(it, last, last + 1);
+		*it = index;
+		grid->CellCount[cell]++;
+		dirtyCells.push_back((uint32_t)cell);
+	});
+
+	return fits;
+}
+
+void BuildGridHashTable(const UniformGrid *grid, std::vector<GridHashSlot>& slots, uint32_t *maxProbes)
+{
+	uint32_t numCells = (uint32_t)grid->Coords.size();
+	uint32_t capacity = 1;
+	while (capacity < numCells * 2)
+		capacity *= 2;
+
+	GridHashSlot empty = { 0, 0, 0, -1 };
+	slots.assign(capacity, empty);
+
+	uint32_t mask = capacity - 1;
+	uint32_t longest = 0;
+	for (uint32_t cellI = 0; cellI < numCells; cellI++)
+	{
+		const GridCoord &c = grid->Coords[cellI];
+		uint32_t slot = GridHash(c.X, c.Y, c.Z) & mask;
+		uint32_t probes = 1;
+		while (slots[slot].Cell >= 0)
+		{
+			slot = (slot + 1) & mask;
+			probes++;
+		}
+
+		GridHashSlot *s = &slots[slot];
+		s->X = c.X;
+		s->Y = c.Y;
+		s->Z = c.Z;
+		s->Cell = (int)cellI;
+
+		if (probes > longest)
+			longest = probes;
+	}
+
+	*maxProbes = longest;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "intersection.h"
+#include <stdint.h>
+#include <vector>
+
+struct JobPool;
+
+struct GridCoord
+{
+	int X, Y, Z;
+};
+
+// Uniform grid over the bounds of a triangle soup. Every cell lists the
+// triangles that overlap the cell grown by `Padding`.
+//
+// Dense grids store every cell in the bounds, x-major:
+// x + (y + z * Size[1]) * Size[0]. Sparse grids only store the occupied
+// cells, sorted by z, y, x, with their coordinates in `Coords`.
+struct UniformGrid
+{
+	Vec3 Base;
+	float CellSize;
+	float Padding;
+	int Size[3];
+
+	bool Sparse;
+	std::vector<GridCoord> Coords;
+
+	// Triangles of cell `c` are `Triangles[CellStart[c] .. CellStart[c + 1])`
+	// in ascending order. After `ReserveGridSlack()` cell `c` only uses the
+	// first `CellCount[c]` entries of its range, the rest is free.
+	std::vector<uint32_t> CellStart;
+	std::vector<uint32_t> CellCount;
+	std::vector<uint32_t> Triangles;
+};
+
+// Binned build, every triangle only visits the cells in its bounds and is
+// tested exactly against them. Runs on `jobs` if not NULL, the result
+// doesn't depend on the threads.
+void BuildUniformGrid(UniformGrid *grid, JobPool *jobs, const Triangle *triangles, uint32_t count, float cellSize, float padding);
+void BuildSparseGrid(UniformGrid *grid, JobPool *jobs, const Triangle *triangles, uint32_t count, float cellSize, float padding);
+
+// Sets up an empty dense grid with the bounds `BuildUniformGrid()` would
+// use, for builds that bin the triangles elsewhere.
+void FitUniformGrid(UniformGrid *grid, const Triangle *triangles, uint32_t count, float cellSize, float padding);
+
+// Upper bound of the triangle/cell pairs of the grid: the cells in the
+// bounds of every triangle, before the exact test.
+uint64_t CountGridPairBound(const UniformGrid *grid, const Triangle *triangles, uint32_t count);
+
+// Spreads the cells out so every cell has room for `slack` times its
+// triangles more, but at least `minSlack`, for `MoveGridTriangle()`.
+void ReserveGridSlack(UniformGrid *grid, float slack, uint32_t minSlack);
+
+// Re-bins triangle `index` after it moved from `from` to `to`, only the
+// cells the two overlap are touched and appended to `dirtyCells`. Fails
+// if `to` leaves the grid bounds, needs a cell a sparse grid doesn't have
+// or a cell runs out of slack, the grid has to be rebuilt then.
+bool MoveGridTriangle(UniformGrid *grid, uint32_t index, const Triangle& from, const Triangle& to, std::vector<uint32_t>& dirtyCells);
+
+// Open addressing hash table of the cells of a sparse grid, probed linearly
+// by `LookupCell()` in `cell_sim.glsl`. Empty slots have `Cell == -1`, a
+// lookup gives up after `maxProbes` slots.
+struct GridHashSlot
+{
+	int X, Y, Z;
+	int Cell;
+};
+
+inline uint32_t GridHash(int x, int y, int z)
+{
+	return (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u;
+}
+
+// Capacity is a power of two at least twice the number of cells
+void BuildGridHashTable(const UniformGrid *grid, std::vector<GridHashSlot>& slots, uint32_t *maxProbes);
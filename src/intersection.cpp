@@ -1,5 +1,8 @@
 #include "intersection.h"
 #include "fastmath.h"
+#include "simd.h"
+#include <float.h>
+#include <string.h>
 
 PlaneRelation CompareAABBvPlane(const Vec3& center, const Vec3& halfSize, const Vec3& normal, float t)
 {
@@ -43,29 +46,37 @@ bool IntersectAABBvTriangle(const Vec3& center, const Vec3& halfSize, const Vec3
 			return false;
 	}
 
-	// Cross axes
+	// Cross products of the box axes and the edges. Both vertices of the edge
+	// project to the same value, so only the edge start and the opposite
+	// vertex need to be tested. With x = (1, 0, 0) cross(x, e) = (0, -e.z, e.y)
+	// and so on.
+	const Vec3 *edges[] = { &e0, &e1, &e2 };
+	const Vec3 *onEdge[] = { &ao, &bo, &co };
+	const Vec3 *opposite[] = { &co, &ao, &bo };
 
-	// --- SLOW
-	Vec3 axes[] = { vec3(1.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f), vec3(0.0f, 0.0f, 1.0f) };
-	Vec3 edges[] = { e0, e1, e2 };
-
-	for (uint32_t axisI = 0; axisI < 3; axisI++)
+	for (uint32_t edgeI = 0; edgeI < 3; edgeI++)
 	{
-		Vec3 axis = axes[axisI];
-		for (uint32_t edgeI = 0; edgeI < 3; edgeI++)
-		{
-			Vec3 edge = edges[edgeI];
+		Vec3 e = *edges[edgeI];
+		Vec3 p = *onEdge[edgeI];
+		Vec3 q = *opposite[edgeI];
+		Vec3 ae = absVec(e);
 
-			Vec3 separatingAxis = cross(axis, edge);
-			float radius = dot(absVec(separatingAxis), halfSize);
+		float p0, p1, r;
 
-			float pa = dot(separatingAxis, a);
-			float pb = dot(separatingAxis, b);
-			float pc = dot(separatingAxis, c);
+		p0 = p.z * e.y - p.y * e.z;
+		p1 = q.z * e.y - q.y * e.z;
+		r = halfSize.y * ae.z + halfSize.z * ae.y;
+		if (F_MIN(p0, p1) > r || F_MAX(p0, p1) < -r) return false;
 
-			if (F_MAX3(pa, pb, pc) < -radius || F_MIN3(pa, pb, pc) > radius)
-				return false;
-		}
+		p0 = p.x * e.z - p.z * e.x;
+		p1 = q.x * e.z - q.z * e.x;
+		r = halfSize.x * ae.z + halfSize.z * ae.x;
+		if (F_MIN(p0, p1) > r || F_MAX(p0, p1) < -r) return false;
+
+		p0 = p.y * e.x - p.x * e.y;
+		p1 = q.y * e.x - q.x * e.y;
+		r = halfSize.x * ae.y + halfSize.y * ae.x;
+		if (F_MIN(p0, p1) > r || F_MAX(p0, p1) < -r) return false;
 	}
 
 	return true;
@@ -81,28 +92,429 @@ bool IntersectAABBvTriangle(const AABB& aabb, const Triangle& triangle)
 	return IntersectAABBvTriangle((aabb.Min + aabb.Max) * 0.5f, (aabb.Max - aabb.Min) * 0.5f, triangle);
 }
 
-bool IntersectRayvTriangle(const Vec3& origin, const Vec3& dir, const Triangle& triangle, float *outT)
+void SetupTriangleBoxAxes(TriangleBoxAxes *axes, const Triangle& triangle, const Vec3& halfSize)
+{
+	Vec3 e0 = triangle.B - triangle.A;
+	Vec3 e1 = triangle.C - triangle.B;
+	Vec3 e2 = triangle.A - triangle.C;
+
+	Vec3 list[TriangleBoxNumAxes] =
+	{
+		vec3(1.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f), vec3(0.0f, 0.0f, 1.0f),
+		cross(e0, e1),
+	};
+
+	Vec3 edges[] = { e0, e1, e2 };
+	for (uint32_t axisI = 0; axisI < 3; axisI++)
+	{
+		for (uint32_t edgeI = 0; edgeI < 3; edgeI++)
+			list[4 + axisI * 3 + edgeI] = cross(list[axisI], edges[edgeI]);
+	}
+
+	for (uint32_t i = 0; i < TriangleBoxNumAxes; i++)
+	{
+		Vec3 axis = list[i];
+		float pa = dot(axis, triangle.A);
+		float pb = dot(axis, triangle.B);
+		float pc = dot(axis, triangle.C);
+		float r = dot(absVec(axis), halfSize);
+
+		axes->X[i] = axis.x;
+		axes->Y[i] = axis.y;
+		axes->Z[i] = axis.z;
+		axes->Lo[i] = F_MIN3(pa, pb, pc) - r;
+		axes->Hi[i] = F_MAX3(pa, pb, pc) + r;
+	}
+}
+
+static const float RayTriangleEpsilon = 0.00001f;
+
+static bool IntersectRayvTriangleEdges(const Vec3& origin, const Vec3& dir, const Vec3& a, const Vec3& e1, const Vec3& e2, float *outT)
 {
-	Vec3 e1 = triangle.B - triangle.A;
-	Vec3 e2 = triangle.C - triangle.A;
 	Vec3 pvec = cross(dir, e2);
 	float det = dot(e1, pvec);
 
-	if (fabs(det) < 0.00001f)
+	if (fabs(det) < RayTriangleEpsilon)
 		return false;
 
 	float invDet = 1.0f / det;
-	Vec3 tvec = origin - triangle.A;
+	Vec3 tvec = origin - a;
 	float u = dot(tvec, pvec) * invDet;
 	if (u < 0.0f || u > 1.0f)
 		return false;
 
 	Vec3 qvec = cross(tvec, e1);
 	float v = dot(dir, qvec) * invDet;
-	if (v < 0.0f || v > 1.0f)
+	if (v < 0.0f || u + v > 1.0f)
 		return false;
 
 	*outT = dot(e2, qvec) * invDet;
 	return true;
 }
 
+bool IntersectRayvTriangle(const Vec3& origin, const Vec3& dir, const Triangle& triangle, float *outT)
+{
+	return IntersectRayvTriangleEdges(origin, dir, triangle.A, triangle.B - triangle.A, triangle.C - triangle.A, outT);
+}
+
+namespace {
+
+struct Vec3x4
+{
+	__m128 x, y, z;
+};
+
+struct Vec3x8
+{
+	__m256 x, y, z;
+};
+
+SIMD_TARGET_SSE41
+inline Vec3x4 load3x4(const float *x, const float *y, const float *z)
+{
+	Vec3x4 r = { _mm_loadu_ps(x), _mm_loadu_ps(y), _mm_loadu_ps(z) };
+	return r;
+}
+
+SIMD_TARGET_SSE41
+inline Vec3x4 splat3x4(const Vec3& v)
+{
+	Vec3x4 r = { _mm_set1_ps(v.x), _mm_set1_ps(v.y), _mm_set1_ps(v.z) };
+	return r;
+}
+
+// Möller-Trumbore on 4 lanes, same math as `IntersectRayvTriangleEdges()`
+SIMD_TARGET_SSE41
+inline __m128 rayTriangle4(const Vec3x4& o, const Vec3x4& d, const Vec3x4& a, const Vec3x4& e1, const Vec3x4& e2, const __m128& maxT, __m128 *outT)
+{
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+
+	__m128 px = _mm_sub_ps(_mm_mul_ps(d.y, e2.z), _mm_mul_ps(d.z, e2.y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(d.z, e2.x), _mm_mul_ps(d.x, e2.z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(d.x, e2.y), _mm_mul_ps(d.y, e2.x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1.x, px), _mm_mul_ps(e1.y, py)), _mm_mul_ps(e1.z, pz));
+
+	__m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+	__m128 mask = _mm_cmpge_ps(absDet, _mm_set1_ps(RayTriangleEpsilon));
+	__m128 invDet = _mm_div_ps(one, det);
+
+	__m128 tx = _mm_sub_ps(o.x, a.x);
+	__m128 ty = _mm_sub_ps(o.y, a.y);
+	__m128 tz = _mm_sub_ps(o.z, a.z);
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1.z), _mm_mul_ps(tz, e1.y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1.x), _mm_mul_ps(tx, e1.z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1.y), _mm_mul_ps(ty, e1.x));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d.x, qx), _mm_mul_ps(d.y, qy)), _mm_mul_ps(d.z, qz)), invDet);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2.x, qx), _mm_mul_ps(e2.y, qy)), _mm_mul_ps(e2.z, qz)), invDet);
+
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(t, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(t, maxT));
+
+	*outT = _mm_blendv_ps(_mm_set1_ps(FLT_MAX), t, mask);
+	return mask;
+}
+
+SIMD_TARGET_AVX2
+inline Vec3x8 load3x8(const float *x, const float *y, const float *z)
+{
+	Vec3x8 r = { _mm256_loadu_ps(x), _mm256_loadu_ps(y), _mm256_loadu_ps(z) };
+	return r;
+}
+
+SIMD_TARGET_AVX2
+inline Vec3x8 splat3x8(const Vec3& v)
+{
+	Vec3x8 r = { _mm256_set1_ps(v.x), _mm256_set1_ps(v.y), _mm256_set1_ps(v.z) };
+	return r;
+}
+
+// FMA is not used here so that the results match the scalar reference
+SIMD_TARGET_AVX2
+inline __m256 rayTriangle8(const Vec3x8& o, const Vec3x8& d, const Vec3x8& a, const Vec3x8& e1, const Vec3x8& e2, const __m256& maxT, __m256 *outT)
+{
+	__m256 zero = _mm256_setzero_ps();
+	__m256 one = _mm256_set1_ps(1.0f);
+
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(d.y, e2.z), _mm256_mul_ps(d.z, e2.y));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(d.z, e2.x), _mm256_mul_ps(d.x, e2.z));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(d.x, e2.y), _mm256_mul_ps(d.y, e2.x));
+	__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1.x, px), _mm256_mul_ps(e1.y, py)), _mm256_mul_ps(e1.z, pz));
+
+	__m256 absDet = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), det);
+	__m256 mask = _mm256_cmp_ps(absDet, _mm256_set1_ps(RayTriangleEpsilon), _CMP_GE_OQ);
+	__m256 invDet = _mm256_div_ps(one, det);
+
+	__m256 tx = _mm256_sub_ps(o.x, a.x);
+	__m256 ty = _mm256_sub_ps(o.y, a.y);
+	__m256 tz = _mm256_sub_ps(o.z, a.z);
+	__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), invDet);
+
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1.z), _mm256_mul_ps(tz, e1.y));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1.x), _mm256_mul_ps(tx, e1.z));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1.y), _mm256_mul_ps(ty, e1.x));
+	__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d.x, qx), _mm256_mul_ps(d.y, qy)), _mm256_mul_ps(d.z, qz)), invDet);
+	__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2.x, qx), _mm256_mul_ps(e2.y, qy)), _mm256_mul_ps(e2.z, qz)), invDet);
+
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, maxT, _CMP_LE_OQ));
+
+	*outT = _mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), t, mask);
+	return mask;
+}
+
+bool rayTriangleScalar(const Vec3& o, const Vec3& d, const Vec3& a, const Vec3& e1, const Vec3& e2, float maxT, float *outT)
+{
+	*outT = FLT_MAX;
+
+	float t;
+	if (!IntersectRayvTriangleEdges(o, d, a, e1, e2, &t) || t < 0.0f || t > maxT)
+		return false;
+
+	*outT = t;
+	return true;
+}
+
+}
+
+void PackTrianglesSoa8(const Triangle *triangles, uint32_t count, TriangleSoa8 *blocks)
+{
+	uint32_t numBlocks = (count + 7) / 8;
+	memset(blocks, 0, numBlocks * sizeof(TriangleSoa8));
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const Triangle &t = triangles[i];
+		TriangleSoa8 &b = blocks[i / 8];
+		uint32_t lane = i % 8;
+
+		Vec3 e1 = t.B - t.A;
+		Vec3 e2 = t.C - t.A;
+		b.Ax[lane] = t.A.x; b.Ay[lane] = t.A.y; b.Az[lane] = t.A.z;
+		b.E1x[lane] = e1.x; b.E1y[lane] = e1.y; b.E1z[lane] = e1.z;
+		b.E2x[lane] = e2.x; b.E2y[lane] = e2.y; b.E2z[lane] = e2.z;
+	}
+}
+
+uint32_t IntersectRayvTriangles8Scalar(const Vec3& origin, const Vec3& dir, const TriangleSoa8& tris, float maxT, float *outT)
+{
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < 8; i++)
+	{
+		Vec3 a = vec3(tris.Ax[i], tris.Ay[i], tris.Az[i]);
+		Vec3 e1 = vec3(tris.E1x[i], tris.E1y[i], tris.E1z[i]);
+		Vec3 e2 = vec3(tris.E2x[i], tris.E2y[i], tris.E2z[i]);
+		if (rayTriangleScalar(origin, dir, a, e1, e2, maxT, &outT[i]))
+			mask |= 1U << i;
+	}
+	return mask;
+}
+
+SIMD_TARGET_SSE41
+uint32_t IntersectRayvTriangles8Sse41(const Vec3& origin, const Vec3& dir, const TriangleSoa8& tris, float maxT, float *outT)
+{
+	Vec3x4 o = splat3x4(origin);
+	Vec3x4 d = splat3x4(dir);
+	__m128 vmaxT = _mm_set1_ps(maxT);
+
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < 8; i += 4)
+	{
+		Vec3x4 a = load3x4(tris.Ax + i, tris.Ay + i, tris.Az + i);
+		Vec3x4 e1 = load3x4(tris.E1x + i, tris.E1y + i, tris.E1z + i);
+		Vec3x4 e2 = load3x4(tris.E2x + i, tris.E2y + i, tris.E2z + i);
+
+		__m128 t;
+		__m128 hit = rayTriangle4(o, d, a, e1, e2, vmaxT, &t);
+		_mm_storeu_ps(outT + i, t);
+		mask |= (uint32_t)_mm_movemask_ps(hit) << i;
+	}
+	return mask;
+}
+
+SIMD_TARGET_AVX2
+uint32_t IntersectRayvTriangles8Avx2(const Vec3& origin, const Vec3& dir, const TriangleSoa8& tris, float maxT, float *outT)
+{
+	Vec3x8 o = splat3x8(origin);
+	Vec3x8 d = splat3x8(dir);
+	Vec3x8 a = load3x8(tris.Ax, tris.Ay, tris.Az);
+	Vec3x8 e1 = load3x8(tris.E1x, tris.E1y, tris.E1z);
+	Vec3x8 e2 = load3x8(tris.E2x, tris.E2y, tris.E2z);
+	__m256 vmaxT = _mm256_set1_ps(maxT);
+
+	__m256 t;
+	__m256 hit = rayTriangle8(o, d, a, e1, e2, vmaxT, &t);
+	_mm256_storeu_ps(outT, t);
+	return (uint32_t)_mm256_movemask_ps(hit);
+}
+
+uint32_t IntersectRayvTriangles8(const Vec3& origin, const Vec3& dir, const TriangleSoa8& tris, float maxT, float *outT)
+{
+	if (CpuSupportsAvx2())
+		return IntersectRayvTriangles8Avx2(origin, dir, tris, maxT, outT);
+	else if (CpuSupportsSse41())
+		return IntersectRayvTriangles8Sse41(origin, dir, tris, maxT, outT);
+	else
+		return IntersectRayvTriangles8Scalar(origin, dir, tris, maxT, outT);
+}
+
+uint32_t IntersectRays8vTriangleScalar(const RaySoa8& rays, const Triangle& triangle, float *outT)
+{
+	Vec3 e1 = triangle.B - triangle.A;
+	Vec3 e2 = triangle.C - triangle.A;
+
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < 8; i++)
+	{
+		Vec3 o = vec3(rays.Ox[i], rays.Oy[i], rays.Oz[i]);
+		Vec3 d = vec3(rays.Dx[i], rays.Dy[i], rays.Dz[i]);
+		if (rayTriangleScalar(o, d, triangle.A, e1, e2, rays.MaxT[i], &outT[i]))
+			mask |= 1U << i;
+	}
+	return mask;
+}
+
+SIMD_TARGET_SSE41
+uint32_t IntersectRays8vTriangleSse41(const RaySoa8& rays, const Triangle& triangle, float *outT)
+{
+	Vec3x4 a = splat3x4(triangle.A);
+	Vec3x4 e1 = splat3x4(triangle.B - triangle.A);
+	Vec3x4 e2 = splat3x4(triangle.C - triangle.A);
+
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < 8; i += 4)
+	{
+		Vec3x4 o = load3x4(rays.Ox + i, rays.Oy + i, rays.Oz + i);
+		Vec3x4 d = load3x4(rays.Dx + i, rays.Dy + i, rays.Dz + i);
+		__m128 maxT = _mm_loadu_ps(rays.MaxT + i);
+
+		__m128 t;
+		__m128 hit = rayTriangle4(o, d, a, e1, e2, maxT, &t);
+		_mm_storeu_ps(outT + i, t);
+		mask |= (uint32_t)_mm_movemask_ps(hit) << i;
+	}
+	return mask;
+}
+
+SIMD_TARGET_AVX2
+uint32_t IntersectRays8vTriangleAvx2(const RaySoa8& rays, const Triangle& triangle, float *outT)
+{
+	Vec3x8 a = splat3x8(triangle.A);
+	Vec3x8 e1 = splat3x8(triangle.B - triangle.A);
+	Vec3x8 e2 = splat3x8(triangle.C - triangle.A);
+	Vec3x8 o = load3x8(rays.Ox, rays.Oy, rays.Oz);
+	Vec3x8 d = load3x8(rays.Dx, rays.Dy, rays.Dz);
+	__m256 maxT = _mm256_loadu_ps(rays.MaxT);
+
+	__m256 t;
+	__m256 hit = rayTriangle8(o, d, a, e1, e2, maxT, &t);
+	_mm256_storeu_ps(outT, t);
+	return (uint32_t)_mm256_movemask_ps(hit);
+}
+
+uint32_t IntersectRays8vTriangle(const RaySoa8& rays, const Triangle& triangle, float *outT)
+{
+	if (CpuSupportsAvx2())
+		return IntersectRays8vTriangleAvx2(rays, triangle, outT);
+	else if (CpuSupportsSse41())
+		return IntersectRays8vTriangleSse41(rays, triangle, outT);
+	else
+		return IntersectRays8vTriangleScalar(rays, triangle, outT);
+}
+
+bool IntersectRayvTrianglesAny(const Vec3& origin, const Vec3& dir, const TriangleSoa8 *blocks, uint32_t numBlocks, float minT, float maxT)
+{
+	float t[8];
+	for (uint32_t blockI = 0; blockI < numBlocks; blockI++)
+	{
+		uint32_t mask = IntersectRayvTriangles8(origin, dir, blocks[blockI], maxT, t);
+		for (; mask; mask &= mask - 1)
+		{
+			if (t[CountTrailingZeros(mask)] > minT)
+				return true;
+		}
+	}
+	return false;
+}
+
+uint32_t IntersectAABBs8vTriangleScalar(const TriangleBoxAxes& axes, const float *cx, const float *cy, const float *cz)
+{
+	uint32_t mask = 0;
+	for (uint32_t lane = 0; lane < 8; lane++)
+	{
+		bool hit = true;
+		for (uint32_t i = 0; i < TriangleBoxNumAxes && hit; i++)
+		{
+			float d = axes.X[i] * cx[lane] + axes.Y[i] * cy[lane] + axes.Z[i] * cz[lane];
+			hit = d >= axes.Lo[i] && d <= axes.Hi[i];
+		}
+		if (hit)
+			mask |= 1U << lane;
+	}
+	return mask;
+}
+
+SIMD_TARGET_SSE41
+uint32_t IntersectAABBs8vTriangleSse41(const TriangleBoxAxes& axes, const float *cx, const float *cy, const float *cz)
+{
+	uint32_t mask = 0;
+	for (uint32_t lane = 0; lane < 8; lane += 4)
+	{
+		__m128 x = _mm_loadu_ps(cx + lane);
+		__m128 y = _mm_loadu_ps(cy + lane);
+		__m128 z = _mm_loadu_ps(cz + lane);
+
+		__m128 hit = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (uint32_t i = 0; i < TriangleBoxNumAxes; i++)
+		{
+			__m128 d = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(_mm_set1_ps(axes.X[i]), x),
+				_mm_mul_ps(_mm_set1_ps(axes.Y[i]), y)),
+				_mm_mul_ps(_mm_set1_ps(axes.Z[i]), z));
+			hit = _mm_and_ps(hit, _mm_cmpge_ps(d, _mm_set1_ps(axes.Lo[i])));
+			hit = _mm_and_ps(hit, _mm_cmple_ps(d, _mm_set1_ps(axes.Hi[i])));
+		}
+		mask |= (uint32_t)_mm_movemask_ps(hit) << lane;
+	}
+	return mask;
+}
+
+SIMD_TARGET_AVX2
+uint32_t IntersectAABBs8vTriangleAvx2(const TriangleBoxAxes& axes, const float *cx, const float *cy, const float *cz)
+{
+	__m256 x = _mm256_loadu_ps(cx);
+	__m256 y = _mm256_loadu_ps(cy);
+	__m256 z = _mm256_loadu_ps(cz);
+
+	__m256 hit = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+	for (uint32_t i = 0; i < TriangleBoxNumAxes; i++)
+	{
+		// No fmadd, every kernel has to round like the scalar one so cells
+		// on the boundary get the same triangles on every CPU
+		__m256 d = _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(_mm256_set1_ps(axes.X[i]), x),
+			_mm256_mul_ps(_mm256_set1_ps(axes.Y[i]), y)),
+			_mm256_mul_ps(_mm256_set1_ps(axes.Z[i]), z));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(d, _mm256_set1_ps(axes.Lo[i]), _CMP_GE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(d, _mm256_set1_ps(axes.Hi[i]), _CMP_LE_OQ));
+	}
+	return (uint32_t)_mm256_movemask_ps(hit);
+}
+
+uint32_t IntersectAABBs8vTriangle(const TriangleBoxAxes& axes, const float *cx, const float *cy, const float *cz)
+{
+	if (CpuSupportsAvx2())
+		return IntersectAABBs8vTriangleAvx2(axes, cx, cy, cz);
+	else if (CpuSupportsSse41())
+		return IntersectAABBs8vTriangleSse41(axes, cx, cy, cz);
+	else
+		return IntersectAABBs8vTriangleScalar(axes, cx, cy, cz);
+}
@@ -44,5 +44,62 @@ bool IntersectAABBvTriangle(const Vec3& center, const Vec3& halfSize, const Vec3
 bool IntersectAABBvTriangle(const Vec3& center, const Vec3& halfSize, const Triangle& triangle);
 bool IntersectAABBvTriangle(const AABB& aabb, const Triangle& triangle);
 
+// Separating axes of a triangle against boxes of one size: the box axes, the
+// triangle normal and the 9 edge cross products. A box centered at `c`
+// overlaps the triangle if `Lo[i] <= dot(axis[i], c) <= Hi[i]` on all axes,
+// the triangle interval is already grown by the box radius.
+const uint32_t TriangleBoxNumAxes = 13;
+
+struct TriangleBoxAxes
+{
+	float X[TriangleBoxNumAxes], Y[TriangleBoxNumAxes], Z[TriangleBoxNumAxes];
+	float Lo[TriangleBoxNumAxes], Hi[TriangleBoxNumAxes];
+};
+
+void SetupTriangleBoxAxes(TriangleBoxAxes *axes, const Triangle& triangle, const Vec3& halfSize);
+
 bool IntersectRayvTriangle(const Vec3& origin, const Vec3& dir, const Triangle& triangle, float *outT);
 
+
+// Batch kernels. The lanes are independent, the returned mask has bit N set
+// if lane N hit in the range [0, maxT], missed lanes get FLT_MAX in `outT`.
+// The dispatching versions pick the AVX2 or SSE4.1 implementation at runtime
+// and fall back to the scalar reference.
+
+struct TriangleSoa8
+{
+	float Ax[8], Ay[8], Az[8];
+	float E1x[8], E1y[8], E1z[8];
+	float E2x[8], E2y[8], E2z[8];
+};
+
+struct RaySoa8
+{
+	float Ox[8], Oy[8], Oz[8];
+	float Dx[8], Dy[8], Dz[8];
+	float MaxT[8];
+};
+
+// Packs into `(count + 7) / 8` blocks, missing lanes are degenerate and never hit.
+void PackTrianglesSoa8(const Triangle *triangles, uint32_t count, TriangleSoa8 *blocks);
+
+uint32_t IntersectRayvTriangles8(const Vec3& origin, const Vec3& dir, const TriangleSoa8& tris, float maxT, float *outT);
+uint32_t IntersectRayvTriangles8Scalar(const Vec3& origin, const Vec3& dir, const TriangleSoa8& tris, float maxT, float *outT);
+uint32_t IntersectRayvTriangles8Sse41(const Vec3& origin, const Vec3& dir, const TriangleSoa8& tris, float maxT, float *outT);
+uint32_t IntersectRayvTriangles8Avx2(const Vec3& origin, const Vec3& dir, const TriangleSoa8& tris, float maxT, float *outT);
+
+uint32_t IntersectRays8vTriangle(const RaySoa8& rays, const Triangle& triangle, float *outT);
+uint32_t IntersectRays8vTriangleScalar(const RaySoa8& rays, const Triangle& triangle, float *outT);
+uint32_t IntersectRays8vTriangleSse41(const RaySoa8& rays, const Triangle& triangle, float *outT);
+uint32_t IntersectRays8vTriangleAvx2(const RaySoa8& rays, const Triangle& triangle, float *outT);
+
+// Tests 8 boxes of the size passed to `SetupTriangleBoxAxes()` against the
+// triangle, bit N of the result is set if the box centered at
+// (cx[N], cy[N], cz[N]) overlaps it.
+uint32_t IntersectAABBs8vTriangle(const TriangleBoxAxes& axes, const float *cx, const float *cy, const float *cz);
+uint32_t IntersectAABBs8vTriangleScalar(const TriangleBoxAxes& axes, const float *cx, const float *cy, const float *cz);
+uint32_t IntersectAABBs8vTriangleSse41(const TriangleBoxAxes& axes, const float *cx, const float *cy, const float *cz);
+uint32_t IntersectAABBs8vTriangleAvx2(const TriangleBoxAxes& axes, const float *cx, const float *cy, const float *cz);
+
+// True if the ray hits any of the packed triangles with minT < t < maxT.
+bool IntersectRayvTrianglesAny(const Vec3& origin, const Vec3& dir, const TriangleSoa8 *blocks, uint32_t numBlocks, float minT, float maxT);
@@ -0,0 +1,200 @@
+#include "jobs.h"
+#include "util.h"
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <memory>
+
+// Padded to a cache line so the owner and the thieves of different queues
+// don't fight over the same line.
+struct alignas(64) JobQueue
+{
+	std::atomic<uint32_t> Next;
+	uint32_t End;
+
+	double Milliseconds;
+	uint32_t Chunks;
+};
+
+struct JobPool
+{
+	std::vector<std::thread> Threads;
+	std::unique_ptr<uint8_t[]> QueueMemory;
+	JobQueue *Queues;
+	uint32_t NumThreads;
+
+	std::mutex Mutex;
+	std::condition_variable WakeCond;
+	std::condition_variable DoneCond;
+	uint64_t Generation;
+	uint32_t Running;
+	bool Quit;
+
+	JobRangeFunc Func;
+	void *User;
+	uint32_t Count;
+	uint32_t ChunkSize;
+};
+
+static void RunJobThread(JobPool *p, uint32_t thread)
+{
+	uint64_t begin = BeginMeasureCpuTime();
+	uint32_t chunks = 0;
+
+	// Own queue first, then steal from the following threads in order
+	for (uint32_t i = 0; i < p->NumThreads; i++)
+	{
+		JobQueue *q = &p->Queues[(thread + i) % p->NumThreads];
+		for (;;)
+		{
+			uint32_t chunk = q->Next.fetch_add(1, std::memory_order_relaxed);
+			if (chunk >= q->End)
+				break;
+
+			uint32_t first = chunk * p->ChunkSize;
+			uint32_t last = first + p->ChunkSize;
+			if (last > p->Count)
+				last = p->Count;
+
+			p->Func(p->User, first, last, thread);
+			chunks++;
+		}
+	}
+
+	JobQueue *own = &p->Queues[thread];
+	own->Milliseconds = EndMeasureCpuTime(begin);
+	own->Chunks = chunks;
+}
+
+static void JobWorker(JobPool *p, uint32_t thread)
+{
+	uint64_t seen = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(p->Mutex);
+			p->WakeCond.wait(lock, [&]() { return p->Quit || p->Generation != seen; });
+			if (p->Quit)
+				return;
+			seen = p->Generation;
+		}
+
+		RunJobThread(p, thread);
+
+		{
+			std::lock_guard<std::mutex> lock(p->Mutex);
+			if (--p->Running == 0)
+				p->DoneCond.notify_one();
+		}
+	}
+}
+
+JobPool *CreateJobPool(uint32_t numThreads)
+{
+	if (numThreads == 0)
+		numThreads = std::thread::hardware_concurrency();
+	if (numThreads == 0)
+		numThreads = 1;
+
+	JobPool *p = new JobPool();
+	p->NumThreads = numThreads;
+
+	// `new` only honors `alignas(64)` from C++17 on, align the queues by hand
+	p->QueueMemory.reset(new uint8_t[numThreads * sizeof(JobQueue) + alignof(JobQueue) - 1]);
+	uintptr_t queueAddress = ((uintptr_t)p->QueueMemory.get() + alignof(JobQueue) - 1) & ~(uintptr_t)(alignof(JobQueue) - 1);
+	p->Queues = (JobQueue*)queueAddress;
+
+	p->Generation = 0;
+	p->Running = 0;
+	p->Quit = false;
+
+	for (uint32_t i = 0; i < numThreads; i++)
+	{
+		new (&p->Queues[i]) JobQueue();
+		p->Queues[i].Next = 0;
+		p->Queues[i].End = 0;
+		p->Queues[i].Milliseconds = 0.0;
+		p->Queues[i].Chunks = 0;
+	}
+
+	// Thread 0 is the caller of `RunJobRange()`
+	for (uint32_t i = 1; i < numThreads; i++)
+		p->Threads.emplace_back(JobWorker, p, i);
+
+	return p;
+}
+
+void DestroyJobPool(JobPool *p)
+{
+	{
+		std::lock_guard<std::mutex> lock(p->Mutex);
+		p->Quit = true;
+	}
+	p->WakeCond.notify_all();
+
+	for (auto &thread : p->Threads)
+		thread.join();
+
+	delete p;
+}
+
+uint32_t GetJobPoolThreadCount(JobPool *p)
+{
+	return p->NumThreads;
+}
+
+void RunJobRange(JobPool *p, uint32_t count, uint32_t chunkSize, JobRangeFunc func, void *user)
+{
+	uint32_t numChunks = (count + chunkSize - 1) / chunkSize;
+
+	p->Func = func;
+	p->User = user;
+	p->Count = count;
+	p->ChunkSize = chunkSize;
+
+	for (uint32_t i = 0; i < p->NumThreads; i++)
+	{
+		JobQueue *q = &p->Queues[i];
+		q->Next.store((uint32_t)((uint64_t)numChunks * i / p->NumThreads), std::memory_order_relaxed);
+		q->End = (uint32_t)((uint64_t)numChunks * (i + 1) / p->NumThreads);
+	}
+
+	if (p->NumThreads == 1 || numChunks <= 1)
+	{
+		// Not worth waking anyone up
+		for (uint32_t i = 1; i < p->NumThreads; i++)
+		{
+			p->Queues[i].Milliseconds = 0.0;
+			p->Queues[i].Chunks = 0;
+		}
+		RunJobThread(p, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(p->Mutex);
+		p->Running = p->NumThreads - 1;
+		p->Generation++;
+	}
+	p->WakeCond.notify_all();
+
+	RunJobThread(p, 0);
+
+	{
+		std::unique_lock<std::mutex> lock(p->Mutex);
+		p->DoneCond.wait(lock, [&]() { return p->Running == 0; });
+	}
+}
+
+double GetJobThreadMilliseconds(JobPool *p, uint32_t thread)
+{
+	return p->Queues[thread].Milliseconds;
+}
+
+uint32_t GetJobThreadChunks(JobPool *p, uint32_t thread)
+{
+	return p->Queues[thread].Chunks;
+}
+
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+struct JobPool;
+
+// Called for every chunk [begin, end) of a `RunJobRange()`, `thread` is the
+// index of the executing thread in [0, GetJobPoolThreadCount()).
+typedef void (*JobRangeFunc)(void *user, uint32_t begin, uint32_t end, uint32_t thread);
+
+// `numThreads` includes the calling thread, 0 uses all hardware threads.
+JobPool *CreateJobPool(uint32_t numThreads);
+void DestroyJobPool(JobPool *p);
+
+uint32_t GetJobPoolThreadCount(JobPool *p);
+
+// Split [0, count) into chunks of `chunkSize` and run them across the pool,
+// returns when all the chunks are done. The chunks are initially distributed
+// evenly between the threads, threads that run out of work steal chunks from
+// the others.
+void RunJobRange(JobPool *p, uint32_t count, uint32_t chunkSize, JobRangeFunc func, void *user);
+
+// Time spent and chunks executed by a thread during the last `RunJobRange()`.
+double GetJobThreadMilliseconds(JobPool *p, uint32_t thread);
+uint32_t GetJobThreadChunks(JobPool *p, uint32_t thread);
+
@@ -14,21 +14,67 @@ struct Particle
 	float Lifetime;
 };
 
+enum EmitterShape
+{
+	EmitterPoint,
+	EmitterBox,
+	EmitterSphere,
+};
+
+// Describes particles to spawn instead of listing them, the backends expand
+// the emitters themselves (the GPU ones in a compute shader). Every random
+// value is `Base + [-1, 1] * Spread`, derived from `Seed` and the index of
+// the particle within the emitter so the results don't depend on the dt.
+struct ParticleEmitter
+{
+	EmitterShape Shape;
+	Vec3 Position;
+	// Box: half size, sphere: radius in `x`
+	Vec3 Extent;
+	Vec3 Velocity, VelocitySpread;
+	float Lifetime, LifetimeSpread;
+	// Particles per second after the initial `Burst`. Emitters with a zero
+	// rate are removed once the burst is spawned.
+	float Rate;
+	uint32_t Burst;
+	uint32_t Seed;
+};
+
 class ParticleSystem
 {
 public:
 	virtual ~ParticleSystem() { }
 
 	virtual void Initialize(const Triangle *triangles, uint32_t count) = 0;
+	// Moves the triangles `indices` of the mesh passed to `Initialize()` to
+	// `triangles`, for animated collision geometry. Only the acceleration
+	// structure around the moved triangles is updated.
+	virtual void UpdateTriangles(const uint32_t *indices, const Triangle *triangles, uint32_t count) = 0;
 
 	virtual void SpawnParticles(const Particle *particles, uint32_t count) = 0;
-	virtual void GetParticles(std::vector<Particle>& particles) = 0;
+	// Returns an id for `RemoveEmitter()`, emitters start spawning on the
+	// next `Update()`.
+	virtual uint32_t AddEmitter(const ParticleEmitter& emitter) = 0;
+	virtual void RemoveEmitter(uint32_t id) = 0;
+	// Appends the particles in [offset, offset + count) to `particles`. The
+	// GPU backends never wait for the GPU, they return the latest finished
+	// readback which is a frame or two old (nothing on the first calls).
+	virtual void GetParticles(std::vector<Particle>& particles, uint32_t offset = 0, uint32_t count = ~0U) = 0;
 
 	virtual void Update(CommandBuffer *cb, float dt) = 0;
 	virtual void Render(CommandBuffer *cb, const Mat44& view, const Mat44& proj) = 0;
 };
 
 ParticleSystem *ParticlesCreateDumbCpu();
+// Same as `ParticlesCreateDumbCpu()` but updates the particles on
+// `numThreads` threads, 0 uses all the hardware threads.
+ParticleSystem *ParticlesCreateParallelCpu(uint32_t numThreads);
 ParticleSystem *ParticlesCreateDumbGpu();
 ParticleSystem *ParticlesCreateGridGpu();
+// Grid backend that only stores the occupied cells in a hash table, memory
+// scales with the surface instead of the bounding volume.
+ParticleSystem *ParticlesCreateSparseGridGpu();
+// Grid backend that sorts the particles by cell every frame so workgroups
+// can share the triangles of a cell.
+ParticleSystem *ParticlesCreateBucketedGridGpu();
 
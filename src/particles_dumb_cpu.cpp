@@ -1,6 +1,12 @@
 #include "particles.h"
 #include "renderer.h"
 #include "util.h"
+#include "simd.h"
+#include "jobs.h"
+#include "bvh.h"
+#include "emitter.h"
+#include "fastmath.h"
+#include <string.h>
 
 namespace {
 
@@ -28,65 +34,236 @@ struct ParticleUniform
 	Mat44 u_WorldViewProjection;
 };
 
-bool RayTriangleIntersect(const Vec3& ro, const Vec3& rd, const Vec3* pV, float *outT)
+// Particles stored as separate 32-byte aligned streams so that the
+// integration step can process 4 (SSE) or 8 (AVX2) particles at a time.
+// Capacity is always a multiple of `ParticleStreamWidth` so the kernels
+// can run over the padding at the end without a scalar tail loop.
+const uint32_t ParticleStreamWidth = 8;
+
+enum ParticleStream
+{
+	StreamPosX,
+	StreamPosY,
+	StreamPosZ,
+	StreamVelX,
+	StreamVelY,
+	StreamVelZ,
+	StreamLife,
+	StreamPrevX,
+	StreamPrevY,
+	StreamPrevZ,
+	StreamCount,
+};
+
+struct ParticleStreams
+{
+	float *Data;
+	float *S[StreamCount];
+	uint32_t Count;
+	uint32_t Capacity;
+};
+
+void ReserveParticleStreams(ParticleStreams *ps, uint32_t count)
+{
+	if (count <= ps->Capacity)
+		return;
+
+	uint32_t capacity = ps->Capacity * 2;
+	if (capacity < count)
+		capacity = count;
+	capacity = (capacity + ParticleStreamWidth - 1) & ~(ParticleStreamWidth - 1);
+
+	float *data = (float*)SimdAlloc(sizeof(float) * capacity * StreamCount);
+	memset(data, 0, sizeof(float) * capacity * StreamCount);
+
+	for (uint32_t i = 0; i < StreamCount; i++)
+	{
+		float *stream = data + i * capacity;
+		if (ps->Count > 0)
+			memcpy(stream, ps->S[i], ps->Count * sizeof(float));
+		ps->S[i] = stream;
+	}
+
+	if (ps->Data)
+		SimdFree(ps->Data);
+
+	ps->Data = data;
+	ps->Capacity = capacity;
+}
+
+void FreeParticleStreams(ParticleStreams *ps)
 {
-	Vec3 e0 = pV[1] - pV[0];
-	Vec3 e1 = pV[2] - pV[0];
+	if (ps->Data)
+		SimdFree(ps->Data);
+	memset(ps, 0, sizeof(ParticleStreams));
+}
 
-	Vec3 p = cross(rd, e1);
-	float det = dot(e0, p);
+void IntegrateParticlesSse(ParticleStreams *ps, uint32_t begin, uint32_t end, float dt, const Vec3& gravity)
+{
+	float **s = ps->S;
+	__m128 vdt = _mm_set1_ps(dt);
+	__m128 gx = _mm_set1_ps(gravity.x);
+	__m128 gy = _mm_set1_ps(gravity.y);
+	__m128 gz = _mm_set1_ps(gravity.z);
 
-	if (fabsf(det) < 0.0001f)
-		return false;
+	for (uint32_t i = begin; i < end; i += 4)
+	{
+		__m128 px = _mm_load_ps(s[StreamPosX] + i);
+		__m128 py = _mm_load_ps(s[StreamPosY] + i);
+		__m128 pz = _mm_load_ps(s[StreamPosZ] + i);
+		__m128 vx = _mm_load_ps(s[StreamVelX] + i);
+		__m128 vy = _mm_load_ps(s[StreamVelY] + i);
+		__m128 vz = _mm_load_ps(s[StreamVelZ] + i);
+		__m128 life = _mm_load_ps(s[StreamLife] + i);
+
+		_mm_store_ps(s[StreamPrevX] + i, px);
+		_mm_store_ps(s[StreamPrevY] + i, py);
+		_mm_store_ps(s[StreamPrevZ] + i, pz);
+
+		_mm_store_ps(s[StreamPosX] + i, _mm_add_ps(px, _mm_mul_ps(vx, vdt)));
+		_mm_store_ps(s[StreamPosY] + i, _mm_add_ps(py, _mm_mul_ps(vy, vdt)));
+		_mm_store_ps(s[StreamPosZ] + i, _mm_add_ps(pz, _mm_mul_ps(vz, vdt)));
+		_mm_store_ps(s[StreamVelX] + i, _mm_add_ps(vx, gx));
+		_mm_store_ps(s[StreamVelY] + i, _mm_add_ps(vy, gy));
+		_mm_store_ps(s[StreamVelZ] + i, _mm_add_ps(vz, gz));
+		_mm_store_ps(s[StreamLife] + i, _mm_sub_ps(life, vdt));
+	}
+}
 
-	float inv_det = 1.0f / det;
+SIMD_TARGET_AVX2
+void IntegrateParticlesAvx2(ParticleStreams *ps, uint32_t begin, uint32_t end, float dt, const Vec3& gravity)
+{
+	float **s = ps->S;
+	__m256 vdt = _mm256_set1_ps(dt);
+	__m256 gx = _mm256_set1_ps(gravity.x);
+	__m256 gy = _mm256_set1_ps(gravity.y);
+	__m256 gz = _mm256_set1_ps(gravity.z);
 
-	Vec3 t = ro - pV[0];
-	float u = dot(t, p) * inv_det;
-	if (u < 0.0f || u > 1.0f) return false;
+	for (uint32_t i = begin; i < end; i += 8)
+	{
+		__m256 px = _mm256_load_ps(s[StreamPosX] + i);
+		__m256 py = _mm256_load_ps(s[StreamPosY] + i);
+		__m256 pz = _mm256_load_ps(s[StreamPosZ] + i);
+		__m256 vx = _mm256_load_ps(s[StreamVelX] + i);
+		__m256 vy = _mm256_load_ps(s[StreamVelY] + i);
+		__m256 vz = _mm256_load_ps(s[StreamVelZ] + i);
+		__m256 life = _mm256_load_ps(s[StreamLife] + i);
+
+		_mm256_store_ps(s[StreamPrevX] + i, px);
+		_mm256_store_ps(s[StreamPrevY] + i, py);
+		_mm256_store_ps(s[StreamPrevZ] + i, pz);
+
+		_mm256_store_ps(s[StreamPosX] + i, _mm256_add_ps(px, _mm256_mul_ps(vx, vdt)));
+		_mm256_store_ps(s[StreamPosY] + i, _mm256_add_ps(py, _mm256_mul_ps(vy, vdt)));
+		_mm256_store_ps(s[StreamPosZ] + i, _mm256_add_ps(pz, _mm256_mul_ps(vz, vdt)));
+		_mm256_store_ps(s[StreamVelX] + i, _mm256_add_ps(vx, gx));
+		_mm256_store_ps(s[StreamVelY] + i, _mm256_add_ps(vy, gy));
+		_mm256_store_ps(s[StreamVelZ] + i, _mm256_add_ps(vz, gz));
+		_mm256_store_ps(s[StreamLife] + i, _mm256_sub_ps(life, vdt));
+	}
+}
 
-	Vec3 q = cross(t, e0);
-	float v = dot(rd, q) * inv_det;
-	if (v < 0.0f || u + v > 1.0f)
-		return false;
+// `begin` must be aligned to `ParticleStreamWidth`, `end` is rounded up.
+void IntegrateParticles(ParticleStreams *ps, uint32_t begin, uint32_t end, float dt, const Vec3& gravity)
+{
+	end = (end + ParticleStreamWidth - 1) & ~(ParticleStreamWidth - 1);
 
-	*outT = dot(e1, q) * inv_det;
-	return true;
+	if (CpuSupportsAvx2())
+		IntegrateParticlesAvx2(ps, begin, end, dt, gravity);
+	else
+		IntegrateParticlesSse(ps, begin, end, dt, gravity);
 }
 
+// Removes the particles whose lifetime has run out, keeps the order of the
+// remaining ones. The previous position streams are scratch and skipped.
+void CompactParticleStreams(ParticleStreams *ps)
+{
+	float **s = ps->S;
+	const float *life = s[StreamLife];
+
+	uint32_t dst = 0;
+	while (dst < ps->Count && life[dst] > 0.0f)
+		dst++;
+
+	for (uint32_t src = dst + 1; src < ps->Count; src++)
+	{
+		if (life[src] <= 0.0f)
+			continue;
+
+		for (uint32_t i = StreamPosX; i <= StreamLife; i++)
+			s[i][dst] = s[i][src];
+		dst++;
+	}
+
+	ps->Count = dst;
+}
+
+// Multiple of `ParticleStreamWidth` and 16 floats so every chunk starts on
+// its own cache line in all the streams.
+const uint32_t ParticleChunkSize = 1024;
+
+// Particles that travel further than this in one step are re-simulated in
+// substeps so the gravity arc and the collisions along it are resolved.
+// The substeps are capped too, particles faster than
+// `ParticleMaxSubsteps * ParticleMaxSubstepTravel` per step are slowed down
+// to that so the bound still holds.
+const float ParticleMaxSubstepTravel = 0.3f;
+const uint32_t ParticleMaxSubsteps = 16;
+
+// Bounces resolved within one substep, the rest of the substep is dropped
+// after that so a particle wedged in a corner can't loop forever.
+const uint32_t ParticleMaxBounces = 4;
+
+// Particles stop this far before the surface they hit so the next ray
+// doesn't start on the triangle it bounced off.
+const float ParticleContactOffset = 0.001f;
+
+const float ParticleRestitution = 0.7f;
+
 };
 
 class ParticleSystemDumbCpu : public ParticleSystem
 {
 public:
 	std::vector<Triangle> Triangles;
-	std::vector<Particle> Particles;
+	Bvh Collision;
+	ParticleStreams Particles;
 
 	Texture *ParticleTex;
 	Sampler *ParticleSampler;
 	VertexSpec *ParticleSpec;
-	Buffer *UniformBuffer;
 	Buffer *IndexBuffer;
 
 	Buffer *TexCoordBuffer;
-	Buffer *DynamicVertexBuffer;
+	StreamBuffer *PositionStream;
 	RenderState *ParticleState;
 	Shader *ParticleShader;
 
 	Buffer *VertexBuffers[2];
 
-	ParticleSystemDumbCpu()
+	ParticleEmitters Emitters;
+	std::vector<EmitBatch> EmitBatches;
+
+	JobPool *Jobs;
+	float UpdateDt;
+
+	ParticleSystemDumbCpu(uint32_t numThreads)
 	{
+		Jobs = numThreads != 1 ? CreateJobPool(numThreads) : NULL;
+		UpdateDt = 0.0f;
+
 		ParticleTex = LoadImage("mesh/particle.png");
 		ParticleShader = LoadVertFragShader("shader/particle_cpu/particle");
 		ParticleSpec = CreateVertexSpec(Particle_Elements, ArrayCount(Particle_Elements));
 		ParticleSampler = CreateSamplerSimple(FilterLinear, FilterLinear, FilterLinear, WrapClamp, 0);
 		TexCoordBuffer = CreateStaticBuffer(BufferVertex, ParticleTexCoords, sizeof(ParticleTexCoords));
 		IndexBuffer = CreateStaticBuffer(BufferIndex, ParticleIndices, sizeof(ParticleIndices));
-		UniformBuffer = CreateStaticBuffer(BufferUniform, NULL, sizeof(ParticleUniform));
-		DynamicVertexBuffer = CreateBuffer(BufferVertex);
+		PositionStream = CreateStreamBuffer(BufferVertex);
+
+		memset(&Particles, 0, sizeof(Particles));
+		InitParticleEmitters(&Emitters);
 
-		VertexBuffers[0] = DynamicVertexBuffer;
+		VertexBuffers[0] = GetStreamBuffer(PositionStream);
 		VertexBuffers[1] = TexCoordBuffer;
 
 		{
@@ -100,91 +277,277 @@ public:
 
 	virtual ~ParticleSystemDumbCpu()
 	{
+		FreeParticleStreams(&Particles);
+		if (Jobs)
+			DestroyJobPool(Jobs);
 	}
 
 	virtual void Initialize(const Triangle *triangles, uint32_t count)
 	{
 		Triangles.insert(Triangles.end(), triangles, triangles + count);
+		BuildBvh(&Collision, Triangles.data(), (uint32_t)Triangles.size());
+	}
+
+	virtual void UpdateTriangles(const uint32_t *indices, const Triangle *triangles, uint32_t count)
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (indices[i] < Triangles.size())
+				Triangles[indices[i]] = triangles[i];
+		}
+		RefitBvh(&Collision, Triangles.data());
 	}
 
 	virtual void SpawnParticles(const Particle *particles, uint32_t count)
 	{
-		Particles.insert(Particles.end(), particles, particles + count);
+		ReserveParticleStreams(&Particles, Particles.Count + count);
+
+		float **s = Particles.S;
+		uint32_t base = Particles.Count;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const Particle *p = &particles[i];
+			s[StreamPosX][base + i] = p->Position.x;
+			s[StreamPosY][base + i] = p->Position.y;
+			s[StreamPosZ][base + i] = p->Position.z;
+			s[StreamVelX][base + i] = p->Velocity.x;
+			s[StreamVelY][base + i] = p->Velocity.y;
+			s[StreamVelZ][base + i] = p->Velocity.z;
+			s[StreamLife][base + i] = p->Lifetime;
+		}
+
+		Particles.Count += count;
+	}
+
+	virtual uint32_t AddEmitter(const ParticleEmitter& emitter)
+	{
+		return AddParticleEmitter(&Emitters, emitter);
 	}
 
-	virtual void GetParticles(std::vector<Particle>& particles)
+	virtual void RemoveEmitter(uint32_t id)
 	{
-		particles.insert(particles.end(), Particles.begin(), Particles.end());
+		RemoveParticleEmitter(&Emitters, id);
 	}
 
-	virtual void Update(CommandBuffer *cb, float dt)
+	void EmitParticles(float dt)
 	{
-		uint64_t begin = BeginMeasureCpuTime();
+		StepParticleEmitters(&Emitters, dt, EmitBatches);
 
-		Vec3 gravity = vec3(0.0f, -4.0f, 0.0f) * dt;
-		for (auto &particle : Particles)
+		for (const EmitBatch &batch : EmitBatches)
 		{
-			Vec3 prevPos = particle.Position;
+			ReserveParticleStreams(&Particles, Particles.Count + batch.Count);
 
-			particle.Position += particle.Velocity * dt;
-			particle.Velocity += gravity;
-			particle.Lifetime -= dt;
+			float **s = Particles.S;
+			uint32_t base = Particles.Count;
+			for (uint32_t i = 0; i < batch.Count; i++)
+			{
+				Particle p;
+				EmitParticle(batch.Emitter, batch.First + i, &p);
+				s[StreamPosX][base + i] = p.Position.x;
+				s[StreamPosY][base + i] = p.Position.y;
+				s[StreamPosZ][base + i] = p.Position.z;
+				s[StreamVelX][base + i] = p.Velocity.x;
+				s[StreamVelY][base + i] = p.Velocity.y;
+				s[StreamVelZ][base + i] = p.Velocity.z;
+				s[StreamLife][base + i] = p.Lifetime;
+			}
+
+			Particles.Count += batch.Count;
+		}
 
-			Vec3 delta = particle.Position - prevPos;
-			Vec3 dir = normalize(delta);
+		EmitBatches.clear();
+	}
+
+	virtual void GetParticles(std::vector<Particle>& particles, uint32_t offset, uint32_t count)
+	{
+		if (offset >= Particles.Count)
+			return;
+		if (count > Particles.Count - offset)
+			count = Particles.Count - offset;
+
+		float **s = Particles.S;
+		size_t base = particles.size();
+		particles.resize(base + count);
+		for (uint32_t i = offset; i < offset + count; i++)
+		{
+			Particle *p = &particles[base + i - offset];
+			p->Position = vec3(s[StreamPosX][i], s[StreamPosY][i], s[StreamPosZ][i]);
+			p->Velocity = vec3(s[StreamVelX][i], s[StreamVelY][i], s[StreamVelZ][i]);
+			p->Lifetime = s[StreamLife][i];
+		}
+	}
+
+	// Moves the particle for `dt` with time of impact response: on a hit the
+	// particle stops at the contact, bounces and spends the rest of the time
+	// moving along the reflected velocity.
+	void MoveParticle(Vec3 *pos, Vec3 *vel, float dt)
+	{
+		float remaining = dt;
+		for (uint32_t bounce = 0; bounce < ParticleMaxBounces; bounce++)
+		{
+			Vec3 delta = *vel * remaining;
 			float dlen = length(delta);
-			for (auto &triangle : Triangles)
+			if (dlen <= 0.0f)
+				return;
+
+			Vec3 dir = delta * (1.0f / dlen);
+			float t;
+			uint32_t triangleIx;
+			if (!IntersectRayvBvh(&Collision, *pos, dir, dlen, &t, &triangleIx))
+			{
+				*pos += delta;
+				return;
+			}
+
+			const Triangle &triangle = Triangles[triangleIx];
+			Vec3 n = normalize(cross(triangle.B - triangle.A, triangle.C - triangle.A));
+
+			*pos += dir * F_MAX(t - ParticleContactOffset, 0.0f);
+			*vel = (*vel - n * 2.0f * dot(*vel, n)) * ParticleRestitution;
+			remaining *= 1.0f - t / dlen;
+		}
+	}
+
+	void UpdateRange(uint32_t begin, uint32_t end, float dt)
+	{
+		Vec3 gravityAccel = vec3(0.0f, -4.0f, 0.0f);
+		Vec3 gravity = gravityAccel * dt;
+		IntegrateParticles(&Particles, begin, end, dt, gravity);
+
+		float **s = Particles.S;
+		for (uint32_t i = begin; i < end; i++)
+		{
+			Vec3 prevPos = vec3(s[StreamPrevX][i], s[StreamPrevY][i], s[StreamPrevZ][i]);
+			Vec3 pos = vec3(s[StreamPosX][i], s[StreamPosY][i], s[StreamPosZ][i]);
+
+			Vec3 delta = pos - prevPos;
+			float dlen = length(delta);
+			if (dlen <= 0.0f)
+				continue;
+
+			// Most particles are slow and don't hit anything, the integrated
+			// result is already final for those.
+			if (dlen <= ParticleMaxSubstepTravel)
+			{
+				Vec3 dir = delta * (1.0f / dlen);
+				float t;
+				uint32_t triangleIx;
+				if (!IntersectRayvBvh(&Collision, prevPos, dir, dlen, &t, &triangleIx))
+					continue;
+			}
+
+			// Redo the step from the start in substeps
+			Vec3 vel = vec3(s[StreamVelX][i], s[StreamVelY][i], s[StreamVelZ][i]) - gravity;
+			pos = prevPos;
+
+			uint32_t numSubsteps = (uint32_t)ceilf(dlen / ParticleMaxSubstepTravel);
+			if (numSubsteps < 1)
+				numSubsteps = 1;
+			if (numSubsteps > ParticleMaxSubsteps)
+				numSubsteps = ParticleMaxSubsteps;
+
+			float h = dt / (float)numSubsteps;
+			Vec3 substepGravity = gravityAccel * h;
+			float maxSpeed = ParticleMaxSubstepTravel / h;
+			for (uint32_t step = 0; step < numSubsteps; step++)
 			{
-				float t = 0.0f;
-				if (RayTriangleIntersect(prevPos, dir, triangle.P, &t) && t >= 0.0f && t <= dlen)
-				{
-					Vec3 n = normalize(cross(triangle.B - triangle.A, triangle.C - triangle.A));
-					particle.Position = prevPos;
-					particle.Velocity = (particle.Velocity - n * 2.0f * dot(particle.Velocity, n)) * 0.7f;
-				}
+				float speed = length(vel);
+				if (speed > maxSpeed)
+					vel = vel * (maxSpeed / speed);
+
+				MoveParticle(&pos, &vel, h);
+				vel += substepGravity;
 			}
+
+			s[StreamPosX][i] = pos.x;
+			s[StreamPosY][i] = pos.y;
+			s[StreamPosZ][i] = pos.z;
+			s[StreamVelX][i] = vel.x;
+			s[StreamVelY][i] = vel.y;
+			s[StreamVelZ][i] = vel.z;
 		}
+	}
+
+	static void UpdateJob(void *user, uint32_t begin, uint32_t end, uint32_t thread)
+	{
+		ParticleSystemDumbCpu *self = (ParticleSystemDumbCpu*)user;
+		self->UpdateRange(begin, end, self->UpdateDt);
+	}
+
+	virtual void Update(CommandBuffer *cb, float dt)
+	{
+		uint64_t begin = BeginMeasureCpuTime();
+
+		EmitParticles(dt);
+
+		// Every particle is simulated independently so the results don't
+		// depend on how the chunks end up distributed between the threads.
+		if (Jobs)
+		{
+			UpdateDt = dt;
+			RunJobRange(Jobs, Particles.Count, ParticleChunkSize, &UpdateJob, this);
+		}
+		else
+		{
+			UpdateRange(0, Particles.Count, dt);
+		}
+
+		CompactParticleStreams(&Particles);
 
 		double delta = EndMeasureCpuTime(begin);
 
-		char title[128];
-		sprintf(title, "CPU: %.2fms, Particles: %u", delta, Particles.size());
+		char title[1024];
+		int len = sprintf(title, "CPU: %.2fms, Particles: %u", delta, Particles.Count);
+
+		if (Jobs)
+		{
+			uint32_t numThreads = GetJobPoolThreadCount(Jobs);
+			len += sprintf(title + len, "   Threads:");
+			for (uint32_t i = 0; i < numThreads && len < (int)sizeof(title) - 16; i++)
+				len += sprintf(title + len, " %.2f", GetJobThreadMilliseconds(Jobs, i));
+		}
+
 		SetWindowTitle(title);
 	}
 
 	virtual void Render(CommandBuffer *cb, const Mat44& view, const Mat44& proj)
 	{
+		if (Particles.Count == 0)
+			return;
+
 		// Update uniform buffer
 		{
 			ParticleUniform u;
 			u.u_WorldViewProjection = transpose(view * proj);
-			SetBufferData(UniformBuffer, &u, sizeof(u));
+			PushUniformData(cb, 0, &u, sizeof(u));
 		}
 
-		// Create vertices
+		// Write the positions straight into the mapped stream buffer
+		size_t offsets[2] = { 0, 0 };
 		{
-			size_t requiredSize = Particles.size() * sizeof(Vec3);
-			ReserveUndefinedBuffer(DynamicVertexBuffer, requiredSize, false);
-
-			Vec3 *verts = (Vec3*)LockBuffer(DynamicVertexBuffer);
-			for (auto &particle : Particles)
-				*verts++ = particle.Position;
-			UnlockBuffer(DynamicVertexBuffer);
+			float **s = Particles.S;
+			Vec3 *verts = (Vec3*)MapStreamBuffer(PositionStream, Particles.Count * sizeof(Vec3), &offsets[0]);
+			for (uint32_t i = 0; i < Particles.Count; i++)
+				*verts++ = vec3(s[StreamPosX][i], s[StreamPosY][i], s[StreamPosZ][i]);
 		}
 
 		// Set state and draw!
 		SetShader(cb, ParticleShader);
 		SetRenderState(cb, ParticleState);
-		SetUniformBuffer(cb, 0, UniformBuffer);
-		SetVertexBuffers(cb, ParticleSpec, VertexBuffers, ArrayCount(VertexBuffers));
+		SetVertexBuffers(cb, ParticleSpec, VertexBuffers, ArrayCount(VertexBuffers), offsets);
 		SetIndexBuffer(cb, IndexBuffer, DataUInt16);
 		SetTexture(cb, 0, ParticleTex, ParticleSampler);
-		DrawIndexedInstanced(cb, DrawTriangles, Particles.size(), 6, 0);
+		DrawIndexedInstanced(cb, DrawTriangles, Particles.Count, 6, 0);
 	}
 };
 
 ParticleSystem *ParticlesCreateDumbCpu()
 {
-	return new ParticleSystemDumbCpu();
+	return new ParticleSystemDumbCpu(1);
+}
+
+ParticleSystem *ParticlesCreateParallelCpu(uint32_t numThreads)
+{
+	return new ParticleSystemDumbCpu(numThreads);
 }
 
@@ -1,4 +1,5 @@
 #include "particles.h"
+#include "particles_gpu.h"
 #include "renderer.h"
 #include "util.h"
 
@@ -26,17 +27,24 @@ struct ParticleUniform
 	Mat44 u_WorldViewProjection;
 };
 
-struct GpuParticle
-{
-	float PositionAndLifetime[4];
-	float Velocity[4];
-};
-
 struct GpuTriangle
 {
 	float P[3][4];
 };
 
+GpuTriangle toGpu(const Triangle& t)
+{
+	GpuTriangle gt;
+	for (uint32_t p = 0; p < 3; p++)
+	{
+		gt.P[p][0] = t.P[p].x;
+		gt.P[p][1] = t.P[p].y;
+		gt.P[p][2] = t.P[p].z;
+		gt.P[p][3] = 0.0f;
+	}
+	return gt;
+}
+
 struct SimUniform
 {
 	int u_Counts[4];
@@ -50,11 +58,12 @@ class ParticleSystemDumbGpu : public ParticleSystem
 {
 public:
 	std::vector<Particle> NewParticles;
+	ParticleEmitters Emitters;
+	std::vector<EmitBatch> EmitBatches;
 
 	Texture *ParticleTex;
 	Sampler *ParticleSampler;
 	VertexSpec *ParticleSpec;
-	Buffer *UniformBuffer;
 	Buffer *IndexBuffer;
 
 	Shader *ComputeSim;
@@ -64,14 +73,12 @@ public:
 	RenderState *ParticleState;
 	Shader *ParticleShader;
 
-	Buffer *SimUniformBuffer;
 
-	Buffer *NewParticleBuffer;
-
-	Buffer *ParticleBuffer;
+	GpuParticlePool Pool;
 	Buffer *TriangleBuffer;
+	std::vector<GpuTriangle> Triangles;
+	std::vector<uint32_t> DirtyTriangles;
 
-	uint32_t NumParticles;
 	uint32_t NumTriangles;
 
 	Timer *GpuTimer, *RenderTimer;
@@ -85,16 +92,13 @@ public:
 		ParticleSampler = CreateSamplerSimple(FilterLinear, FilterLinear, FilterLinear, WrapClamp, 0);
 		TexCoordBuffer = CreateStaticBuffer(BufferVertex, ParticleTexCoords, sizeof(ParticleTexCoords));
 		IndexBuffer = CreateStaticBuffer(BufferIndex, ParticleIndices, sizeof(ParticleIndices));
-		UniformBuffer = CreateStaticBuffer(BufferUniform, NULL, sizeof(ParticleUniform));
-		SimUniformBuffer = CreateStaticBuffer(BufferUniform, NULL, sizeof(SimUniform));
 		GpuTimer = CreateTimer();
 		RenderTimer = CreateTimer();
 
-		ParticleBuffer = CreateStaticBuffer(BufferStorage, NULL, sizeof(GpuParticle) * 1024 * 128);
+		InitParticleEmitters(&Emitters);
+		CreateGpuParticlePool(&Pool, 1024 * 16, 1024 * 128);
 		TriangleBuffer = CreateBuffer(BufferStorage);
-		NewParticleBuffer = CreateBuffer(BufferStorage);
 
-		NumParticles = 0;
 		NumTriangles = 0;
 
 		{
@@ -112,23 +116,29 @@ public:
 
 	virtual void Initialize(const Triangle *triangles, uint32_t count)
 	{
-		ReserveUndefinedBuffer(TriangleBuffer, count * sizeof(GpuTriangle), true);
-		GpuTriangle *tris = (GpuTriangle*)LockBuffer(TriangleBuffer);
+		Triangles.resize(count);
+		for (uint32_t i = 0; i < count; i++)
+			Triangles[i] = toGpu(triangles[i]);
 
+		SetBufferData(TriangleBuffer, Triangles.data(), count * sizeof(GpuTriangle));
+
+		NumTriangles = count;
+	}
+
+	virtual void UpdateTriangles(const uint32_t *indices, const Triangle *triangles, uint32_t count)
+	{
+		DirtyTriangles.clear();
 		for (uint32_t i = 0; i < count; i++)
 		{
-			for (uint32_t p = 0; p < 3; p++)
-			{
-				tris[i].P[p][0] = triangles[i].P[p].x;
-				tris[i].P[p][1] = triangles[i].P[p].y;
-				tris[i].P[p][2] = triangles[i].P[p].z;
-				tris[i].P[p][3] = 0.0f;
-			}
-		}
+			uint32_t ix = indices[i];
+			if (ix >= NumTriangles)
+				continue;
 
-		UnlockBuffer(TriangleBuffer);
+			Triangles[ix] = toGpu(triangles[i]);
+			DirtyTriangles.push_back(ix);
+		}
 
-		NumTriangles = count;
+		UploadGpuRanges(TriangleBuffer, Triangles.data(), sizeof(GpuTriangle), DirtyTriangles);
 	}
 
 	virtual void SpawnParticles(const Particle *particles, uint32_t count)
@@ -136,49 +146,38 @@ public:
 		NewParticles.insert(NewParticles.end(), particles, particles + count);
 	}
 
-	virtual void GetParticles(std::vector<Particle>& particles)
+	virtual uint32_t AddEmitter(const ParticleEmitter& emitter)
+	{
+		return AddParticleEmitter(&Emitters, emitter);
+	}
+
+	virtual void RemoveEmitter(uint32_t id)
+	{
+		RemoveParticleEmitter(&Emitters, id);
+	}
+
+	virtual void GetParticles(std::vector<Particle>& particles, uint32_t offset, uint32_t count)
 	{
-		// particles.insert(particles.end(), Particles.begin(), Particles.end());
+		GetGpuParticles(&Pool, particles, offset, count);
 	}
 
 	virtual void Update(CommandBuffer *cb, float dt)
 	{
 		char title[128];
-		sprintf(title, "Sim: %.2fms, Render: %.2fms   Particles: %u",
+		sprintf(title, "Sim: %.2fms, Render: %.2fms   Particles: %u (peak %u, dropped %u)",
 			GetTimerMilliseconds(GpuTimer),
-			GetTimerMilliseconds(RenderTimer), NumParticles);
+			GetTimerMilliseconds(RenderTimer), Pool.NumParticles,
+			Pool.PeakParticles, Pool.Dropped);
 		SetWindowTitle(title);
 
 		StartTimer(cb, GpuTimer);
 
 		Vec3 gravity = vec3(0.0f, -4.0f, 0.0f) * dt;
 
-		// Copy new particles
-		ReserveUndefinedBuffer(NewParticleBuffer, sizeof(GpuParticle) * NewParticles.size(), false);
-		GpuParticle *parts = (GpuParticle*)LockBuffer(NewParticleBuffer);
-		for (uint32_t i = 0; i < NewParticles.size(); i++)
-		{
-			GpuParticle *g = &parts[i];
-			Particle *p = &NewParticles[i];
-
-			g->PositionAndLifetime[0] = p->Position.x;
-			g->PositionAndLifetime[1] = p->Position.y;
-			g->PositionAndLifetime[2] = p->Position.z;
-			g->PositionAndLifetime[3] = p->Lifetime;
-			g->Velocity[0] = p->Velocity.x;
-			g->Velocity[1] = p->Velocity.y;
-			g->Velocity[2] = p->Velocity.z;
-			g->Velocity[3] = 0.0f;
-		}
-		UnlockBuffer(NewParticleBuffer);
-
-		CopyBufferData(cb, ParticleBuffer, NewParticleBuffer,
-				NumParticles * sizeof(GpuParticle),
-				0,
-				NewParticles.size() * sizeof(GpuParticle));
-
-		NumParticles += NewParticles.size();
-		NewParticles.clear();
+		// Copy new particles and expand the emitters
+		AppendGpuParticles(&Pool, cb, NewParticles);
+		StepParticleEmitters(&Emitters, dt, EmitBatches);
+		EmitGpuParticles(&Pool, cb, EmitBatches);
 
 		// Simulate particles
 		{
@@ -195,14 +194,15 @@ public:
 			u.u_Gravity[1] = gravity.y;
 			u.u_Gravity[2] = gravity.z;
 			u.u_Gravity[3] = 0.0f;
-			SetBufferData(SimUniformBuffer, &u, sizeof(u));
+			PushUniformData(cb, 0, &u, sizeof(u));
 		}
 
 		SetShader(cb, ComputeSim);
-		SetUniformBuffer(cb, 0, SimUniformBuffer);
-		SetStorageBuffer(cb, 0, ParticleBuffer);
+		BindGpuParticleSimulation(&Pool, cb);
 		SetStorageBuffer(cb, 1, TriangleBuffer);
-		DispatchCompute(cb, (NumParticles + 63) / 64, 1, 1);
+		DispatchGpuParticles(&Pool, cb);
+
+		SwapGpuParticles(&Pool, cb);
 
 		StopTimer(cb, GpuTimer);
 	}
@@ -215,18 +215,17 @@ public:
 		{
 			ParticleUniform u;
 			u.u_WorldViewProjection = transpose(view * proj);
-			SetBufferData(UniformBuffer, &u, sizeof(u));
+			PushUniformData(cb, 0, &u, sizeof(u));
 		}
 
 		// Set state and draw!
 		SetShader(cb, ParticleShader);
 		SetRenderState(cb, ParticleState);
-		SetUniformBuffer(cb, 0, UniformBuffer);
 		SetVertexBuffers(cb, ParticleSpec, &TexCoordBuffer, 1);
 		SetIndexBuffer(cb, IndexBuffer, DataUInt16);
-		SetStorageBuffer(cb, 0, ParticleBuffer);
+		BindGpuParticleRender(&Pool, cb);
 		SetTexture(cb, 0, ParticleTex, ParticleSampler);
-		DrawIndexedInstanced(cb, DrawTriangles, NumParticles, 6, 0);
+		DrawGpuParticles(&Pool, cb);
 
 		StopTimer(cb, RenderTimer);
 	}
@@ -0,0 +1,369 @@
+#include "particles_gpu.h"
+#include "renderer.h"
+#include "util.h"
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+
+namespace {
+
+struct CopyUniform
+{
+	int u_Copy[4];
+};
+
+struct EmitUniform
+{
+	uint32_t u_Emit[4];
+};
+
+// Layout of `GpuParticlePool::Counters`, `Zero` is never written and is
+// used to reset `Next` with a buffer copy. `Overflow` counts the particles
+// dropped by the spawn shaders.
+struct GpuParticleCounters
+{
+	uint32_t Count;
+	uint32_t Next;
+	uint32_t Zero;
+	uint32_t Overflow;
+};
+
+// Layout of `GpuParticlePool::Args`, written by `particle_args.glsl`
+struct GpuParticleArgs
+{
+	DispatchIndirectArgs Sim;
+	DrawIndexedIndirectArgs Draw;
+};
+
+void updateGpuParticleArgs(GpuParticlePool *pool, CommandBuffer *cb)
+{
+	SetShader(cb, pool->ArgsShader);
+	SetStorageBuffer(cb, 0, pool->Args);
+	SetStorageBuffer(cb, GpuParticleBindingCounters, pool->Counters);
+	DispatchCompute(cb, 1, 1, 1);
+	ComputeBarrier(cb);
+}
+
+// Grows the particle buffers so `count` more fit under the upper bound,
+// keeping the current particles. Returns how many of them to dispatch, at
+// the cap the spawn shaders drop whatever doesn't fit on the GPU.
+uint32_t reserveGpuParticles(GpuParticlePool *pool, CommandBuffer *cb, uint32_t count)
+{
+	uint64_t needed = (uint64_t)pool->MaxParticles + count;
+	if (needed > pool->Capacity && pool->Capacity < pool->MaxCapacity)
+	{
+		uint64_t capacity = (uint64_t)pool->Capacity * 2;
+		if (capacity < needed)
+			capacity = needed;
+		if (capacity > pool->MaxCapacity)
+			capacity = pool->MaxCapacity;
+
+		Buffer *particles[2];
+		particles[0] = CreateStaticBuffer(BufferStorage, NULL, sizeof(GpuParticle) * capacity);
+		particles[1] = CreateStaticBuffer(BufferStorage, NULL, sizeof(GpuParticle) * capacity);
+
+		Buffer *cur = pool->Particles[pool->Current];
+		CopyBufferData(cb, particles[pool->Current], cur, 0, 0, sizeof(GpuParticle) * pool->MaxParticles);
+
+		DestroyBuffer(pool->Particles[0]);
+		DestroyBuffer(pool->Particles[1]);
+		pool->Particles[0] = particles[0];
+		pool->Particles[1] = particles[1];
+		pool->Capacity = (uint32_t)capacity;
+	}
+
+	return count < pool->Capacity ? count : pool->Capacity;
+}
+
+void addGpuParticles(GpuParticlePool *pool, uint32_t count)
+{
+	pool->MaxParticles += count;
+	if (pool->MaxParticles > pool->Capacity)
+		pool->MaxParticles = pool->Capacity;
+	pool->Spawned[pool->Frame % GpuParticleSpawnHistory] += count;
+}
+
+}
+
+void CreateGpuParticlePool(GpuParticlePool *pool, uint32_t capacity, uint32_t maxCapacity)
+{
+	if (capacity > maxCapacity)
+		capacity = maxCapacity;
+
+	pool->Particles[0] = CreateStaticBuffer(BufferStorage, NULL, sizeof(GpuParticle) * capacity);
+	pool->Particles[1] = CreateStaticBuffer(BufferStorage, NULL, sizeof(GpuParticle) * capacity);
+
+	GpuParticleCounters counters = { };
+	pool->Counters = CreateStaticBuffer(BufferStorage, &counters, sizeof(counters));
+	pool->NewParticles = CreateBuffer(BufferStorage);
+
+	pool->CountReadback = CreateReadbackBuffer();
+	pool->ParticleReadback = CreateReadbackBuffer();
+
+	for (uint32_t i = 0; i < GpuParticleSpawnHistory; i++)
+		pool->Spawned[i] = 0;
+
+	GpuParticleArgs args = { };
+	pool->ArgsShader = LoadComputeShader("shader/particle_gpu/particle_args");
+	pool->Args = CreateStaticBuffer(BufferIndirect, &args, sizeof(args));
+
+	pool->CopyShader = LoadComputeShader("shader/particle_gpu/copy_particles");
+
+	pool->EmitShader = LoadComputeShader("shader/particle_gpu/emit_particles");
+	pool->EmitBatches = CreateBuffer(BufferStorage);
+
+	pool->Current = 0;
+	pool->Capacity = capacity;
+	pool->MaxCapacity = maxCapacity;
+	pool->NumParticles = 0;
+	pool->MaxParticles = 0;
+	pool->PeakParticles = 0;
+	pool->Dropped = 0;
+	pool->Frame = 0;
+
+	pool->ReadbackRequested = false;
+	pool->ReadbackOffset = 0;
+	pool->ReadbackCount = 0;
+}
+
+void AppendGpuParticles(GpuParticlePool *pool, CommandBuffer *cb, std::vector<Particle>& particles)
+{
+	uint32_t count = reserveGpuParticles(pool, cb, (uint32_t)particles.size());
+	if (count > 0)
+	{
+		// `copy_particles.glsl` reads the packed `Particle` structs as is
+		SetBufferData(pool->NewParticles, particles.data(), sizeof(Particle) * count);
+
+		CopyUniform u = { };
+		u.u_Copy[0] = count;
+		u.u_Copy[1] = pool->Capacity;
+
+		SetShader(cb, pool->CopyShader);
+		PushUniformData(cb, 0, &u, sizeof(u));
+		SetStorageBuffer(cb, 0, pool->Particles[pool->Current]);
+		SetStorageBuffer(cb, 1, pool->NewParticles);
+		SetStorageBuffer(cb, GpuParticleBindingCounters, pool->Counters);
+		DispatchCompute(cb, (count + 63) / 64, 1, 1);
+		ComputeBarrier(cb);
+
+		addGpuParticles(pool, count);
+		updateGpuParticleArgs(pool, cb);
+	}
+
+	particles.clear();
+}
+
+void EmitGpuParticles(GpuParticlePool *pool, CommandBuffer *cb, std::vector<EmitBatch>& batches)
+{
+	uint32_t requested = 0;
+	for (const EmitBatch &batch : batches)
+		requested += batch.Count;
+
+	uint32_t space = reserveGpuParticles(pool, cb, requested);
+	uint32_t total = 0;
+
+	pool->EmitScratch.clear();
+	for (const EmitBatch &batch : batches)
+	{
+		uint32_t count = batch.Count < space - total ? batch.Count : space - total;
+		if (count == 0)
+			continue;
+
+		const ParticleEmitter *e = &batch.Emitter;
+		GpuEmitBatch g;
+		g.PositionAndLifetime[0] = e->Position.x;
+		g.PositionAndLifetime[1] = e->Position.y;
+		g.PositionAndLifetime[2] = e->Position.z;
+		g.PositionAndLifetime[3] = e->Lifetime;
+		g.ExtentAndLifetimeSpread[0] = e->Extent.x;
+		g.ExtentAndLifetimeSpread[1] = e->Extent.y;
+		g.ExtentAndLifetimeSpread[2] = e->Extent.z;
+		g.ExtentAndLifetimeSpread[3] = e->LifetimeSpread;
+		g.Velocity[0] = e->Velocity.x;
+		g.Velocity[1] = e->Velocity.y;
+		g.Velocity[2] = e->Velocity.z;
+		g.Velocity[3] = 0.0f;
+		g.VelocitySpread[0] = e->VelocitySpread.x;
+		g.VelocitySpread[1] = e->VelocitySpread.y;
+		g.VelocitySpread[2] = e->VelocitySpread.z;
+		g.VelocitySpread[3] = 0.0f;
+		g.Info[0] = e->Seed;
+		g.Info[1] = batch.First;
+		g.Info[2] = total;
+		g.Info[3] = (uint32_t)e->Shape;
+		pool->EmitScratch.push_back(g);
+
+		total += count;
+	}
+
+	if (total > 0)
+	{
+		SetBufferData(pool->EmitBatches, pool->EmitScratch.data(), sizeof(GpuEmitBatch) * pool->EmitScratch.size());
+
+		EmitUniform u = { };
+		u.u_Emit[0] = (uint32_t)pool->EmitScratch.size();
+		u.u_Emit[1] = total;
+		u.u_Emit[2] = pool->Capacity;
+
+		SetShader(cb, pool->EmitShader);
+		PushUniformData(cb, 0, &u, sizeof(u));
+		SetStorageBuffer(cb, 0, pool->Particles[pool->Current]);
+		SetStorageBuffer(cb, 1, pool->EmitBatches);
+		SetStorageBuffer(cb, GpuParticleBindingCounters, pool->Counters);
+		DispatchCompute(cb, (total + 63) / 64, 1, 1);
+		ComputeBarrier(cb);
+
+		addGpuParticles(pool, total);
+		updateGpuParticleArgs(pool, cb);
+	}
+
+	batches.clear();
+}
+
+void BindGpuParticleSimulation(GpuParticlePool *pool, CommandBuffer *cb)
+{
+	SetStorageBuffer(cb, 0, pool->Particles[pool->Current]);
+	SetStorageBuffer(cb, GpuParticleBindingOutput, pool->Particles[pool->Current ^ 1]);
+	SetStorageBuffer(cb, GpuParticleBindingCounters, pool->Counters);
+}
+
+void DispatchGpuParticles(GpuParticlePool *pool, CommandBuffer *cb)
+{
+	DispatchComputeIndirect(cb, pool->Args, offsetof(GpuParticleArgs, Sim));
+}
+
+void BindGpuParticleReorder(GpuParticlePool *pool, CommandBuffer *cb)
+{
+	BindGpuParticleSimulation(pool, cb);
+}
+
+void FinishGpuParticleReorder(GpuParticlePool *pool, CommandBuffer *cb)
+{
+	ComputeBarrier(cb);
+	pool->Current ^= 1;
+}
+
+void SwapGpuParticles(GpuParticlePool *pool, CommandBuffer *cb)
+{
+	ComputeBarrier(cb);
+
+	// Count = Next, Next = 0
+	CopyBufferData(cb, pool->Counters, pool->Counters,
+		offsetof(GpuParticleCounters, Count), offsetof(GpuParticleCounters, Next), sizeof(uint32_t));
+	CopyBufferData(cb, pool->Counters, pool->Counters,
+		offsetof(GpuParticleCounters, Next), offsetof(GpuParticleCounters, Zero), sizeof(uint32_t));
+	updateGpuParticleArgs(pool, cb);
+
+	pool->Current ^= 1;
+
+	// The readback is tagged with the frame it was issued in. Particles only
+	// die on the GPU, so that count plus everything spawned since is an
+	// upper bound of the current count.
+	size_t size;
+	uint32_t frame;
+	const GpuParticleCounters *counters = (const GpuParticleCounters*)GetReadbackData(pool->CountReadback, &size, &frame);
+	if (counters)
+	{
+		if (counters->Count > pool->PeakParticles)
+			pool->PeakParticles = counters->Count;
+		pool->Dropped = counters->Overflow;
+	}
+	if (counters && pool->Frame - frame < GpuParticleSpawnHistory)
+	{
+		pool->NumParticles = counters->Count;
+		pool->MaxParticles = counters->Count;
+		for (uint32_t f = frame + 1; f <= pool->Frame; f++)
+			pool->MaxParticles += pool->Spawned[f % GpuParticleSpawnHistory];
+		if (pool->MaxParticles > pool->Capacity)
+			pool->MaxParticles = pool->Capacity;
+	}
+
+	ReadbackRange countRange = { pool->Counters, 0, sizeof(GpuParticleCounters) };
+	QueueReadback(cb, pool->CountReadback, &countRange, 1, pool->Frame);
+
+	if (pool->ReadbackRequested)
+	{
+		// Particles followed by the live count, tagged with the offset
+		uint32_t offset = pool->ReadbackOffset;
+		uint32_t num = 0;
+		if (offset < pool->MaxParticles)
+			num = pool->MaxParticles - offset < pool->ReadbackCount ? pool->MaxParticles - offset : pool->ReadbackCount;
+
+		ReadbackRange ranges[2] =
+		{
+			{ pool->Particles[pool->Current], offset * sizeof(GpuParticle), num * sizeof(GpuParticle) },
+			{ pool->Counters, offsetof(GpuParticleCounters, Count), sizeof(uint32_t) },
+		};
+		QueueReadback(cb, pool->ParticleReadback, ranges, ArrayCount(ranges), offset);
+		pool->ReadbackRequested = false;
+	}
+
+	pool->Frame++;
+	pool->Spawned[pool->Frame % GpuParticleSpawnHistory] = 0;
+}
+
+void GetGpuParticles(GpuParticlePool *pool, std::vector<Particle>& particles, uint32_t offset, uint32_t count)
+{
+	pool->ReadbackRequested = true;
+	pool->ReadbackOffset = offset;
+	pool->ReadbackCount = count;
+
+	size_t size;
+	uint32_t first;
+	const char *data = (const char*)GetReadbackData(pool->ParticleReadback, &size, &first);
+	if (!data)
+		return;
+
+	uint32_t num = (uint32_t)((size - sizeof(uint32_t)) / sizeof(GpuParticle));
+	uint32_t live;
+	memcpy(&live, data + num * sizeof(GpuParticle), sizeof(uint32_t));
+
+	// Only [first, min(live, first + num)) of the readback are particles,
+	// clip that to the range asked for now.
+	uint64_t end = (uint64_t)first + num;
+	if (end > live)
+		end = live;
+	if (end > (uint64_t)offset + count)
+		end = (uint64_t)offset + count;
+	uint32_t begin = first > offset ? first : offset;
+
+	const GpuParticle *parts = (const GpuParticle*)data;
+	for (uint32_t i = begin; i < end; i++)
+	{
+		const GpuParticle *g = &parts[i - first];
+
+		Particle p;
+		p.Position = vec3(g->PositionAndLifetime[0], g->PositionAndLifetime[1], g->PositionAndLifetime[2]);
+		p.Velocity = vec3(g->Velocity[0], g->Velocity[1], g->Velocity[2]);
+		p.Lifetime = g->PositionAndLifetime[3];
+		particles.push_back(p);
+	}
+}
+
+void BindGpuParticleRender(GpuParticlePool *pool, CommandBuffer *cb)
+{
+	SetStorageBuffer(cb, 0, pool->Particles[pool->Current]);
+}
+
+void DrawGpuParticles(GpuParticlePool *pool, CommandBuffer *cb)
+{
+	DrawIndexedIndirect(cb, DrawTriangles, pool->Args, offsetof(GpuParticleArgs, Draw));
+}
+
+void UploadGpuRanges(Buffer *b, const void *data, size_t stride, std::vector<uint32_t>& indices)
+{
+	std::sort(indices.begin(), indices.end());
+	indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+	const char *bytes = (const char*)data;
+	for (size_t i = 0; i < indices.size(); )
+	{
+		uint32_t first = indices[i];
+		uint32_t last = first;
+		while (++i < indices.size() && indices[i] == last + 1)
+			last++;
+
+		UpdateBufferData(b, first * stride, bytes + first * stride, (last - first + 1) * stride);
+	}
+}
+
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "particles.h"
+#include "emitter.h"
+#include <stdint.h>
+#include <vector>
+
+struct Buffer;
+struct Shader;
+struct CommandBuffer;
+struct ReadbackBuffer;
+
+struct GpuParticle
+{
+	float PositionAndLifetime[4];
+	float Velocity[4];
+};
+
+// Emit batch as read by `emit_particles.glsl`, `Info` is the seed, the
+// index of the first particle, the first thread of the batch and the shape.
+struct GpuEmitBatch
+{
+	float PositionAndLifetime[4];
+	float ExtentAndLifetimeSpread[4];
+	float Velocity[4];
+	float VelocitySpread[4];
+	uint32_t Info[4];
+};
+
+// Storage buffer bindings shared by the GPU particle shaders
+const uint32_t GpuParticleBindingOutput = 3;
+const uint32_t GpuParticleBindingCounters = 4;
+
+// Frames of spawn counts kept to correct the lagged particle count
+const uint32_t GpuParticleSpawnHistory = 8;
+
+// Live particles of the GPU backends, kept in two ping-pong buffers. The
+// simulation reads the current buffer and appends the surviving particles
+// to the other one, so dead particles drop out every frame.
+//
+// The exact count only lives on the GPU (`Counters`), the CPU works with
+// an upper bound derived from an asynchronous readback and the particles
+// spawned since, so it never has to wait for the GPU. The bound only
+// sizes the buffers, dispatches and draws take the count from `Args`.
+//
+// The buffers double whenever the upper bound doesn't fit, up to
+// `MaxCapacity`. At that point new particles are dropped on the GPU once
+// the real count reaches the capacity and `Dropped` counts them.
+struct GpuParticlePool
+{
+	Buffer *Particles[2];
+	Buffer *Counters;
+	Buffer *NewParticles;
+	ReadbackBuffer *CountReadback;
+	ReadbackBuffer *ParticleReadback;
+
+	Shader *CopyShader;
+
+	// `GpuParticleArgs` for the live count, rewritten on the GPU whenever the
+	// count changes.
+	Shader *ArgsShader;
+	Buffer *Args;
+
+	Shader *EmitShader;
+	Buffer *EmitBatches;
+	std::vector<GpuEmitBatch> EmitScratch;
+
+	uint32_t Current;
+	uint32_t Capacity;
+	uint32_t MaxCapacity;
+
+	uint32_t NumParticles;
+	uint32_t MaxParticles;
+
+	// Highest particle count read back and the total dropped at the cap,
+	// both lag behind like `NumParticles`.
+	uint32_t PeakParticles;
+	uint32_t Dropped;
+
+	uint32_t Frame;
+	uint32_t Spawned[GpuParticleSpawnHistory];
+
+	// Range requested by the last `GetGpuParticles()`, read back at the
+	// end of the next frame.
+	bool ReadbackRequested;
+	uint32_t ReadbackOffset;
+	uint32_t ReadbackCount;
+};
+
+// Starts with room for `capacity` particles and grows up to `maxCapacity`
+void CreateGpuParticlePool(GpuParticlePool *pool, uint32_t capacity, uint32_t maxCapacity);
+
+// Appends new particles to the current buffer, growing it if needed.
+// Particles that don't fit under `MaxCapacity` are dropped.
+void AppendGpuParticles(GpuParticlePool *pool, CommandBuffer *cb, std::vector<Particle>& particles);
+
+// Expands the emitter batches into the current buffer on the GPU, only the
+// batch descriptors are uploaded. Clears `batches`.
+void EmitGpuParticles(GpuParticlePool *pool, CommandBuffer *cb, std::vector<EmitBatch>& batches);
+
+// Binds the current buffer, the output buffer and the counters for a
+// simulation pass that appends the live particles to the output.
+void BindGpuParticleSimulation(GpuParticlePool *pool, CommandBuffer *cb);
+
+// Dispatches a thread per live particle in groups of 64, the count comes
+// from the GPU.
+void DispatchGpuParticles(GpuParticlePool *pool, CommandBuffer *cb);
+
+// Binds the current buffer and the output like `BindGpuParticleSimulation()`
+// for a pass that writes every live particle to a new position in the
+// output, the count stays the same.
+void BindGpuParticleReorder(GpuParticlePool *pool, CommandBuffer *cb);
+
+// Call after the reorder pass, makes the output the current buffer.
+void FinishGpuParticleReorder(GpuParticlePool *pool, CommandBuffer *cb);
+
+// Call after the simulation pass, makes the output the current buffer.
+void SwapGpuParticles(GpuParticlePool *pool, CommandBuffer *cb);
+
+// Appends the particles in [offset, offset + count) of the latest finished
+// readback to `particles` and requests a readback of that range for the
+// next frame. Never waits, the data is a frame or two old.
+void GetGpuParticles(GpuParticlePool *pool, std::vector<Particle>& particles, uint32_t offset, uint32_t count);
+
+// Uploads the elements `indices` of the array `data` to the same place in
+// `b`, one upload per run of consecutive indices. Sorts and dedups `indices`.
+void UploadGpuRanges(Buffer *b, const void *data, size_t stride, std::vector<uint32_t>& indices);
+
+// Binds the current buffer for `DrawGpuParticles()`
+void BindGpuParticleRender(GpuParticlePool *pool, CommandBuffer *cb);
+
+// Draws an instance of the 6 index particle quad per live particle, the
+// count comes from the GPU.
+void DrawGpuParticles(GpuParticlePool *pool, CommandBuffer *cb);
+
@@ -1,8 +1,13 @@
 #include "particles.h"
+#include "particles_gpu.h"
 #include "renderer.h"
 #include "util.h"
 #include "fastmath.h"
 #include "intersection.h"
+#include "grid.h"
+#include "jobs.h"
+#include "gpu_scan.h"
+#include "gpu_grid.h"
 
 namespace {
 
@@ -25,17 +30,22 @@ uint16_t ParticleIndices[] =
 };
 
 const float GridCellSize = 1.0f;
-const float ParticleMaxStep = 0.3f;
+// The simulation walks every cell the particle crosses, the padding only
+// covers rounding at the cell borders.
+const float GridCellPadding = 0.001f;
 
-Vec3 vecMin(const Vec3& a, const Vec3& b)
-{
-	return vec3(F_MIN(a.x, b.x), F_MIN(a.y, b.y), F_MIN(a.z, b.z));
-}
+// Spare room of every cell for `UpdateTriangles()`, a cell that runs out
+// causes a full rebuild.
+const float GridCellSlack = 0.5f;
+const uint32_t GridCellMinSlack = 4;
 
-Vec3 vecMax(const Vec3& a, const Vec3& b)
-{
-	return vec3(F_MAX(a.x, b.x), F_MAX(a.y, b.y), F_MAX(a.z, b.z));
-}
+// Bucketed simulation: particles per work item
+const uint32_t BucketWorkSize = 256;
+
+// Header of `BucketBuffer` before the per bucket counts, see `bucket_count.glsl`.
+// The work item count is followed by the indirect arguments of the simulation.
+const uint32_t BucketHeaderSize = 4;
+const size_t BucketSimArgsOffset = sizeof(uint32_t);
 
 struct ParticleUniform
 {
@@ -45,22 +55,21 @@ struct ParticleUniform
 struct SimUniform
 {
 	int u_Counts[4];
-	int u_Copy[4];
 	float u_GridBase[4];
 	float u_InvGridSize[4];
 	float u_Dt[4];
 	float u_Gravity[4];
+	int u_Hash[4];
+	int u_Buckets[4];
 };
 
-struct GpuParticle
-{
-	float PositionAndLifetime[4];
-	float Velocity[4];
-};
-
+// First vertex and the two edges from it, the unit normal is packed into
+// the w components.
 struct GpuTriangle
 {
-	float P[3][4];
+	float AAndNormalX[4];
+	float E0AndNormalY[4];
+	float E1AndNormalZ[4];
 };
 
 struct GpuCell
@@ -70,14 +79,25 @@ struct GpuCell
 
 GpuTriangle toGpu(const Triangle& t)
 {
+	Vec3 e0 = t.B - t.A;
+	Vec3 e1 = t.C - t.A;
+	Vec3 n = cross(e0, e1);
+	float len = length(n);
+	n = len > 0.0f ? n * (1.0f / len) : vec3s(0.0f);
+
 	GpuTriangle gt;
-	for (uint32_t p = 0; p < 3; p++)
-	{
-		gt.P[p][0] = t.P[p].x;
-		gt.P[p][1] = t.P[p].y;
-		gt.P[p][2] = t.P[p].z;
-		gt.P[p][3] = 0.0f;
-	}
+	gt.AAndNormalX[0] = t.A.x;
+	gt.AAndNormalX[1] = t.A.y;
+	gt.AAndNormalX[2] = t.A.z;
+	gt.AAndNormalX[3] = n.x;
+	gt.E0AndNormalY[0] = e0.x;
+	gt.E0AndNormalY[1] = e0.y;
+	gt.E0AndNormalY[2] = e0.z;
+	gt.E0AndNormalY[3] = n.y;
+	gt.E1AndNormalZ[0] = e1.x;
+	gt.E1AndNormalZ[1] = e1.y;
+	gt.E1AndNormalZ[2] = e1.z;
+	gt.E1AndNormalZ[3] = n.z;
 	return gt;
 }
 
@@ -87,54 +107,103 @@ class ParticleSystemGridGpu : public ParticleSystem
 {
 public:
 	std::vector<Particle> NewParticles;
-
+	ParticleEmitters Emitters;
+	std::vector<EmitBatch> EmitBatches;
+
+	bool Sparse;
+	bool Bucketed;
+
+	// Dense grids are built on the GPU on the first `Update()`, `Grid` then
+	// only has the bounds until `UpdateTriangles()` needs the cells.
+	GpuGridBuilder *GridBuilder;
+	bool GridPending;
+	bool GridOnCpu;
+	UniformGrid Grid;
 	Vec3 GridBase;
 	int GridSize[3];
+	uint32_t HashMask;
+	uint32_t HashProbes;
 
 	Texture *ParticleTex;
 	Sampler *ParticleSampler;
 	VertexSpec *ParticleSpec;
-	Buffer *UniformBuffer;
 	Buffer *IndexBuffer;
 	Buffer *TexCoordBuffer;
 	RenderState *ParticleState;
 	Shader *ParticleShader;
 
 	Shader *ComputeSim;
-	Shader *CopySim;
-	Buffer *SimUniformBuffer;
-
-	Buffer *NewParticleBuffer;
-	Buffer *ParticleBuffer;
+	Shader *BucketCount;
+	Shader *BucketScatter;
+	Shader *BucketSim;
+	GpuScan *Scan;
+
+	// Pushed again by every simulation pass
+	SimUniform SimUniforms;
+
+	GpuParticlePool Pool;
+	std::vector<Triangle> Triangles;
+	std::vector<GpuTriangle> GpuTriangles;
+	std::vector<GpuCell> Cells;
+	std::vector<uint32_t> DirtyTriangles;
+	std::vector<uint32_t> DirtyCells;
 	Buffer *TriangleBuffer;
 	Buffer *CellBuffer;
+	Buffer *CellTriangleBuffer;
+	Buffer *HashBuffer;
 
-	uint32_t NumParticles;
-	uint32_t NumTriangles;
+	uint32_t NumBuckets;
+	uint32_t BucketCapacity;
+	Buffer *BucketBuffer;
+	Buffer *ParticleBucketBuffer;
+
+	JobPool *Jobs;
 
 	Timer *GpuTimer, *RenderTimer;
 
-	ParticleSystemGridGpu()
+	ParticleSystemGridGpu(bool sparse, bool bucketed)
 	{
+		Sparse = sparse;
+		Bucketed = bucketed;
+
 		ParticleTex = LoadImage("mesh/particle.png");
 		ParticleShader = LoadVertFragShader("shader/particle_gpu/particle");
 		ComputeSim = LoadComputeShader("shader/particle_gpu/cell_sim");
-		CopySim = LoadComputeShader("shader/particle_gpu/copy_particles");
+		if (Bucketed)
+		{
+			BucketCount = LoadComputeShader("shader/particle_gpu/bucket_count");
+			BucketScatter = LoadComputeShader("shader/particle_gpu/bucket_scatter");
+			BucketSim = LoadComputeShader("shader/particle_gpu/bucket_sim");
+			Scan = CreateGpuScan();
+			BucketBuffer = CreateBuffer(BufferStorage);
+			ParticleBucketBuffer = CreateBuffer(BufferStorage);
+		}
 		ParticleSpec = CreateVertexSpec(Particle_Elements, ArrayCount(Particle_Elements));
 		ParticleSampler = CreateSamplerSimple(FilterLinear, FilterLinear, FilterLinear, WrapClamp, 0);
 		TexCoordBuffer = CreateStaticBuffer(BufferVertex, ParticleTexCoords, sizeof(ParticleTexCoords));
 		IndexBuffer = CreateStaticBuffer(BufferIndex, ParticleIndices, sizeof(ParticleIndices));
-		UniformBuffer = CreateStaticBuffer(BufferUniform, NULL, sizeof(ParticleUniform));
-		SimUniformBuffer = CreateStaticBuffer(BufferUniform, NULL, sizeof(SimUniform));
 		GpuTimer = CreateTimer();
 		RenderTimer = CreateTimer();
 
-		NewParticleBuffer = CreateBuffer(BufferStorage);
+		InitParticleEmitters(&Emitters);
+		CreateGpuParticlePool(&Pool, 1024 * 16, 1024 * 512);
+
+		Jobs = CreateJobPool(0);
+		GridBuilder = Sparse ? NULL : CreateGpuGridBuilder();
+		GridPending = false;
+		GridOnCpu = false;
 
-		ParticleBuffer = CreateStaticBuffer(BufferStorage, NULL, sizeof(GpuParticle) * 1024 * 512);
+		TriangleBuffer = CreateBuffer(BufferStorage);
+		CellBuffer = CreateBuffer(BufferStorage);
+		CellTriangleBuffer = CreateBuffer(BufferStorage);
+		HashBuffer = CreateBuffer(BufferStorage);
 
-		NumParticles = 0;
-		NumTriangles = 0;
+		GridBase = vec3s(0.0f);
+		GridSize[0] = GridSize[1] = GridSize[2] = 0;
+		HashMask = 0;
+		HashProbes = 0;
+		NumBuckets = 0;
+		BucketCapacity = 0;
 
 		{
 			RenderStateInfo rsi = { };
@@ -147,6 +216,87 @@ public:
 
 	virtual ~ParticleSystemGridGpu()
 	{
+		DestroyJobPool(Jobs);
+	}
+
+	// Bins `Triangles` from scratch and uploads everything but the triangles
+	void rebuildGrid()
+	{
+		uint32_t count = (uint32_t)Triangles.size();
+		if (Sparse)
+			BuildSparseGrid(&Grid, Jobs, Triangles.data(), count, GridCellSize, GridCellPadding);
+		else
+			BuildUniformGrid(&Grid, Jobs, Triangles.data(), count, GridCellSize, GridCellPadding);
+		ReserveGridSlack(&Grid, GridCellSlack, GridCellMinSlack);
+		GridOnCpu = true;
+
+		// Cells list triangle indices, `w` is the capacity of the cell
+		uint32_t cellCount = (uint32_t)Grid.CellStart.size() - 1;
+		Cells.resize(cellCount);
+		for (uint32_t cellI = 0; cellI < cellCount; cellI++)
+		{
+			uint32_t cellBase = Grid.CellStart[cellI];
+			uint32_t cellSize = Grid.CellCount[cellI];
+
+			GpuCell *cell = &Cells[cellI];
+			cell->Offsets[0] = cellBase;
+			cell->Offsets[1] = cellBase + cellSize;
+			cell->Offsets[2] = cellSize;
+			cell->Offsets[3] = Grid.CellStart[cellI + 1] - cellBase;
+		}
+
+		SetBufferData(CellBuffer, Cells.data(), Cells.size() * sizeof(GpuCell));
+		SetBufferData(CellTriangleBuffer, Grid.Triangles.data(), Grid.Triangles.size() * sizeof(uint32_t));
+
+		setupGridLookup(cellCount);
+	}
+
+	// Same cells as the CPU build but without slack, nothing is read back
+	void buildGridOnGpu(CommandBuffer *cb)
+	{
+		BuildGpuUniformGrid(GridBuilder, cb, &Grid, Triangles.data(), (uint32_t)Triangles.size(),
+			GridCellSize, GridCellPadding, CellBuffer, CellTriangleBuffer);
+		GridOnCpu = false;
+		GridPending = false;
+
+		setupGridLookup((uint32_t)(Grid.Size[0] * Grid.Size[1] * Grid.Size[2]));
+	}
+
+	// Uniforms, hash table and buckets for the grid in `Grid`
+	void setupGridLookup(uint32_t cellCount)
+	{
+		GridBase = Grid.Base;
+		GridSize[0] = Grid.Size[0];
+		GridSize[1] = Grid.Size[1];
+		GridSize[2] = Grid.Size[2];
+
+		// Dense grids still bind a slot so the binding is never empty
+		std::vector<GridHashSlot> slots(1);
+		slots[0].Cell = -1;
+		HashProbes = 0;
+		if (Sparse)
+			BuildGridHashTable(&Grid, slots, &HashProbes);
+		HashMask = (uint32_t)slots.size() - 1;
+		SetBufferData(HashBuffer, slots.data(), slots.size() * sizeof(GridHashSlot));
+
+		if (Bucketed)
+		{
+			NumBuckets = cellCount + 1;
+			reserveBuckets();
+		}
+	}
+
+	// Sized for the grid and the particle capacity, which both can change
+	void reserveBuckets()
+	{
+		// Every cell plus one for the particles outside, then the counts
+		// are followed by up to one work item per bucket plus one for
+		// every full `BucketWorkSize` particles.
+		uint32_t maxWork = NumBuckets + Pool.Capacity / BucketWorkSize;
+		size_t size = (BucketHeaderSize + NumBuckets + 1 + maxWork * 2) * sizeof(uint32_t);
+		ReserveUndefinedBuffer(BucketBuffer, size, true);
+		ReserveUndefinedBuffer(ParticleBucketBuffer, Pool.Capacity * 2 * sizeof(uint32_t), true);
+		BucketCapacity = Pool.Capacity;
 	}
 
 	virtual void Initialize(const Triangle *triangles, uint32_t count)
@@ -154,64 +304,71 @@ public:
 		if (count == 0)
 			return;
 
-		Vec3 min = triangles[0].A, max = min;
+		// Triangles are stored once, the cells list their indices
+		Triangles.assign(triangles, triangles + count);
+		GpuTriangles.resize(count);
+		for (uint32_t i = 0; i < count; i++)
+			GpuTriangles[i] = toGpu(triangles[i]);
+		SetBufferData(TriangleBuffer, GpuTriangles.data(), GpuTriangles.size() * sizeof(GpuTriangle));
 
+		if (GridBuilder)
+			GridPending = true;
+		else
+			rebuildGrid();
+	}
+
+	virtual void UpdateTriangles(const uint32_t *indices, const Triangle *triangles, uint32_t count)
+	{
+		DirtyTriangles.clear();
+		DirtyCells.clear();
+
+		// Re-bin the moved triangles on the CPU, only the touched cells and
+		// triangles are uploaded. A pending GPU build picks them up as is.
+		bool rebuild = !GridOnCpu && !GridPending;
 		for (uint32_t i = 0; i < count; i++)
 		{
-			const Triangle *t = &triangles[i];
-			min = vecMin(min, vecMin(t->A, vecMin(t->B, t->C)));
-			max = vecMax(max, vecMax(t->A, vecMax(t->B, t->C)));
+			uint32_t ix = indices[i];
+			if (ix >= Triangles.size())
+				continue;
+
+			if (!rebuild && GridOnCpu && !MoveGridTriangle(&Grid, ix, Triangles[ix], triangles[i], DirtyCells))
+				rebuild = true;
+
+			Triangles[ix] = triangles[i];
+			GpuTriangles[ix] = toGpu(triangles[i]);
+			DirtyTriangles.push_back(ix);
 		}
 
-		GridBase = min;
-		GridSize[0] = (int)((max.x - min.x) / GridCellSize) + 1;
-		GridSize[1] = (int)((max.y - min.y) / GridCellSize) + 1;
-		GridSize[2] = (int)((max.z - min.z) / GridCellSize) + 1;
+		UploadGpuRanges(TriangleBuffer, GpuTriangles.data(), sizeof(GpuTriangle), DirtyTriangles);
 
-		std::vector<GpuTriangle> gpuTriangles;
-		std::vector<GpuCell> cells;
+		if (rebuild)
+		{
+			rebuildGrid();
+			return;
+		}
+		if (!GridOnCpu)
+			return;
 
-		int cellCount = GridSize[0] * GridSize[1] * GridSize[2];
-		for (int cellI = 0; cellI < cellCount; cellI++)
+		for (uint32_t cellI : DirtyCells)
 		{
-			int x = cellI % GridSize[0];
-			int y = cellI / GridSize[0] % GridSize[1];
-			int z = cellI / GridSize[0] / GridSize[1];
-
-			size_t cellBase = gpuTriangles.size();
-
-			Vec3 pos = vec3((float)x, (float)y, (float)z);
-			Vec3 base = GridBase + pos * GridCellSize;
-			Vec3 padding = vec3s(ParticleMaxStep);
-
-			AABB aabb;
-			aabb.Min = base - padding;
-			aabb.Max = base + vec3s(GridCellSize) + padding;
-
-			for (uint32_t i = 0; i < count; i++)
-			{
-				AABB ab;
-				ab.Min = vecMin(vecMin(triangles[i].A, triangles[i].B), triangles[i].C);
-				ab.Max = vecMax(vecMax(triangles[i].A, triangles[i].B), triangles[i].C);
-				// if (IntersectAABBvTriangle(aabb, triangles[i]))
-				if (IntersectAABBvAABB(aabb, ab))
-				{
-					gpuTriangles.push_back(toGpu(triangles[i]));
-				}
-			}
-
-			size_t cellEnd = gpuTriangles.size();
-
-			GpuCell cell;
-			cell.Offsets[0] = (uint32_t)cellBase;
-			cell.Offsets[1] = (uint32_t)cellEnd;
-			cell.Offsets[2] = (uint32_t)(cellEnd - cellBase);
-			cell.Offsets[3] = 0;
-			cells.push_back(cell);
+			GpuCell *cell = &Cells[cellI];
+			cell->Offsets[1] = cell->Offsets[0] + Grid.CellCount[cellI];
+			cell->Offsets[2] = Grid.CellCount[cellI];
 		}
+		UploadGpuRanges(CellBuffer, Cells.data(), sizeof(GpuCell), DirtyCells);
 
-		TriangleBuffer = CreateStaticBuffer(BufferStorage, gpuTriangles.data(), gpuTriangles.size() * sizeof(GpuTriangle));
-		CellBuffer = CreateStaticBuffer(BufferStorage, cells.data(), cells.size() * sizeof(GpuCell));
+		// Runs of consecutive cells are consecutive in `CellTriangleBuffer`
+		for (size_t i = 0; i < DirtyCells.size(); )
+		{
+			uint32_t first = DirtyCells[i];
+			uint32_t last = first;
+			while (++i < DirtyCells.size() && DirtyCells[i] == last + 1)
+				last++;
+
+			uint32_t begin = Grid.CellStart[first];
+			uint32_t end = Grid.CellStart[last] + Grid.CellCount[last];
+			UpdateBufferData(CellTriangleBuffer, begin * sizeof(uint32_t), &Grid.Triangles[begin], (end - begin) * sizeof(uint32_t));
+		}
 	}
 
 	virtual void SpawnParticles(const Particle *particles, uint32_t count)
@@ -219,65 +376,91 @@ public:
 		NewParticles.insert(NewParticles.end(), particles, particles + count);
 	}
 
-	virtual void GetParticles(std::vector<Particle>& particles)
+	virtual uint32_t AddEmitter(const ParticleEmitter& emitter)
+	{
+		return AddParticleEmitter(&Emitters, emitter);
+	}
+
+	virtual void RemoveEmitter(uint32_t id)
+	{
+		RemoveParticleEmitter(&Emitters, id);
+	}
+
+	virtual void GetParticles(std::vector<Particle>& particles, uint32_t offset, uint32_t count)
+	{
+		GetGpuParticles(&Pool, particles, offset, count);
+	}
+
+	// Counting sort of the particles by cell, then a simulation pass where
+	// every workgroup handles a run of particles of a single cell.
+	void SimulateBucketed(CommandBuffer *cb)
 	{
+		if (BucketCapacity != Pool.Capacity)
+			reserveBuckets();
+
+		ClearBufferData(cb, BucketBuffer, 0, (BucketHeaderSize + NumBuckets + 1) * sizeof(uint32_t));
+
+		SetShader(cb, BucketCount);
+		PushUniformData(cb, 0, &SimUniforms, sizeof(SimUniforms));
+		BindGpuParticleReorder(&Pool, cb);
+		SetStorageBuffer(cb, 2, ParticleBucketBuffer);
+		SetStorageBuffer(cb, 5, HashBuffer);
+		SetStorageBuffer(cb, 7, BucketBuffer);
+		DispatchGpuParticles(&Pool, cb);
+		ComputeBarrier(cb);
+
+		// Counts to offsets, the extra zero at the end becomes the total
+		GpuScanExclusive(Scan, cb, BucketBuffer, BucketHeaderSize, NumBuckets + 1);
+
+		SetShader(cb, BucketScatter);
+		PushUniformData(cb, 0, &SimUniforms, sizeof(SimUniforms));
+		BindGpuParticleReorder(&Pool, cb);
+		SetStorageBuffer(cb, 2, ParticleBucketBuffer);
+		SetStorageBuffer(cb, 7, BucketBuffer);
+		DispatchGpuParticles(&Pool, cb);
+		FinishGpuParticleReorder(&Pool, cb);
+
+		SetShader(cb, BucketSim);
+		PushUniformData(cb, 0, &SimUniforms, sizeof(SimUniforms));
+		BindGpuParticleSimulation(&Pool, cb);
+		SetStorageBuffer(cb, 1, TriangleBuffer);
+		SetStorageBuffer(cb, 2, CellBuffer);
+		SetStorageBuffer(cb, 5, HashBuffer);
+		SetStorageBuffer(cb, 6, CellTriangleBuffer);
+		SetStorageBuffer(cb, 7, BucketBuffer);
+		DispatchComputeIndirect(cb, BucketBuffer, BucketSimArgsOffset);
 	}
 
 	virtual void Update(CommandBuffer *cb, float dt)
 	{
 		char title[128];
-		sprintf(title, "Sim: %.2fms, Render: %.2fms   Particles: %u",
+		sprintf(title, "Sim: %.2fms, Render: %.2fms   Particles: %u (peak %u, dropped %u)",
 			GetTimerMilliseconds(GpuTimer),
-			GetTimerMilliseconds(RenderTimer), NumParticles);
+			GetTimerMilliseconds(RenderTimer), Pool.NumParticles,
+			Pool.PeakParticles, Pool.Dropped);
 		SetWindowTitle(title);
 
 		StartTimer(cb, GpuTimer);
 
-		Vec3 gravity = vec3(0.0f, -4.0f, 0.0f) * dt;
+		if (GridPending)
+			buildGridOnGpu(cb);
 
-		uint32_t numNewParticles = 0;
-		uint32_t numOldParticles = NumParticles;
+		Vec3 gravity = vec3(0.0f, -4.0f, 0.0f) * dt;
 
-		// Copy new particles
-		if (!NewParticles.empty())
-		{
-			ReserveUndefinedBuffer(NewParticleBuffer, sizeof(GpuParticle) * NewParticles.size(), false);
-			GpuParticle *parts = (GpuParticle*)LockBuffer(NewParticleBuffer);
-			for (uint32_t i = 0; i < NewParticles.size(); i++)
-			{
-				GpuParticle *g = &parts[i];
-				Particle *p = &NewParticles[i];
-
-				g->PositionAndLifetime[0] = p->Position.x;
-				g->PositionAndLifetime[1] = p->Position.y;
-				g->PositionAndLifetime[2] = p->Position.z;
-				g->PositionAndLifetime[3] = p->Lifetime;
-				g->Velocity[0] = p->Velocity.x;
-				g->Velocity[1] = p->Velocity.y;
-				g->Velocity[2] = p->Velocity.z;
-				g->Velocity[3] = 0.0f;
-			}
-			UnlockBuffer(NewParticleBuffer);
-
-			numNewParticles = NewParticles.size();
-
-			NumParticles += NewParticles.size();
-			NewParticles.clear();
-		}
+		// Copy new particles and expand the emitters
+		AppendGpuParticles(&Pool, cb, NewParticles);
+		StepParticleEmitters(&Emitters, dt, EmitBatches);
+		EmitGpuParticles(&Pool, cb, EmitBatches);
 
 		// Simulate particles
 		{
 			float invCellSize = 1.0f / GridCellSize;
 
-			SimUniform u;
+			SimUniform &u = SimUniforms;
 			u.u_Counts[0] = GridSize[0];
 			u.u_Counts[1] = GridSize[1];
 			u.u_Counts[2] = GridSize[2];
 			u.u_Counts[3] = 0;
-			u.u_Copy[0] = numOldParticles;
-			u.u_Copy[1] = numNewParticles;
-			u.u_Copy[2] = 0;
-			u.u_Copy[3] = 0;
 			u.u_GridBase[0] = GridBase.x;
 			u.u_GridBase[1] = GridBase.y;
 			u.u_GridBase[2] = GridBase.z;
@@ -294,21 +477,33 @@ public:
 			u.u_Gravity[1] = gravity.y;
 			u.u_Gravity[2] = gravity.z;
 			u.u_Gravity[3] = 0.0f;
-			SetBufferData(SimUniformBuffer, &u, sizeof(u));
+			u.u_Hash[0] = Sparse ? 1 : 0;
+			u.u_Hash[1] = (int)HashMask;
+			u.u_Hash[2] = (int)HashProbes;
+			u.u_Hash[3] = 0;
+			u.u_Buckets[0] = (int)NumBuckets;
+			u.u_Buckets[1] = (int)NumBuckets + 1;
+			u.u_Buckets[2] = (int)BucketWorkSize;
+			u.u_Buckets[3] = 0;
 		}
 
-		SetShader(cb, CopySim);
-		SetUniformBuffer(cb, 0, SimUniformBuffer);
-		SetStorageBuffer(cb, 0, ParticleBuffer);
-		SetStorageBuffer(cb, 1, NewParticleBuffer);
-		DispatchCompute(cb, (numNewParticles + 63) / 64, 1, 1);
+		if (Bucketed)
+		{
+			SimulateBucketed(cb);
+		}
+		else
+		{
+			SetShader(cb, ComputeSim);
+			PushUniformData(cb, 0, &SimUniforms, sizeof(SimUniforms));
+			BindGpuParticleSimulation(&Pool, cb);
+			SetStorageBuffer(cb, 1, TriangleBuffer);
+			SetStorageBuffer(cb, 2, CellBuffer);
+			SetStorageBuffer(cb, 5, HashBuffer);
+			SetStorageBuffer(cb, 6, CellTriangleBuffer);
+			DispatchGpuParticles(&Pool, cb);
+		}
 
-		SetShader(cb, ComputeSim);
-		SetUniformBuffer(cb, 0, SimUniformBuffer);
-		SetStorageBuffer(cb, 0, ParticleBuffer);
-		SetStorageBuffer(cb, 1, TriangleBuffer);
-		SetStorageBuffer(cb, 2, CellBuffer);
-		DispatchCompute(cb, (NumParticles + 63) / 64, 1, 1);
+		SwapGpuParticles(&Pool, cb);
 
 		StopTimer(cb, GpuTimer);
 	}
@@ -321,18 +516,17 @@ public:
 		{
 			ParticleUniform u;
 			u.u_WorldViewProjection = transpose(view * proj);
-			SetBufferData(UniformBuffer, &u, sizeof(u));
+			PushUniformData(cb, 0, &u, sizeof(u));
 		}
 
 		// Set state and draw!
 		SetShader(cb, ParticleShader);
 		SetRenderState(cb, ParticleState);
-		SetUniformBuffer(cb, 0, UniformBuffer);
 		SetVertexBuffers(cb, ParticleSpec, &TexCoordBuffer, 1);
 		SetIndexBuffer(cb, IndexBuffer, DataUInt16);
-		SetStorageBuffer(cb, 0, ParticleBuffer);
+		BindGpuParticleRender(&Pool, cb);
 		SetTexture(cb, 0, ParticleTex, ParticleSampler);
-		DrawIndexedInstanced(cb, DrawTriangles, NumParticles, 6, 0);
+		DrawGpuParticles(&Pool, cb);
 
 		StopTimer(cb, RenderTimer);
 	}
@@ -340,7 +534,17 @@ public:
 
 ParticleSystem *ParticlesCreateGridGpu()
 {
-	return new ParticleSystemGridGpu();
+	return new ParticleSystemGridGpu(false, false);
+}
+
+ParticleSystem *ParticlesCreateSparseGridGpu()
+{
+	return new ParticleSystemGridGpu(true, false);
+}
+
+ParticleSystem *ParticlesCreateBucketedGridGpu()
+{
+	return new ParticleSystemGridGpu(false, true);
 }
 
 
@@ -5,13 +5,366 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
-#include <unordered_map>
+#include <vector>
 
 struct Buffer
 {
 	GLuint Buf;
 	GLenum BindPoint;
 	size_t Size;
+	bool Locked;
+};
+
+// Bumped whenever the renderer changes bindings cached by the command
+// buffers outside of them, they forget their cached bindings on the next
+// call. Index buffer bindings are part of the bound VAO, so binding an
+// index buffer for an upload counts.
+static uint32_t g_BindingEpoch = 1;
+
+static void BindBuffer(GLenum bp, GLuint buf)
+{
+	glBindBuffer(bp, buf);
+	if (bp == GL_ELEMENT_ARRAY_BUFFER)
+		g_BindingEpoch++;
+}
+
+static size_t g_BufferMemory;
+static size_t g_PeakBufferMemory;
+
+static void SetBufferSize(Buffer *b, size_t size)
+{
+	g_BufferMemory = g_BufferMemory - b->Size + size;
+	if (g_BufferMemory > g_PeakBufferMemory)
+		g_PeakBufferMemory = g_BufferMemory;
+	b->Size = size;
+}
+
+size_t GetBufferMemoryUsage()
+{
+	return g_BufferMemory;
+}
+
+size_t GetPeakBufferMemoryUsage()
+{
+	return g_PeakBufferMemory;
+}
+
+void ResetPeakBufferMemoryUsage()
+{
+	g_PeakBufferMemory = g_BufferMemory;
+}
+
+// Vertex buffer bindings of a VAO, each element of a spec reads from the
+// binding of its stream.
+const uint32_t MaxVertexStreams = 4;
+
+// Commands of a deferred command buffer are stored back to back in
+// `Stream`, each one a `CommandHeader` followed by the arguments of the
+// call and any arrays or data it points to.
+enum CommandType : uint32_t
+{
+	CommandStartTimer,
+	CommandStopTimer,
+	CommandCopyBufferData,
+	CommandClearBufferData,
+	CommandUploadBufferData,
+	CommandClear,
+	CommandSetVertexBuffers,
+	CommandSetUniformBuffer,
+	CommandPushUniformData,
+	CommandSetStorageBuffer,
+	CommandSetShader,
+	CommandSetIndexBuffer,
+	CommandSetTexture,
+	CommandSetFramebuffer,
+	CommandSetRenderState,
+	CommandSetFillMode,
+	CommandDrawArrays,
+	CommandDrawIndexed,
+	CommandDrawIndexedInstanced,
+	CommandDrawIndexedIndirect,
+	CommandMultiDrawIndexedIndirect,
+	CommandDispatchCompute,
+	CommandDispatchComputeIndirect,
+	CommandComputeBarrier,
+};
+
+struct CommandHeader
+{
+	CommandType Type;
+	uint32_t Size;
+};
+
+const uint32_t MaxCachedBufferSlots = 16;
+const uint32_t MaxCachedTextureSlots = 16;
+
+// GL objects bound by the command buffer, `UnknownBinding` if it can't
+// know. Slots past the cached ones are always bound.
+const GLuint UnknownBinding = ~0u;
+
+struct BindingCache
+{
+	uint32_t Epoch;
+
+	GLuint Program;
+	GLuint Framebuffer;
+	GLuint Vao;
+	GLuint IndexBuffer;
+	GLuint VertexBuffers[MaxVertexStreams];
+	GLintptr VertexOffsets[MaxVertexStreams];
+	GLuint UniformBuffers[MaxCachedBufferSlots];
+	size_t UniformOffsets[MaxCachedBufferSlots];
+	size_t UniformSizes[MaxCachedBufferSlots];
+	GLuint StorageBuffers[MaxCachedBufferSlots];
+
+	GLuint ActiveTexture;
+	GLuint Textures[MaxCachedTextureSlots];
+	GLuint Samplers[MaxCachedTextureSlots];
+};
+
+struct CommandBuffer
+{
+	GLenum IndexType;
+
+	RenderStateInfo State;
+
+	BindingCache Bindings;
+	uint64_t BindsIssued;
+	uint64_t BindsFiltered;
+
+	bool Deferred;
+	std::vector<char> Stream;
+};
+
+// Appends a command with `extra` bytes of trailing data to a deferred
+// command buffer, the pointer is valid until the next command is recorded.
+template <typename T>
+static T *RecordCommand(CommandBuffer *cb, size_t extra = 0)
+{
+	size_t offset = cb->Stream.size();
+	size_t size = (sizeof(CommandHeader) + sizeof(T) + extra + 7) & ~(size_t)7;
+	cb->Stream.resize(offset + size);
+
+	CommandHeader *h = (CommandHeader*)&cb->Stream[offset];
+	h->Type = T::Type;
+	h->Size = (uint32_t)size;
+	return (T*)(h + 1);
+}
+
+// The last command buffer to bind anything, another one may have changed
+// the bindings since.
+static CommandBuffer *g_BindingOwner;
+
+static void SyncBindings(CommandBuffer *cb)
+{
+	if (cb->Bindings.Epoch == g_BindingEpoch && g_BindingOwner == cb)
+		return;
+
+	memset(&cb->Bindings, 0xff, sizeof(BindingCache));
+	cb->Bindings.Epoch = g_BindingEpoch;
+	g_BindingOwner = cb;
+}
+
+// Returns true if `value` has to be bound, counts the call either way.
+// `cached` is NULL for slots that aren't cached.
+static bool UpdateBinding(CommandBuffer *cb, GLuint *cached, GLuint value)
+{
+	if (cached && *cached == value)
+	{
+		cb->BindsFiltered++;
+		return false;
+	}
+
+	if (cached)
+		*cached = value;
+	cb->BindsIssued++;
+	return true;
+}
+
+struct CmdStartTimer
+{
+	static const CommandType Type = CommandStartTimer;
+
+	Timer *T;
+};
+
+struct CmdStopTimer
+{
+	static const CommandType Type = CommandStopTimer;
+
+	Timer *T;
+};
+
+struct CmdCopyBufferData
+{
+	static const CommandType Type = CommandCopyBufferData;
+
+	Buffer *Dst, *Src;
+	size_t DstOffset, SrcOffset, Size;
+};
+
+struct CmdClearBufferData
+{
+	static const CommandType Type = CommandClearBufferData;
+
+	Buffer *B;
+	size_t Offset, Size;
+};
+
+struct CmdUploadBufferData
+{
+	static const CommandType Type = CommandUploadBufferData;
+
+	Buffer *B;
+	size_t Size;
+};
+
+struct CmdClear
+{
+	static const CommandType Type = CommandClear;
+
+	ClearInfo Info;
+};
+
+struct CmdSetVertexBuffers
+{
+	static const CommandType Type = CommandSetVertexBuffers;
+
+	VertexSpec *Spec;
+	uint32_t NumStreams;
+	bool HasOffsets;
+};
+
+struct CmdSetUniformBuffer
+{
+	static const CommandType Type = CommandSetUniformBuffer;
+
+	uint32_t Index;
+	Buffer *B;
+};
+
+struct CmdPushUniformData
+{
+	static const CommandType Type = CommandPushUniformData;
+
+	uint32_t Index;
+	size_t Size;
+};
+
+struct CmdSetStorageBuffer
+{
+	static const CommandType Type = CommandSetStorageBuffer;
+
+	uint32_t Index;
+	Buffer *B;
+};
+
+struct CmdSetShader
+{
+	static const CommandType Type = CommandSetShader;
+
+	Shader *S;
+};
+
+struct CmdSetIndexBuffer
+{
+	static const CommandType Type = CommandSetIndexBuffer;
+
+	Buffer *B;
+	DataType IndexType;
+};
+
+struct CmdSetTexture
+{
+	static const CommandType Type = CommandSetTexture;
+
+	uint32_t Index;
+	Texture *Tex;
+	Sampler *Sm;
+};
+
+struct CmdSetFramebuffer
+{
+	static const CommandType Type = CommandSetFramebuffer;
+
+	Framebuffer *F;
+};
+
+struct CmdSetRenderState
+{
+	static const CommandType Type = CommandSetRenderState;
+
+	RenderState *R;
+};
+
+struct CmdSetFillMode
+{
+	static const CommandType Type = CommandSetFillMode;
+
+	FillMode Mode;
+};
+
+struct CmdDrawArrays
+{
+	static const CommandType Type = CommandDrawArrays;
+
+	DrawType Draw;
+	uint32_t Num, IndexOffset;
+};
+
+struct CmdDrawIndexed
+{
+	static const CommandType Type = CommandDrawIndexed;
+
+	DrawType Draw;
+	uint32_t Num, IndexOffset;
+};
+
+struct CmdDrawIndexedInstanced
+{
+	static const CommandType Type = CommandDrawIndexedInstanced;
+
+	DrawType Draw;
+	uint32_t NumInstances, Num, IndexOffset;
+};
+
+struct CmdDrawIndexedIndirect
+{
+	static const CommandType Type = CommandDrawIndexedIndirect;
+
+	DrawType Draw;
+	Buffer *Args;
+	size_t Offset;
+};
+
+struct CmdMultiDrawIndexedIndirect
+{
+	static const CommandType Type = CommandMultiDrawIndexedIndirect;
+
+	DrawType Draw;
+	Buffer *Args;
+	size_t Offset;
+	uint32_t NumDraws, Stride;
+};
+
+struct CmdDispatchCompute
+{
+	static const CommandType Type = CommandDispatchCompute;
+
+	uint32_t X, Y, Z;
+};
+
+struct CmdDispatchComputeIndirect
+{
+	static const CommandType Type = CommandDispatchComputeIndirect;
+
+	Buffer *Args;
+	size_t Offset;
+};
+
+struct CmdComputeBarrier
+{
+	static const CommandType Type = CommandComputeBarrier;
 };
 
 const GLenum GlBufferType[] =
@@ -20,6 +373,7 @@ const GLenum GlBufferType[] =
 	GL_ELEMENT_ARRAY_BUFFER,
 	GL_UNIFORM_BUFFER,
 	GL_SHADER_STORAGE_BUFFER,
+	GL_DRAW_INDIRECT_BUFFER,
 };
 
 Buffer *CreateBuffer(BufferType type)
@@ -28,6 +382,7 @@ Buffer *CreateBuffer(BufferType type)
 	glGenBuffers(1, &b->Buf);
 	b->BindPoint = GlBufferType[type];
 	b->Size = 0;
+	b->Locked = false;
 	return b;
 }
 
@@ -35,52 +390,435 @@ Buffer *CreateStaticBuffer(BufferType type, const void *data, size_t size)
 {
 	Buffer *b = CreateBuffer(type);
 	GLenum bp = b->BindPoint;
-	glBindBuffer(bp, b->Buf);
+	BindBuffer(bp, b->Buf);
 	glBufferData(bp, size, data, GL_STATIC_DRAW);
-	b->Size = size;
+	SetBufferSize(b, size);
 	return b;
 }
 
+void DestroyBuffer(Buffer *b)
+{
+	glDeleteBuffers(1, &b->Buf);
+	SetBufferSize(b, 0);
+	g_BindingEpoch++;
+	free(b);
+}
+
 void SetBufferData(Buffer *b, const void *data, size_t size)
 {
 	GLenum bp = b->BindPoint;
-	glBindBuffer(bp, b->Buf);
+	BindBuffer(bp, b->Buf);
 	glBufferData(bp, size, data, GL_STATIC_DRAW);
-	b->Size = size;
+	SetBufferSize(b, size);
 }
 
-void ReserveUndefinedBuffer(Buffer *b, size_t size, bool shrink)
+void UpdateBufferData(Buffer *b, size_t offset, const void *data, size_t size)
 {
+	if (size == 0)
+		return;
+
 	GLenum bp = b->BindPoint;
-	glBindBuffer(bp, b->Buf);
+	BindBuffer(bp, b->Buf);
+	glBufferSubData(bp, offset, size, data);
+}
 
-	if (shrink || size > b->Size || true)
+void UploadBufferData(CommandBuffer *cb, Buffer *b, const void *data, size_t size)
+{
+	if (cb->Deferred)
 	{
-		glBufferData(bp, size, NULL, GL_STATIC_DRAW);
-		b->Size = size;
+		CmdUploadBufferData *c = RecordCommand<CmdUploadBufferData>(cb, size);
+		*c = { b, size };
+		memcpy(c + 1, data, size);
+		return;
 	}
-	else
-		glInvalidateBufferData(bp);
 
+	ReserveUndefinedBuffer(b, size, false);
+	UpdateBufferData(b, 0, data, size);
+}
+
+void ReserveUndefinedBuffer(Buffer *b, size_t size, bool shrink)
+{
+	if (size > b->Size || (shrink && size < b->Size))
+	{
+		// Grow geometrically unless the exact size was asked for
+		size_t capacity = size;
+		if (!shrink && capacity < b->Size * 2)
+			capacity = b->Size * 2;
+
+		GLenum bp = b->BindPoint;
+		BindBuffer(bp, b->Buf);
+		glBufferData(bp, capacity, NULL, GL_STATIC_DRAW);
+		SetBufferSize(b, capacity);
+	}
+	else if (b->Size > 0)
+	{
+		// Lets the driver hand out fresh storage instead of waiting for
+		// the commands still using the old contents
+		glInvalidateBufferData(b->Buf);
+	}
+}
+
+const uint32_t StreamBufferFrames = 3;
+const size_t StreamBufferAlignment = 256;
+
+struct StreamBuffer
+{
+	Buffer Buf;
+	char *Ptr;
+	size_t FrameSize;
+	uint32_t Frame;
+	GLsync Fences[StreamBufferFrames];
+};
+
+StreamBuffer *CreateStreamBuffer(BufferType type)
+{
+	StreamBuffer *sb = (StreamBuffer*)malloc(sizeof(StreamBuffer));
+	memset(sb, 0, sizeof(StreamBuffer));
+	sb->Buf.BindPoint = GlBufferType[type];
+	return sb;
+}
+
+void *MapStreamBuffer(StreamBuffer *sb, size_t size, size_t *outOffset)
+{
+	// Everything using the current region has been issued by now
+	if (sb->Ptr)
+		sb->Fences[sb->Frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	sb->Frame = (sb->Frame + 1) % StreamBufferFrames;
+
+	if (size > sb->FrameSize || !sb->Ptr)
+	{
+		size_t frameSize = sb->FrameSize * 2;
+		if (frameSize < size)
+			frameSize = size;
+		frameSize = (frameSize + StreamBufferAlignment - 1) & ~(StreamBufferAlignment - 1);
+		if (frameSize == 0)
+			frameSize = StreamBufferAlignment;
+
+		// GL keeps the old storage alive until the commands using it are done
+		if (sb->Buf.Buf)
+			glDeleteBuffers(1, &sb->Buf.Buf);
+		for (uint32_t i = 0; i < StreamBufferFrames; i++)
+		{
+			if (sb->Fences[i])
+				glDeleteSync(sb->Fences[i]);
+			sb->Fences[i] = 0;
+		}
+
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		GLenum bp = sb->Buf.BindPoint;
+		glGenBuffers(1, &sb->Buf.Buf);
+		BindBuffer(bp, sb->Buf.Buf);
+		glBufferStorage(bp, frameSize * StreamBufferFrames, NULL, flags);
+		sb->Ptr = (char*)glMapBufferRange(bp, 0, frameSize * StreamBufferFrames, flags);
+		sb->FrameSize = frameSize;
+		SetBufferSize(&sb->Buf, frameSize * StreamBufferFrames);
+
+		// The old name may come back for the new buffer while VAOs still
+		// point at the old storage
+		g_BindingEpoch++;
+	}
+	else if (sb->Fences[sb->Frame])
+	{
+		// Only waits if the GPU is more than two frames behind
+		glClientWaitSync(sb->Fences[sb->Frame], GL_SYNC_FLUSH_COMMANDS_BIT, ~(GLuint64)0);
+		glDeleteSync(sb->Fences[sb->Frame]);
+		sb->Fences[sb->Frame] = 0;
+	}
+
+	*outOffset = sb->Frame * sb->FrameSize;
+	return sb->Ptr + *outOffset;
+}
+
+Buffer *GetStreamBuffer(StreamBuffer *sb)
+{
+	return &sb->Buf;
+}
+
+const uint32_t UniformRingFrames = 3;
+const size_t UniformRingMinFrameSize = 64 * 1024;
+
+// Persistently mapped storage for `PushUniformData()`, split into a region
+// per frame in flight. Uniforms are bump allocated from the current region,
+// `EndFrame()` fences it and moves on to the next one.
+//
+// Growing mid-frame can't delete the old buffer, that would unbind it from
+// every slot earlier pushes of the frame still use. It's retired instead and
+// deleted by `EndFrame()` once the fence of its last frame has passed.
+struct RetiredUniformBuffer
+{
+	Buffer Buf;
+	GLsync Fence;
+};
+
+struct UniformRing
+{
+	Buffer Buf;
+	std::vector<RetiredUniformBuffer> Retired;
+	char *Ptr;
+	size_t FrameSize;
+	size_t Alignment;
+	size_t Used;
+	uint32_t Frame;
+	GLsync Fences[UniformRingFrames];
+};
+
+static UniformRing g_UniformRing;
+
+// Returns the offset of `size` bytes in the ring, grows the ring if the
+// current region is full.
+static size_t AllocateUniformData(size_t size)
+{
+	UniformRing *r = &g_UniformRing;
+
+	if (!r->Alignment)
+	{
+		GLint alignment;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		r->Alignment = alignment > 0 ? (size_t)alignment : 256;
+		r->Buf.BindPoint = GL_UNIFORM_BUFFER;
+	}
+
+	size_t offset = (r->Used + r->Alignment - 1) & ~(r->Alignment - 1);
+
+	if (!r->Ptr || offset + size > r->FrameSize)
+	{
+		size_t frameSize = r->FrameSize * 2;
+		if (frameSize < UniformRingMinFrameSize)
+			frameSize = UniformRingMinFrameSize;
+		while (frameSize < size)
+			frameSize *= 2;
+
+		// The new buffer has nothing in flight, the old one is fenced at
+		// the end of this frame
+		if (r->Buf.Buf)
+		{
+			RetiredUniformBuffer retired = { r->Buf, 0 };
+			r->Retired.push_back(retired);
+			r->Buf.Size = 0;
+		}
+		for (uint32_t i = 0; i < UniformRingFrames; i++)
+		{
+			if (r->Fences[i])
+				glDeleteSync(r->Fences[i]);
+			r->Fences[i] = 0;
+		}
+
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &r->Buf.Buf);
+		BindBuffer(GL_UNIFORM_BUFFER, r->Buf.Buf);
+		glBufferStorage(GL_UNIFORM_BUFFER, frameSize * UniformRingFrames, NULL, flags);
+		r->Ptr = (char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, frameSize * UniformRingFrames, flags);
+		r->FrameSize = frameSize;
+		SetBufferSize(&r->Buf, frameSize * UniformRingFrames);
+		offset = 0;
+	}
+
+	r->Used = offset + size;
+	return r->Frame * r->FrameSize + offset;
+}
+
+void EndFrame(CommandBuffer *cb)
+{
+	assert(!cb->Deferred);
+
+	UniformRing *r = &g_UniformRing;
+	if (!r->Ptr)
+		return;
+
+	// Everything using the current region has been issued by now
+	r->Fences[r->Frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	for (size_t i = 0; i < r->Retired.size(); )
+	{
+		RetiredUniformBuffer *retired = &r->Retired[i];
+		if (!retired->Fence)
+		{
+			// Retired during this frame
+			retired->Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			i++;
+			continue;
+		}
+
+		if (glClientWaitSync(retired->Fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+		{
+			i++;
+			continue;
+		}
+
+		// Nothing pushed this frame uses it, so losing its bindings is fine
+		glDeleteSync(retired->Fence);
+		glDeleteBuffers(1, &retired->Buf.Buf);
+		SetBufferSize(&retired->Buf, 0);
+		r->Retired.erase(r->Retired.begin() + i);
+
+		// The old name may come back for another buffer
+		g_BindingEpoch++;
+	}
+
+	r->Frame = (r->Frame + 1) % UniformRingFrames;
+	r->Used = 0;
+
+	if (r->Fences[r->Frame])
+	{
+		// Only waits if the GPU is more than two frames behind
+		glClientWaitSync(r->Fences[r->Frame], GL_SYNC_FLUSH_COMMANDS_BIT, ~(GLuint64)0);
+		glDeleteSync(r->Fences[r->Frame]);
+		r->Fences[r->Frame] = 0;
+	}
 }
 
 void *LockBuffer(Buffer *b)
 {
-	if (b->Size == 0)
+	return LockBufferRange(b, 0, b->Size, 0);
+}
+
+void *LockBufferRange(Buffer *b, size_t offset, size_t size, uint32_t flags)
+{
+	if (size == 0)
 		return NULL;
 
-	glBindBuffer(b->BindPoint, b->Buf);
-	//return glMapBufferRange(b->BindPoint, 0, b->Size, GL_MAP_WRITE_BIT);
-	return glMapBuffer(b->BindPoint, GL_WRITE_ONLY);
+	GLbitfield access = GL_MAP_WRITE_BIT;
+	if (flags & LockInvalidateRange)
+		access |= GL_MAP_INVALIDATE_RANGE_BIT;
+	if (flags & LockInvalidateBuffer)
+		access |= GL_MAP_INVALIDATE_BUFFER_BIT;
+	if (flags & LockUnsynchronized)
+		access |= GL_MAP_UNSYNCHRONIZED_BIT;
+
+	BindBuffer(b->BindPoint, b->Buf);
+	void *ptr = glMapBufferRange(b->BindPoint, offset, size, access);
+	b->Locked = ptr != NULL;
+	return ptr;
 }
 
 void UnlockBuffer(Buffer *b)
 {
-	if (b->Size == 0)
+	if (!b->Locked)
 		return;
 
-	glBindBuffer(b->BindPoint, b->Buf);
+	BindBuffer(b->BindPoint, b->Buf);
 	glUnmapBuffer(b->BindPoint);
+	b->Locked = false;
+}
+
+const uint32_t ReadbackSlotCount = 3;
+
+struct ReadbackSlot
+{
+	GLuint Buf;
+	void *Ptr;
+	size_t Capacity;
+	size_t Size;
+	GLsync Fence;
+	uint64_t Serial;
+	uint32_t Tag;
+	bool Ready;
+};
+
+struct ReadbackBuffer
+{
+	ReadbackSlot Slots[ReadbackSlotCount];
+	uint32_t Next;
+	uint64_t Serial;
+};
+
+ReadbackBuffer *CreateReadbackBuffer()
+{
+	ReadbackBuffer *rb = (ReadbackBuffer*)malloc(sizeof(ReadbackBuffer));
+	memset(rb, 0, sizeof(ReadbackBuffer));
+	return rb;
+}
+
+// Non-blocking fence check
+static bool IsFenceSignaled(GLsync fence)
+{
+	GLenum result = glClientWaitSync(fence, 0, 0);
+	return result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED;
+}
+
+bool QueueReadback(CommandBuffer *cb, ReadbackBuffer *rb, const ReadbackRange *ranges, uint32_t numRanges, uint32_t tag)
+{
+	// The result is needed right away
+	assert(!cb->Deferred);
+
+	ReadbackSlot *s = &rb->Slots[rb->Next];
+	if (s->Fence)
+	{
+		if (!IsFenceSignaled(s->Fence))
+			return false;
+
+		glDeleteSync(s->Fence);
+		s->Fence = 0;
+	}
+
+	size_t size = 0;
+	for (uint32_t i = 0; i < numRanges; i++)
+		size += ranges[i].Size;
+
+	if (size > s->Capacity)
+	{
+		if (s->Buf)
+			glDeleteBuffers(1, &s->Buf);
+
+		size_t capacity = s->Capacity * 2;
+		if (capacity < size)
+			capacity = size;
+
+		GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &s->Buf);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, s->Buf);
+		glBufferStorage(GL_COPY_WRITE_BUFFER, capacity, NULL, flags);
+		s->Ptr = glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, capacity, flags);
+		s->Capacity = capacity;
+	}
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, s->Buf);
+
+	size_t offset = 0;
+	for (uint32_t i = 0; i < numRanges; i++)
+	{
+		if (ranges[i].Size > 0)
+		{
+			glBindBuffer(GL_COPY_READ_BUFFER, ranges[i].Src->Buf);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, ranges[i].Offset, offset, ranges[i].Size);
+		}
+		offset += ranges[i].Size;
+	}
+
+	s->Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	s->Size = size;
+	s->Tag = tag;
+	s->Serial = ++rb->Serial;
+	s->Ready = false;
+
+	rb->Next = (rb->Next + 1) % ReadbackSlotCount;
+	return true;
+}
+
+const void *GetReadbackData(ReadbackBuffer *rb, size_t *outSize, uint32_t *outTag)
+{
+	ReadbackSlot *latest = NULL;
+	for (uint32_t i = 0; i < ReadbackSlotCount; i++)
+	{
+		ReadbackSlot *s = &rb->Slots[i];
+		if (s->Fence && IsFenceSignaled(s->Fence))
+		{
+			glDeleteSync(s->Fence);
+			s->Fence = 0;
+			s->Ready = true;
+		}
+
+		if (s->Ready && (!latest || s->Serial > latest->Serial))
+			latest = s;
+	}
+
+	if (!latest)
+		return NULL;
+
+	*outSize = latest->Size;
+	*outTag = latest->Tag;
+	return latest->Ptr;
 }
 
 struct Timer
@@ -113,11 +851,23 @@ double GetTimerMilliseconds(Timer *t)
 
 void StartTimer(CommandBuffer *cb, Timer *t)
 {
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdStartTimer>(cb) = { t };
+		return;
+	}
+
 	glBeginQuery(GL_TIME_ELAPSED, t->Queries[t->QueryIndex]);
 }
 
 void StopTimer(CommandBuffer *cb, Timer *t)
 {
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdStopTimer>(cb) = { t };
+		return;
+	}
+
 	glEndQuery(GL_TIME_ELAPSED);
 	t->QueryIndex++;
 	if (t->QueryIndex >= 4)
@@ -129,13 +879,36 @@ void StopTimer(CommandBuffer *cb, Timer *t)
 
 void CopyBufferData(CommandBuffer *cb, Buffer *dst, Buffer *src, size_t dstOffset, size_t srcOffset, size_t size)
 {
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdCopyBufferData>(cb) = { dst, src, dstOffset, srcOffset, size };
+		return;
+	}
+
 	glBindBuffer(GL_COPY_WRITE_BUFFER, dst->Buf);
 	glBindBuffer(GL_COPY_READ_BUFFER, src->Buf);
 	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, srcOffset, dstOffset, size);
 }
 
+void ClearBufferData(CommandBuffer *cb, Buffer *b, size_t offset, size_t size)
+{
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdClearBufferData>(cb) = { b, offset, size };
+		return;
+	}
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, b->Buf);
+	glClearBufferSubData(GL_COPY_WRITE_BUFFER, GL_R32UI, offset, size, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+}
+
+// One VAO per spec holding the attribute formats, the buffers are bound to
+// it per draw by `SetVertexBuffers()`.
 struct VertexSpec
 {
+	GLuint Vao;
+	GLsizei Strides[MaxVertexStreams];
+
 	uint32_t NumElements;
 	VertexElement Elements[1];
 };
@@ -175,145 +948,286 @@ VertexSpec *CreateVertexSpec(const VertexElement *el, uint32_t count)
 
 	spec->NumElements = count;
 	memcpy(spec->Elements, el, count * sizeof(VertexElement));
+	memset(spec->Strides, 0, sizeof(spec->Strides));
+
+	glGenVertexArrays(1, &spec->Vao);
+	glBindVertexArray(spec->Vao);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const VertexElement *e = &el[i];
+
+		// The stride and divisor belong to the binding, the elements of a
+		// stream have to agree on them.
+		assert(e->Stream < MaxVertexStreams);
+		assert(!spec->Strides[e->Stream] || spec->Strides[e->Stream] == (GLsizei)e->Stride);
+		spec->Strides[e->Stream] = e->Stride;
+
+		glEnableVertexAttribArray(e->Index);
+
+		if (GlIntegral[e->Type] && !e->Normalized)
+			glVertexAttribIFormat(e->Index, e->NumComponents, GlDataType[e->Type], e->Offset);
+		else
+			glVertexAttribFormat(e->Index, e->NumComponents, GlDataType[e->Type], e->Normalized, e->Offset);
+
+		glVertexAttribBinding(e->Index, e->Stream);
+		glVertexBindingDivisor(e->Stream, e->Divisor);
+	}
+
+	glBindVertexArray(0);
+	g_BindingEpoch++;
 
 	return spec;
 }
 
-struct VertexBuffers
+CommandBuffer *CreateCommandBuffer()
 {
-	GLuint Buffers[4];
-	VertexSpec *Spec;
-};
+	return new CommandBuffer();
+}
 
-struct VBHash
+void GetBindingCounters(CommandBuffer *cb, uint64_t *outIssued, uint64_t *outFiltered)
 {
-	size_t operator()(const VertexBuffers& vb) const
-	{
-		return vb.Buffers[0] ^ vb.Buffers[1] ^ vb.Buffers[2] ^ vb.Buffers[3] ^ (uintptr_t)vb.Spec;
-	}
-};
+	*outIssued = cb->BindsIssued;
+	*outFiltered = cb->BindsFiltered;
+}
 
-bool operator==(const VertexBuffers& a, const VertexBuffers& b)
+void ResetBindingCounters(CommandBuffer *cb)
 {
-	return !memcmp(&a, &b, sizeof(VertexBuffers));
+	cb->BindsIssued = 0;
+	cb->BindsFiltered = 0;
 }
 
-struct CommandBuffer
+CommandBuffer *CreateDeferredCommandBuffer()
 {
-	std::unordered_map<VertexBuffers, GLuint, VBHash> VAOs;
+	CommandBuffer *cb = new CommandBuffer();
+	cb->Deferred = true;
+	return cb;
+}
 
-	GLenum IndexType;
-	GLuint IndexBuffer;
+void SetVertexBuffers(CommandBuffer *cb, VertexSpec *spec, Buffer **buffers, uint32_t numStreams, const size_t *offsets)
+{
+	if (cb->Deferred)
+	{
+		size_t extra = numStreams * (sizeof(Buffer*) + (offsets ? sizeof(size_t) : 0));
+		CmdSetVertexBuffers *c = RecordCommand<CmdSetVertexBuffers>(cb, extra);
+		*c = { spec, numStreams, offsets != NULL };
+		memcpy(c + 1, buffers, numStreams * sizeof(Buffer*));
+		if (offsets)
+			memcpy((Buffer**)(c + 1) + numStreams, offsets, numStreams * sizeof(size_t));
+		return;
+	}
 
-	RenderStateInfo State;
-};
+	assert(numStreams <= MaxVertexStreams);
 
-CommandBuffer *CreateCommandBuffer()
-{
-	return new CommandBuffer();
+	SyncBindings(cb);
+	BindingCache *bc = &cb->Bindings;
+
+	if (UpdateBinding(cb, &bc->Vao, spec->Vao))
+	{
+		glBindVertexArray(spec->Vao);
+
+		// The index and vertex buffer bindings are part of the VAO
+		bc->IndexBuffer = UnknownBinding;
+		memset(bc->VertexBuffers, 0xff, sizeof(bc->VertexBuffers));
+	}
+
+	GLuint names[MaxVertexStreams];
+	GLintptr bufferOffsets[MaxVertexStreams];
+	bool bound = true;
+	for (uint32_t i = 0; i < numStreams; i++)
+	{
+		names[i] = buffers[i]->Buf;
+		bufferOffsets[i] = offsets ? (GLintptr)offsets[i] : 0;
+		bound = bound && bc->VertexBuffers[i] == names[i] && bc->VertexOffsets[i] == bufferOffsets[i];
+	}
+
+	if (bound)
+	{
+		cb->BindsFiltered++;
+		return;
+	}
+
+	memcpy(bc->VertexBuffers, names, numStreams * sizeof(GLuint));
+	memcpy(bc->VertexOffsets, bufferOffsets, numStreams * sizeof(GLintptr));
+	cb->BindsIssued++;
+
+	glBindVertexBuffers(0, numStreams, names, bufferOffsets, spec->Strides);
 }
 
-GLuint CreateAndBindVao(CommandBuffer *cb, VertexSpec *spec, Buffer **buffers, uint32_t numStreams)
+// `size` 0 binds the whole buffer
+static void BindUniformBuffer(CommandBuffer *cb, uint32_t index, GLuint buf, size_t offset, size_t size)
 {
-	GLuint vao;
-	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
+	SyncBindings(cb);
+	BindingCache *bc = &cb->Bindings;
 
-	for (uint32_t streamI = 0; streamI < numStreams; streamI++)
+	if (index < MaxCachedBufferSlots)
 	{
-		glBindBuffer(GL_ARRAY_BUFFER, buffers[streamI]->Buf);
-
-		for (uint32_t i = 0; i < spec->NumElements; i++)
+		if (bc->UniformBuffers[index] == buf && bc->UniformOffsets[index] == offset && bc->UniformSizes[index] == size)
 		{
-			const VertexElement *e = &spec->Elements[i];
-			if (e->Stream != streamI)
-				continue;
-
-			glEnableVertexAttribArray(e->Index);
-
-			if (GlIntegral[e->Type] && !e->Normalized)
-			{
-				glVertexAttribIPointer(
-						e->Index,
-						e->NumComponents,
-						GlDataType[e->Type],
-						e->Stride,
-						(const GLvoid*)(uintptr_t)e->Offset);
-			}
-			else
-			{
-				glVertexAttribPointer(
-						e->Index,
-						e->NumComponents,
-						GlDataType[e->Type],
-						e->Normalized,
-						e->Stride,
-						(const GLvoid*)(uintptr_t)e->Offset);
-			}
-
-			if (e->Divisor > 0)
-				glVertexAttribDivisor(e->Index, e->Divisor);
+			cb->BindsFiltered++;
+			return;
 		}
+
+		bc->UniformBuffers[index] = buf;
+		bc->UniformOffsets[index] = offset;
+		bc->UniformSizes[index] = size;
 	}
 
-	glBindBuffer(GL_ARRAY_BUFFER, NULL);
-	return vao;
+	cb->BindsIssued++;
+	if (size)
+		glBindBufferRange(GL_UNIFORM_BUFFER, index, buf, offset, size);
+	else
+		glBindBufferBase(GL_UNIFORM_BUFFER, index, buf);
 }
 
-void SetVertexBuffers(CommandBuffer *cb, VertexSpec *spec, Buffer **buffers, uint32_t numStreams)
+void SetUniformBuffer(CommandBuffer *cb, uint32_t index, Buffer *b)
 {
-	VertexBuffers vb = { 0 };
-	for (uint32_t i = 0; i < numStreams; i++)
+	if (cb->Deferred)
 	{
-		vb.Buffers[i] = buffers[i]->Buf;
+		*RecordCommand<CmdSetUniformBuffer>(cb) = { index, b };
+		return;
 	}
-	vb.Spec = spec;
-
-	auto it = cb->VAOs.find(vb);
 
-	if (it == cb->VAOs.end())
-		cb->VAOs[vb] = CreateAndBindVao(cb, spec, buffers, numStreams);
-	else
-		glBindVertexArray(it->second);
+	BindUniformBuffer(cb, index, b->Buf, 0, 0);
 }
 
-void SetUniformBuffer(CommandBuffer *cb, uint32_t index, Buffer *b)
+void PushUniformData(CommandBuffer *cb, uint32_t index, const void *data, size_t size)
 {
-	glBindBufferBase(GL_UNIFORM_BUFFER, index, b->Buf);
+	if (cb->Deferred)
+	{
+		CmdPushUniformData *c = RecordCommand<CmdPushUniformData>(cb, size);
+		*c = { index, size };
+		memcpy(c + 1, data, size);
+		return;
+	}
+
+	UniformRing *r = &g_UniformRing;
+	size_t offset = AllocateUniformData(size);
+	memcpy(r->Ptr + offset, data, size);
+	BindUniformBuffer(cb, index, r->Buf.Buf, offset, size);
 }
 
 void SetStorageBuffer(CommandBuffer *cb, uint32_t index, Buffer *b)
 {
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, index, b->Buf);
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdSetStorageBuffer>(cb) = { index, b };
+		return;
+	}
+
+	SyncBindings(cb);
+	GLuint *cached = index < MaxCachedBufferSlots ? &cb->Bindings.StorageBuffers[index] : NULL;
+	if (UpdateBinding(cb, cached, b->Buf))
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, index, b->Buf);
 }
 
 void SetIndexBuffer(CommandBuffer *cb, Buffer *b, DataType type)
 {
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdSetIndexBuffer>(cb) = { b, type };
+		return;
+	}
+
 	cb->IndexType = GlDataType[type];
-	cb->IndexBuffer = b->Buf;
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, b->Buf);
+
+	SyncBindings(cb);
+	if (UpdateBinding(cb, &cb->Bindings.IndexBuffer, b->Buf))
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, b->Buf);
 }
 
 void DrawArrays(CommandBuffer *cb, DrawType type, uint32_t num, uint32_t indexOffset)
 {
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdDrawArrays>(cb) = { type, num, indexOffset };
+		return;
+	}
+
 	glDrawArrays(GlDrawType[type], indexOffset, num);
 }
 
 void DrawIndexed(CommandBuffer *cb, DrawType type, uint32_t num, uint32_t indexOffset)
 {
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdDrawIndexed>(cb) = { type, num, indexOffset };
+		return;
+	}
+
 	glDrawElements(GlDrawType[type], num, cb->IndexType, (const GLvoid*)(uintptr_t)indexOffset);
 }
 
 void DrawIndexedInstanced(CommandBuffer *cb, DrawType type, uint32_t numInstances, uint32_t num, uint32_t indexOffset)
 {
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdDrawIndexedInstanced>(cb) = { type, numInstances, num, indexOffset };
+		return;
+	}
+
 	glDrawElementsInstanced(GlDrawType[type], num, cb->IndexType, (const GLvoid*)(uintptr_t)indexOffset, numInstances);
 }
 
+void DrawIndexedIndirect(CommandBuffer *cb, DrawType type, Buffer *args, size_t offset)
+{
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdDrawIndexedIndirect>(cb) = { type, args, offset };
+		return;
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, args->Buf);
+	glDrawElementsIndirect(GlDrawType[type], cb->IndexType, (const GLvoid*)(uintptr_t)offset);
+}
+
+void MultiDrawIndexedIndirect(CommandBuffer *cb, DrawType type, Buffer *args, size_t offset, uint32_t numDraws, uint32_t stride)
+{
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdMultiDrawIndexedIndirect>(cb) = { type, args, offset, numDraws, stride };
+		return;
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, args->Buf);
+	glMultiDrawElementsIndirect(GlDrawType[type], cb->IndexType, (const GLvoid*)(uintptr_t)offset, numDraws, stride);
+}
+
 void DispatchCompute(CommandBuffer *cb, uint32_t x, uint32_t y, uint32_t z)
 {
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdDispatchCompute>(cb) = { x, y, z };
+		return;
+	}
+
 	glDispatchCompute(x, y, z);
 }
 
+void DispatchComputeIndirect(CommandBuffer *cb, Buffer *args, size_t offset)
+{
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdDispatchComputeIndirect>(cb) = { args, offset };
+		return;
+	}
+
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, args->Buf);
+	glDispatchComputeIndirect((GLintptr)offset);
+}
+
+void ComputeBarrier(CommandBuffer *cb)
+{
+	if (cb->Deferred)
+	{
+		RecordCommand<CmdComputeBarrier>(cb);
+		return;
+	}
+
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT
+		| GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_UNIFORM_BARRIER_BIT);
+}
+
 const GLenum GlShaderTypes[ShaderTypeCount] = {
 	GL_VERTEX_SHADER,
 	GL_FRAGMENT_SHADER,
@@ -411,6 +1325,7 @@ void DestroyShader(Shader *s)
 		glDeleteProgram(s->Program);
 
 	free(s);
+	g_BindingEpoch++;
 }
 
 Shader *CreateShader(const ShaderSource *sources, uint32_t numSources)
@@ -429,7 +1344,15 @@ Shader *CreateShader(const ShaderSource *sources, uint32_t numSources)
 
 void SetShader(CommandBuffer *cb, Shader *s)
 {
-	glUseProgram(s->Program);
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdSetShader>(cb) = { s };
+		return;
+	}
+
+	SyncBindings(cb);
+	if (UpdateBinding(cb, &cb->Bindings.Program, s->Program))
+		glUseProgram(s->Program);
 }
 
 struct Sampler
@@ -534,6 +1457,7 @@ Texture *CreateStaticTexture2D(const void **data, uint32_t levels, uint32_t widt
 	t->Format = format;
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(t->BindPoint, t->Tex);
+	g_BindingEpoch++;
 
 	uint32_t w = width, h = height;
 	for (uint32_t i = 0; i < levels; i++)
@@ -551,9 +1475,25 @@ Texture *CreateStaticTexture2D(const void **data, uint32_t levels, uint32_t widt
 
 void SetTexture(CommandBuffer *cb, uint32_t index, Texture *tex, Sampler *sm)
 {
-	glActiveTexture(GL_TEXTURE0 + index);
-	glBindTexture(tex->BindPoint, tex->Tex);
-	glBindSampler(index, sm->SamplerObject);
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdSetTexture>(cb) = { index, tex, sm };
+		return;
+	}
+
+	SyncBindings(cb);
+	BindingCache *bc = &cb->Bindings;
+	bool cached = index < MaxCachedTextureSlots;
+
+	if (UpdateBinding(cb, cached ? &bc->Textures[index] : NULL, tex->Tex))
+	{
+		if (UpdateBinding(cb, &bc->ActiveTexture, index))
+			glActiveTexture(GL_TEXTURE0 + index);
+		glBindTexture(tex->BindPoint, tex->Tex);
+	}
+
+	if (UpdateBinding(cb, cached ? &bc->Samplers[index] : NULL, sm->SamplerObject))
+		glBindSampler(index, sm->SamplerObject);
 }
 
 struct Framebuffer
@@ -588,6 +1528,7 @@ Framebuffer *CreateFramebuffer(Texture **color, uint32_t numColor, Texture *dept
 
 	glGenFramebuffers(1, &f->Buf);
 	glBindFramebuffer(GL_FRAMEBUFFER, f->Buf);
+	g_BindingEpoch++;
 
 	glActiveTexture(GL_TEXTURE0);
 	for (uint32_t i = 0; i < numColor; i++)
@@ -629,14 +1570,27 @@ Framebuffer *CreateFramebuffer(Texture **color, uint32_t numColor, Texture *dept
 
 void SetFramebuffer(CommandBuffer *cb, Framebuffer *f)
 {
-	if (f)
-		glBindFramebuffer(GL_FRAMEBUFFER, f->Buf);
-	else
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdSetFramebuffer>(cb) = { f };
+		return;
+	}
+
+	GLuint buf = f ? f->Buf : 0;
+
+	SyncBindings(cb);
+	if (UpdateBinding(cb, &cb->Bindings.Framebuffer, buf))
+		glBindFramebuffer(GL_FRAMEBUFFER, buf);
 }
 
 void Clear(CommandBuffer *cb, const ClearInfo *ci)
 {
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdClear>(cb) = { *ci };
+		return;
+	}
+
 	uint32_t flags = 0;
 
 	if (ci->ClearColor)
@@ -676,6 +1630,12 @@ RenderState *CreateRenderState(const RenderStateInfo *rsi)
 
 void SetRenderState(CommandBuffer *cb, RenderState *r)
 {
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdSetRenderState>(cb) = { r };
+		return;
+	}
+
 	if (r->Info.DepthTest >= RsBoolFalse && r->Info.DepthTest != cb->State.DepthTest)
 	{
 		if (r->Info.DepthTest == RsBoolTrue)
@@ -704,5 +1664,154 @@ void SetRenderState(CommandBuffer *cb, RenderState *r)
 
 void SetFillMode(CommandBuffer *cb, FillMode mode)
 {
+	if (cb->Deferred)
+	{
+		*RecordCommand<CmdSetFillMode>(cb) = { mode };
+		return;
+	}
+
 	glPolygonMode(GL_FRONT_AND_BACK, GlFillMode[mode]);
 }
+
+void SubmitCommandBuffer(CommandBuffer *cb, CommandBuffer *deferred)
+{
+	assert(!cb->Deferred && deferred->Deferred);
+
+	const char *pos = deferred->Stream.data();
+	const char *end = pos + deferred->Stream.size();
+
+	while (pos < end)
+	{
+		const CommandHeader *h = (const CommandHeader*)pos;
+		const void *args = h + 1;
+		pos += h->Size;
+
+		switch (h->Type)
+		{
+		case CommandStartTimer:
+			StartTimer(cb, ((const CmdStartTimer*)args)->T);
+			break;
+		case CommandStopTimer:
+			StopTimer(cb, ((const CmdStopTimer*)args)->T);
+			break;
+		case CommandCopyBufferData:
+		{
+			const CmdCopyBufferData *c = (const CmdCopyBufferData*)args;
+			CopyBufferData(cb, c->Dst, c->Src, c->DstOffset, c->SrcOffset, c->Size);
+			break;
+		}
+		case CommandClearBufferData:
+		{
+			const CmdClearBufferData *c = (const CmdClearBufferData*)args;
+			ClearBufferData(cb, c->B, c->Offset, c->Size);
+			break;
+		}
+		case CommandUploadBufferData:
+		{
+			const CmdUploadBufferData *c = (const CmdUploadBufferData*)args;
+			UploadBufferData(cb, c->B, c + 1, c->Size);
+			break;
+		}
+		case CommandClear:
+			Clear(cb, &((const CmdClear*)args)->Info);
+			break;
+		case CommandSetVertexBuffers:
+		{
+			const CmdSetVertexBuffers *c = (const CmdSetVertexBuffers*)args;
+			Buffer **buffers = (Buffer**)(c + 1);
+			const size_t *offsets = c->HasOffsets ? (const size_t*)(buffers + c->NumStreams) : NULL;
+			SetVertexBuffers(cb, c->Spec, buffers, c->NumStreams, offsets);
+			break;
+		}
+		case CommandSetUniformBuffer:
+		{
+			const CmdSetUniformBuffer *c = (const CmdSetUniformBuffer*)args;
+			SetUniformBuffer(cb, c->Index, c->B);
+			break;
+		}
+		case CommandPushUniformData:
+		{
+			const CmdPushUniformData *c = (const CmdPushUniformData*)args;
+			PushUniformData(cb, c->Index, c + 1, c->Size);
+			break;
+		}
+		case CommandSetStorageBuffer:
+		{
+			const CmdSetStorageBuffer *c = (const CmdSetStorageBuffer*)args;
+			SetStorageBuffer(cb, c->Index, c->B);
+			break;
+		}
+		case CommandSetShader:
+			SetShader(cb, ((const CmdSetShader*)args)->S);
+			break;
+		case CommandSetIndexBuffer:
+		{
+			const CmdSetIndexBuffer *c = (const CmdSetIndexBuffer*)args;
+			SetIndexBuffer(cb, c->B, c->IndexType);
+			break;
+		}
+		case CommandSetTexture:
+		{
+			const CmdSetTexture *c = (const CmdSetTexture*)args;
+			SetTexture(cb, c->Index, c->Tex, c->Sm);
+			break;
+		}
+		case CommandSetFramebuffer:
+			SetFramebuffer(cb, ((const CmdSetFramebuffer*)args)->F);
+			break;
+		case CommandSetRenderState:
+			SetRenderState(cb, ((const CmdSetRenderState*)args)->R);
+			break;
+		case CommandSetFillMode:
+			SetFillMode(cb, ((const CmdSetFillMode*)args)->Mode);
+			break;
+		case CommandDrawArrays:
+		{
+			const CmdDrawArrays *c = (const CmdDrawArrays*)args;
+			DrawArrays(cb, c->Draw, c->Num, c->IndexOffset);
+			break;
+		}
+		case CommandDrawIndexed:
+		{
+			const CmdDrawIndexed *c = (const CmdDrawIndexed*)args;
+			DrawIndexed(cb, c->Draw, c->Num, c->IndexOffset);
+			break;
+		}
+		case CommandDrawIndexedInstanced:
+		{
+			const CmdDrawIndexedInstanced *c = (const CmdDrawIndexedInstanced*)args;
+			DrawIndexedInstanced(cb, c->Draw, c->NumInstances, c->Num, c->IndexOffset);
+			break;
+		}
+		case CommandDrawIndexedIndirect:
+		{
+			const CmdDrawIndexedIndirect *c = (const CmdDrawIndexedIndirect*)args;
+			DrawIndexedIndirect(cb, c->Draw, c->Args, c->Offset);
+			break;
+		}
+		case CommandMultiDrawIndexedIndirect:
+		{
+			const CmdMultiDrawIndexedIndirect *c = (const CmdMultiDrawIndexedIndirect*)args;
+			MultiDrawIndexedIndirect(cb, c->Draw, c->Args, c->Offset, c->NumDraws, c->Stride);
+			break;
+		}
+		case CommandDispatchCompute:
+		{
+			const CmdDispatchCompute *c = (const CmdDispatchCompute*)args;
+			DispatchCompute(cb, c->X, c->Y, c->Z);
+			break;
+		}
+		case CommandDispatchComputeIndirect:
+		{
+			const CmdDispatchComputeIndirect *c = (const CmdDispatchComputeIndirect*)args;
+			DispatchComputeIndirect(cb, c->Args, c->Offset);
+			break;
+		}
+		case CommandComputeBarrier:
+			ComputeBarrier(cb);
+			break;
+		}
+	}
+
+	deferred->Stream.clear();
+}
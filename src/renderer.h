@@ -11,6 +11,8 @@ struct Texture;
 struct Framebuffer;
 struct RenderState;
 struct Timer;
+struct ReadbackBuffer;
+struct StreamBuffer;
 
 enum BufferType
 {
@@ -18,6 +20,7 @@ enum BufferType
 	BufferIndex,
 	BufferUniform,
 	BufferStorage,
+	BufferIndirect,
 };
 
 enum ShaderType
@@ -76,6 +79,17 @@ enum FillMode
 	FillWireframe,
 };
 
+enum LockFlags
+{
+	// The old contents of the locked range can be thrown away
+	LockInvalidateRange = 0x1,
+	// The old contents of the whole buffer can be thrown away
+	LockInvalidateBuffer = 0x2,
+	// Don't wait for commands using the buffer, they must not touch the
+	// locked range
+	LockUnsynchronized = 0x4,
+};
+
 struct VertexElement
 {
 	uint32_t Stream;
@@ -134,22 +148,95 @@ struct RenderStateInfo
 	RsBool BlendEnable;
 };
 
+struct ReadbackRange
+{
+	Buffer *Src;
+	size_t Offset;
+	size_t Size;
+};
+
+// Argument layouts of the indirect commands, usually written by a compute
+// shader. Any buffer can be used, `BufferIndirect` is just for uploads.
+struct DrawIndexedIndirectArgs
+{
+	uint32_t Count;
+	uint32_t NumInstances;
+	uint32_t FirstIndex;
+	int32_t BaseVertex;
+	uint32_t BaseInstance;
+};
+
+struct DispatchIndirectArgs
+{
+	uint32_t X, Y, Z;
+};
+
 RenderState *CreateRenderState(const RenderStateInfo *rsi);
 
-void SetVertexBuffers(CommandBuffer *cb, VertexSpec *spec, Buffer **buffers, uint32_t numStreams);
+// `offsets` are byte offsets added to the elements of each stream, NULL for none.
+void SetVertexBuffers(CommandBuffer *cb, VertexSpec *spec, Buffer **buffers, uint32_t numStreams, const size_t *offsets = NULL);
 
 Buffer *CreateBuffer(BufferType type);
 Buffer *CreateStaticBuffer(BufferType type, const void *data, size_t size);
+// GL keeps the storage alive until the commands using it are done
+void DestroyBuffer(Buffer *b);
 void SetBufferData(Buffer *b, const void *data, size_t size);
+// Overwrites [offset, offset + size) of the buffer, keeps the rest.
+void UpdateBufferData(Buffer *b, size_t offset, const void *data, size_t size);
+// Writes `data` to the start of `b` in order with the other commands of
+// `cb`, reusing the storage if it's big enough. A deferred command buffer
+// copies `data` into its command stream.
+void UploadBufferData(CommandBuffer *cb, Buffer *b, const void *data, size_t size);
+// Makes room for at least `size` bytes and leaves the contents undefined,
+// growing geometrically. `shrink` reallocates to exactly `size` instead.
+// The storage is reused when it's big enough.
 void ReserveUndefinedBuffer(Buffer *b, size_t size, bool shrink);
 
+// Maps the whole buffer for writing, waits for the GPU to finish with it.
 void *LockBuffer(Buffer *b);
+// Maps [offset, offset + size) for writing, see `LockFlags`. NULL if
+// `size` is 0.
+void *LockBufferRange(Buffer *b, size_t offset, size_t size, uint32_t flags);
 void UnlockBuffer(Buffer *b);
 
+// Persistently mapped buffer for data written by the CPU every frame. The
+// storage is split into three regions used in turn, a region is reused
+// only after the GPU is done with the commands issued while it was current.
+StreamBuffer *CreateStreamBuffer(BufferType type);
+
+// Switches to the next region and returns a pointer for writing `size`
+// bytes to it, bind `GetStreamBuffer()` at `*outOffset` to use the data.
+// Commands using the previous region must be recorded before this call.
+void *MapStreamBuffer(StreamBuffer *sb, size_t size, size_t *outOffset);
+Buffer *GetStreamBuffer(StreamBuffer *sb);
+
+// Bytes allocated for buffers, the peak is tracked since the last reset.
+size_t GetBufferMemoryUsage();
+size_t GetPeakBufferMemoryUsage();
+void ResetPeakBufferMemoryUsage();
 
+
+// Creates the VAO for the format, the elements of a stream must share the
+// stride and divisor and `Offset` is relative to the stream.
 VertexSpec *CreateVertexSpec(const VertexElement *el, uint32_t count);
+// Binding calls skip the GL call when the object is already bound.
 CommandBuffer *CreateCommandBuffer();
 
+// Binding calls made to GL and skipped as redundant since the last reset,
+// deferred command buffers count when they are submitted.
+void GetBindingCounters(CommandBuffer *cb, uint64_t *outIssued, uint64_t *outFiltered);
+void ResetBindingCounters(CommandBuffer *cb);
+
+// Records the commands instead of issuing them, so it can be filled on any
+// thread without a GL context. Commands see the state of the command buffer
+// it is submitted to, and a deferred command buffer is only used by one
+// thread at a time. `QueueReadback()` can't be deferred.
+CommandBuffer *CreateDeferredCommandBuffer();
+
+// Replays the commands of `deferred` on `cb` on the GL thread and empties
+// it for recording again.
+void SubmitCommandBuffer(CommandBuffer *cb, CommandBuffer *deferred);
+
 Shader *CreateShader(const ShaderSource *sources, uint32_t numSources);
 void DestroyShader(Shader *s);
 
@@ -161,15 +248,35 @@ Framebuffer *CreateFramebuffer(Texture **color, uint32_t numColor, Texture *dept
 Sampler *CreateSampler(const SamplerInfo *si);
 Sampler *CreateSamplerSimple(FilterMode min, FilterMode mag, FilterMode mip, WrapMode wrap, uint32_t anisotropy);
 
+// Ring of persistently mapped staging buffers for reading GPU data back
+// without waiting for it, every queued readback is guarded by a fence.
+ReadbackBuffer *CreateReadbackBuffer();
+
+// Copies the ranges back to back into the next staging buffer, `tag` is
+// returned with the data. Returns false and skips the readback if all the
+// staging buffers are still in flight.
+bool QueueReadback(CommandBuffer *cb, ReadbackBuffer *rb, const ReadbackRange *ranges, uint32_t numRanges, uint32_t tag);
+
+// Most recent readback the GPU has finished, NULL if none has yet. Never
+// waits, the data stays valid until the next `QueueReadback()`.
+const void *GetReadbackData(ReadbackBuffer *rb, size_t *outSize, uint32_t *outTag);
+
 Timer *CreateTimer();
 double GetTimerMilliseconds(Timer *t);
 
 void StartTimer(CommandBuffer *cb, Timer *t);
 void StopTimer(CommandBuffer *cb, Timer *t);
 void CopyBufferData(CommandBuffer *cb, Buffer *dst, Buffer *src, size_t dstOffset, size_t srcOffset, size_t size);
+// Zeroes `size` bytes from `offset`, both must be multiples of 4.
+void ClearBufferData(CommandBuffer *cb, Buffer *b, size_t offset, size_t size);
 void Clear(CommandBuffer *cb, const ClearInfo *ci);
-void SetVertexBuffers(CommandBuffer *cb, VertexSpec *spec, Buffer **buffers, uint32_t numStreams);
 void SetUniformBuffer(CommandBuffer *cb, uint32_t index, Buffer *b);
+// Copies `data` to a transient uniform ring shared by all the command
+// buffers and binds it to `index`. The data is only valid for the current
+// frame. `EndFrame()` must be called every frame, until then the ring keeps
+// growing to hold everything pushed. Growing moves later pushes to a new
+// buffer, data pushed before stays bound and valid for the rest of the frame.
+void PushUniformData(CommandBuffer *cb, uint32_t index, const void *data, size_t size);
 void SetStorageBuffer(CommandBuffer *cb, uint32_t index, Buffer *b);
 void SetShader(CommandBuffer *cb, Shader *s);
 void SetIndexBuffer(CommandBuffer *cb, Buffer *b, DataType type);
@@ -180,5 +287,19 @@ void SetFillMode(CommandBuffer *cb, FillMode mode);
 void DrawArrays(CommandBuffer *cb, DrawType type, uint32_t num, uint32_t indexOffset);
 void DrawIndexed(CommandBuffer *cb, DrawType type, uint32_t num, uint32_t indexOffset);
 void DrawIndexedInstanced(CommandBuffer *cb, DrawType type, uint32_t numInstances, uint32_t num, uint32_t indexOffset);
+// `offset` is the byte offset of the `DrawIndexedIndirectArgs` in `args`.
+void DrawIndexedIndirect(CommandBuffer *cb, DrawType type, Buffer *args, size_t offset);
+// `stride` 0 means tightly packed.
+void MultiDrawIndexedIndirect(CommandBuffer *cb, DrawType type, Buffer *args, size_t offset, uint32_t numDraws, uint32_t stride);
 void DispatchCompute(CommandBuffer *cb, uint32_t x, uint32_t y, uint32_t z);
+// Reads `DispatchIndirectArgs` from `offset` in `args`, which must be a
+// multiple of 4.
+void DispatchComputeIndirect(CommandBuffer *cb, Buffer *args, size_t offset);
+// Makes storage buffer writes of previous dispatches visible to all
+// following shader, copy, draw and dispatch commands.
+void ComputeBarrier(CommandBuffer *cb);
+
+// Call once per frame after the last command, lets the transient uniform
+// data of the frame be reused once the GPU is done with it. Never deferred.
+void EndFrame(CommandBuffer *cb);
 
@@ -267,19 +267,22 @@ void Render()
 
 	if (QQQ % 100 == 0)
 	{
-		static Particle parts[10000];
-		for (uint32_t i = 0; i < ArrayCount(parts); i++)
-		{
-			parts[i].Position = vec3((float)rand() / (float)RAND_MAX * 5.0f - 2.5f, 4.0f + (float)rand() / (float)RAND_MAX * 2.0f, (float)rand() / (float)RAND_MAX * 5.0f - 2.5f);
-			parts[i].Velocity = vec3(0.0f, 0.0f, 0.0f);
-			parts[i].Lifetime = 10.0f;
-		}
-		ps->SpawnParticles(parts, ArrayCount(parts));
+		// Burst only, the emitter is removed after spawning
+		ParticleEmitter e = { };
+		e.Shape = EmitterBox;
+		e.Position = vec3(0.0f, 5.0f, 0.0f);
+		e.Extent = vec3(2.5f, 1.0f, 2.5f);
+		e.Lifetime = 10.0f;
+		e.Burst = 10000;
+		e.Seed = (uint32_t)QQQ;
+		ps->AddEmitter(e);
 	}
 
 	ps->Update(cb, 0.016f);
 
 	ps->Render(cb, view, proj);
+
+	EndFrame(cb);
 }
 
 #endif
@@ -214,7 +214,7 @@ void Render()
 	size_t requiredSize = numParticles * 4 * sizeof(ParticleVertex);
 	ReserveUndefinedBuffer(g_ParticleBuffer, requiredSize, false);
 
-	ParticleVertex *verts = (ParticleVertex*)LockBuffer(g_ParticleBuffer);
+	ParticleVertex *verts = (ParticleVertex*)LockBufferRange(g_ParticleBuffer, 0, requiredSize, LockInvalidateBuffer);
 
 	static bool wireframe = false, prevW = false;
 
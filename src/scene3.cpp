@@ -8,13 +8,16 @@
 #include <algorithm>
 #include "math.h"
 #include "intersection.h"
+#include "simd.h"
 #include "util.h"
+#include "jobs.h"
 
 extern GLFWwindow *g_Window;
 
 const float Pi = 3.14159265358979323846f;
 
 CommandBuffer *g_CommandBuffer;
+JobPool *g_Jobs;
 
 VertexSpec *g_ObjSpec;
 VertexSpec *g_ReflectorSpec;
@@ -117,6 +120,10 @@ struct Object
 
 	Buffer *LightBuffer;
 	std::vector<VertexReflector> Reflectors;
+	std::vector<Vec3> Light;
+
+	// Recorded by a worker thread every frame
+	CommandBuffer *Commands;
 };
 
 constexpr uint32_t MaxProbeGroups = 32;
@@ -141,9 +148,6 @@ std::vector<LightProbe> g_Probes;
 Object g_Objects[32];
 uint32_t g_NumObjects;
 
-Buffer *g_UniformBuffers[128];
-uint32_t g_UniformIndex;
-
 const uint32_t ReflectorSegments = 16;
 Buffer *g_ReflectorCircleVertices;
 Buffer *g_ReflectorCircleIndices;
@@ -331,6 +335,7 @@ void Initialize()
 	g_QuadSpec = CreateVertexSpec(QuadVertex_Elements, ArrayCount(QuadVertex_Elements));
 
 	g_CommandBuffer = CreateCommandBuffer();
+	g_Jobs = CreateJobPool(0);
 
 
 	{
@@ -341,9 +346,6 @@ void Initialize()
 		g_State = CreateRenderState(&rsi);
 	}
 
-	for (uint32_t i = 0; i < ArrayCount(g_UniformBuffers); i++)
-		g_UniformBuffers[i] = CreateBuffer(BufferUniform);
-
 	g_LineBuffer = CreateBuffer(BufferVertex);
 
 	g_HdrColor = CreateStaticTexture2D(NULL, 1, 1280, 720, TexRGBAF16);
@@ -432,6 +434,7 @@ void Initialize()
 			obj->NumIndices = (uint32_t)indices.size();
 
 			obj->LightBuffer = CreateBuffer(BufferVertex);
+			obj->Commands = CreateDeferredCommandBuffer();
 
 			obj->Reflectors.resize(vertices.size());
 			memset(obj->Reflectors.data(), 0, sizeof(VertexReflector) * obj->Reflectors.size());
@@ -441,6 +444,10 @@ void Initialize()
 		}
 	}
 
+	// Visibility queries test 8 triangles at a time
+	std::vector<TriangleSoa8> triangleBlocks((triangles.size() + 7) / 8);
+	PackTrianglesSoa8(triangles.data(), (uint32_t)triangles.size(), triangleBlocks.data());
+
 	{
 		Vec2 verts[ReflectorSegments + 1];
 		uint16_t indices[ReflectorSegments * 3];
@@ -668,22 +675,8 @@ void Initialize()
 					Vec3 dst = b.Position + b.Normal * 0.01f;
 					float len = length(dst - src);
 					Vec3 dir = normalize(dst - src);
-					bool shadow = false;
 
-					for (Triangle &tri : triangles)
-					{
-						float t;
-						if (IntersectRayvTriangle(src, dir, tri, &t))
-						{
-							if (t > 0.0f && t < len)
-							{
-								shadow = true;
-								break;
-							}
-						}
-					}
-
-					if (shadow)
+					if (IntersectRayvTrianglesAny(src, dir, triangleBlocks.data(), (uint32_t)triangleBlocks.size(), 0.0f, len))
 						continue;
 
 					ReflectorPair pair;
@@ -791,44 +784,63 @@ void Initialize()
 
 	std::vector<std::pair<float, uint32_t> > groupInfluence;
 	groupInfluence.resize(g_ReflectorGroups.size());
+	std::vector<std::pair<uint32_t, float> > candidates;
 	for (uint32_t pI = 0; pI < g_Probes.size(); pI++)
 	{
 		LightProbe &p = g_Probes[pI];
 		for (uint32_t i = 0; i < g_ReflectorGroups.size(); i++)
 			groupInfluence[i] = std::make_pair(0.0f, i);
 
+		candidates.clear();
 		for (uint32_t aI = 0; aI < g_Reflectors.size(); aI++)
 		{
-			Reflector &a = g_Reflectors[aI];
+			float transport = LightTransportDiscPos(g_Reflectors[aI], p.Position);
+			if (transport > 0.001f)
+				candidates.push_back(std::make_pair(aI, transport));
+		}
 
-			float transport = LightTransportDiscPos(a, p.Position);
+		// Trace the rays towards the probe in packets of 8
+		for (uint32_t first = 0; first < candidates.size(); first += 8)
+		{
+			uint32_t num = std::min((uint32_t)candidates.size() - first, 8U);
+			uint32_t active = (1U << num) - 1;
 
-			if (transport > 0.001f)
+			RaySoa8 rays;
+			memset(&rays, 0, sizeof(rays));
+			for (uint32_t i = 0; i < num; i++)
 			{
-				Vec3 src = a.Position;
+				Vec3 src = g_Reflectors[candidates[first + i].first].Position;
 				Vec3 dst = p.Position;
-				float len = length(dst - src);
 				Vec3 dir = normalize(dst - src);
 
-				bool shadow = false;
+				rays.Ox[i] = src.x; rays.Oy[i] = src.y; rays.Oz[i] = src.z;
+				rays.Dx[i] = dir.x; rays.Dy[i] = dir.y; rays.Dz[i] = dir.z;
+				rays.MaxT[i] = length(dst - src) - 0.01f;
+			}
 
-				for (Triangle &tri : triangles)
+			uint32_t shadowed = 0;
+			for (Triangle &tri : triangles)
+			{
+				float t[8];
+				uint32_t mask = IntersectRays8vTriangle(rays, tri, t) & active;
+				for (; mask; mask &= mask - 1)
 				{
-					float t;
-					if (IntersectRayvTriangle(src, dir, tri, &t))
-					{
-						if (t > 0.01f && t < len - 0.01f)
-						{
-							shadow = true;
-							break;
-						}
-					}
+					uint32_t lane = CountTrailingZeros(mask);
+					if (t[lane] > 0.01f)
+						shadowed |= 1U << lane;
 				}
 
-				if (shadow)
+				if (shadowed == active)
+					break;
+			}
+
+			for (uint32_t i = 0; i < num; i++)
+			{
+				if (shadowed & (1U << i))
 					continue;
 
-				groupInfluence[a.Group].first += transport;
+				Reflector &a = g_Reflectors[candidates[first + i].first];
+				groupInfluence[a.Group].first += candidates[first + i].second;
 			}
 		}
 
@@ -850,17 +862,6 @@ void Initialize()
 	}
 }
 
-void PushUniform(CommandBuffer *cb, uint32_t index, const void *data, uint32_t size)
-{
-	uint32_t ix = g_UniformIndex;
-	g_UniformIndex = (g_UniformIndex + 1) % ArrayCount(g_UniformBuffers);
-
-	Buffer *b = g_UniformBuffers[g_UniformIndex];
-	SetBufferData(b, data, size);
-
-	SetUniformBuffer(cb, index, b);
-}
-
 struct ObjectUniform
 {
 	Mat44 u_WorldViewProjection;
@@ -1033,6 +1034,35 @@ void UpdateLight()
 #endif
 }
 
+// Averages the reflector light for the vertices of every object and
+// records the draw to the object's own command buffer.
+void RecordObjects(void *user, uint32_t begin, uint32_t end, uint32_t thread)
+{
+	for (uint32_t objI = begin; objI < end; objI++)
+	{
+		Object *obj = &g_Objects[objI];
+		CommandBuffer *cb = obj->Commands;
+
+		obj->Light.resize(obj->Reflectors.size());
+		for (uint32_t ri = 0; ri < obj->Reflectors.size(); ri++)
+		{
+			VertexReflector &vr = obj->Reflectors[ri];
+			Vec3 total = vec3s(0.0f);
+			for (uint32_t i = 0; i < vr.Count; i++)
+				total += g_Reflectors[vr.Index[i]].TotalLight;
+			obj->Light[ri] = total * (1.0f / (float)vr.Count);
+		}
+		UploadBufferData(cb, obj->LightBuffer, obj->Light.data(), sizeof(Vec3) * obj->Light.size());
+
+		Buffer *streams[2] = { obj->VertexBuffer, obj->LightBuffer };
+		SetVertexBuffers(cb, g_ObjSpec, streams, 2);
+
+		SetIndexBuffer(cb, obj->IndexBuffer, DataUInt16);
+		SetTexture(cb, 0, obj->Texture, g_ObjSampler);
+		DrawIndexed(cb, DrawTriangles, obj->NumIndices, 0);
+	}
+}
+
 void Render()
 {
 	CommandBuffer *cb = g_CommandBuffer;
@@ -1076,31 +1106,11 @@ void Render()
 
 		ObjectUniform ou;
 		ou.u_WorldViewProjection = transpose(view * proj);
-		PushUniform(cb, 0, &ou, sizeof(ou));
+		PushUniformData(cb, 0, &ou, sizeof(ou));
 
+		RunJobRange(g_Jobs, g_NumObjects, 1, &RecordObjects, NULL);
 		for (uint32_t objI = 0; objI < g_NumObjects; objI++)
-		{
-			Object *obj = &g_Objects[objI];
-
-			ReserveUndefinedBuffer(obj->LightBuffer, sizeof(Vec3) * obj->Reflectors.size(), false);
-			Vec3 *light = (Vec3*)LockBuffer(obj->LightBuffer);
-			for (uint32_t ri = 0; ri < obj->Reflectors.size(); ri++)
-			{
-				VertexReflector &vr = obj->Reflectors[ri];
-				Vec3 total = vec3s(0.0f);
-				for (uint32_t i = 0; i < vr.Count; i++)
-					total += g_Reflectors[vr.Index[i]].TotalLight;
-				light[ri] = total * (1.0f / (float)vr.Count);
-			}
-			UnlockBuffer(obj->LightBuffer);
-
-			Buffer *streams[2] = { obj->VertexBuffer, obj->LightBuffer };
-			SetVertexBuffers(cb, g_ObjSpec, streams, 2);
-
-			SetIndexBuffer(cb, obj->IndexBuffer, DataUInt16);
-			SetTexture(cb, 0, obj->Texture, g_ObjSampler);
-			DrawIndexed(cb, DrawTriangles, obj->NumIndices, 0);
-		}
+			SubmitCommandBuffer(cb, g_Objects[objI].Commands);
 	}
 
 	if (renderReflectors)
@@ -1109,7 +1119,7 @@ void Render()
 
 		ReflectorUniform ou;
 		ou.u_ViewProjection = transpose(view * proj);
-		PushUniform(cb, 0, &ou, sizeof(ou));
+		PushUniformData(cb, 0, &ou, sizeof(ou));
 
 		uint32_t palette[3 * 3 * 3];
 		for (uint32_t ix = 0; ix < 3 * 3 * 3; ix++)
@@ -1120,8 +1130,9 @@ void Render()
 			palette[ix] = r | g << 8 | b << 16;
 		}
 
-		ReserveUndefinedBuffer(g_ReflectorBuffer, sizeof(GpuReflector) * g_Reflectors.size(), false);
-		GpuReflector *ref = (GpuReflector*)LockBuffer(g_ReflectorBuffer);
+		size_t reflectorSize = sizeof(GpuReflector) * g_Reflectors.size();
+		ReserveUndefinedBuffer(g_ReflectorBuffer, reflectorSize, false);
+		GpuReflector *ref = (GpuReflector*)LockBufferRange(g_ReflectorBuffer, 0, reflectorSize, LockInvalidateBuffer);
 
 		for (uint32_t i = 0; i < g_Reflectors.size(); i++)
 		{
@@ -1148,7 +1159,7 @@ void Render()
 
 		ProbeUniformGlobal gu;
 		gu.u_ViewProjection = transpose(view * proj);
-		PushUniform(cb, 0, &gu, sizeof(gu));
+		PushUniformData(cb, 0, &gu, sizeof(gu));
 
 		SetVertexBuffers(cb, g_SphereSpec, &g_SphereVertexBuffer, 1);
 		SetIndexBuffer(cb, g_SphereIndexBuffer, DataUInt16);
@@ -1161,7 +1172,7 @@ void Render()
 			for (int band = 0; band < 4; band++)
 				ou.u_SH[band] = vec4(probe.SH[band], 0.0f);
 
-			PushUniform(cb, 1, &ou, sizeof(ou));
+			PushUniformData(cb, 1, &ou, sizeof(ou));
 
 			DrawIndexed(cb, DrawTriangles, SphereNumIndex, 0);
 		}
@@ -1175,10 +1186,11 @@ void Render()
 
 			LineUniform ou;
 			ou.u_ViewProjection = transpose(view * proj);
-			PushUniform(cb, 0, &ou, sizeof(ou));
+			PushUniformData(cb, 0, &ou, sizeof(ou));
 
-			ReserveUndefinedBuffer(g_LineBuffer, sizeof(LineVertex) * g_DebugLines.size(), false);
-			void *ptr = LockBuffer(g_LineBuffer);
+			size_t lineSize = sizeof(LineVertex) * g_DebugLines.size();
+			ReserveUndefinedBuffer(g_LineBuffer, lineSize, false);
+			void *ptr = LockBufferRange(g_LineBuffer, 0, lineSize, LockInvalidateBuffer);
 			memcpy(ptr, g_DebugLines.data(), g_DebugLines.size() * sizeof(LineVertex));
 			UnlockBuffer(g_LineBuffer);
 
@@ -1211,6 +1223,8 @@ void Render()
 		SetIndexBuffer(cb, g_QuadIndices, DataUInt16);
 		DrawIndexed(cb, DrawTriangles, 6, 0);
 	}
+
+	EndFrame(cb);
 }
 
 #endif
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+
+// MSVC allows AVX intrinsics in any function, the caller is responsible
+// for only calling them after checking `CpuSupportsAvx2()`.
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_SSE41
+
+#else
+
+// No "fma", GCC would contract mul+add into fmadd and the AVX2 kernels
+// would no longer round like the SSE and scalar ones.
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#define SIMD_TARGET_SSE41 __attribute__((target("sse4.1")))
+
+#endif
+
+#define SIMD_ALIGN 32
+
+inline bool DetectCpuAvx2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// AVX and OSXSAVE, OS has to save the YMM registers on context switch
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+		return false;
+	if ((_xgetbv(0) & 6) != 6)
+		return false;
+
+	// FMA, AVX2 doesn't imply it and CPUs without it are treated as SSE only
+	if ((info[2] & (1 << 12)) == 0)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	// AVX2 doesn't imply FMA, CPUs without it are treated as SSE only
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+
+inline bool DetectCpuSse41()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 19)) != 0;
+#else
+	return __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+inline bool CpuSupportsAvx2()
+{
+	static const bool supported = DetectCpuAvx2();
+	return supported;
+}
+
+inline bool CpuSupportsSse41()
+{
+	static const bool supported = DetectCpuSse41();
+	return supported;
+}
+
+inline uint32_t CountTrailingZeros(uint32_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (uint32_t)index;
+#else
+	return (uint32_t)__builtin_ctz(mask);
+#endif
+}
+
+inline void *SimdAlloc(size_t size)
+{
+	return _mm_malloc(size, SIMD_ALIGN);
+}
+
+inline void SimdFree(void *ptr)
+{
+	_mm_free(ptr);
+}
+